@@ -27,13 +27,13 @@ int list_service(const char *bucketName) {
   return 0; 
 }
 
-static FILE *outfile;
-int get_buffer(const char *buffer, int bufferLength) {
+int get_buffer(const char *buffer, int bufferLength, void *userdata) {
+  FILE *outfile = (FILE *) userdata;
   return fwrite(buffer, 1, bufferLength, outfile);  
 }
 
-static FILE *infile;
-int put_buffer(char *buffer, int bufferLength) {
+int put_buffer(char *buffer, int bufferLength, void *userdata) {
+  FILE *infile = (FILE *) userdata;
   fprintf(stdout, "put_buffer %d \n", bufferLength);
   return fread(buffer, 1, bufferLength, infile);
 }
@@ -54,7 +54,7 @@ int test() {
   cloud_print_error();
 
   printf("Put object\n");
-  infile = fopen("./README", "rb");
+  FILE *infile = fopen("./README", "rb");
   if(infile == NULL)
   {
     printf("File not found.");
@@ -62,7 +62,7 @@ int test() {
   }
   struct stat stat_buf;
   lstat("./README", &stat_buf);
-  cloud_put_object("test", "helloworld", stat_buf.st_size, put_buffer);
+  cloud_put_object("test", "helloworld", stat_buf.st_size, put_buffer, infile);
   fclose(infile);
   cloud_print_error();
 
@@ -70,8 +70,8 @@ int test() {
   'cloud_list_bucket'("test", list_bucket);
 
   printf("Get object:\n");
-  outfile = fopen("/tmp/README", "wb");
-  cloud_get_object("test", "helloworld", get_buffer);
+  FILE *outfile = fopen("/tmp/README", "wb");
+  cloud_get_object("test", "helloworld", get_buffer, outfile);
   fclose(outfile);
   cloud_print_error();
 
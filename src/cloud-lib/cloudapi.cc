@@ -49,10 +49,30 @@ static const char secretAccessKeyG[16] = "";
 
 
 
-// Request results, saved as globals -------------------------------------------
+// Request results -------------------------------------------------------------
+
+// Every request carries its own status block as the first member of its
+// callback data, so concurrent requests from different FUSE threads never
+// overwrite each other's result. The last result of each thread is kept for
+// cloud_print_error().
+typedef struct request_status {
+    int status;
+    char errorDetails[4096];
+} request_status;
+
+static __thread int statusG = 0;
+static __thread char errorDetailsG[4096] = {0};
+
+static void request_status_init(request_status *rs) {
+    rs->status = S3StatusOK;
+    rs->errorDetails[0] = 0;
+}
 
-static int statusG = 0;
-static char errorDetailsG[4096] = {0};
+static S3Status request_status_finish(const request_status *rs) {
+    statusG = rs->status;
+    snprintf(errorDetailsG, sizeof(errorDetailsG), "%s", rs->errorDetails);
+    return static_cast<S3Status>(rs->status);
+}
 
 // response properties callback ------------------------------------------------
 
@@ -102,36 +122,38 @@ static S3Status responsePropertiesCallback
 // response complete callback ------------------------------------------------
 
 // This callback does the same thing for every request type: saves the status
-// and error stuff in global variables
+// and error stuff in the request_status at the head of the callback data
 static void responseCompleteCallback(S3Status status,
                                      const S3ErrorDetails *error,
                                      void *callbackData) {
-    (void) callbackData;
+    request_status *rs = (request_status *) callbackData;
+    char *errorDetails = rs->errorDetails;
+    size_t detailsSize = sizeof(rs->errorDetails);
 
-    statusG = status;
+    rs->status = status;
     // Compose the error details message now, although we might not use it.
     // Can't just save a pointer to [error] since it's not guaranteed to last
     // beyond this callback
     int len = 0;
     if (error && error->message) {
-        len += snprintf(&(errorDetailsG[len]), sizeof(errorDetailsG) - len,
+        len += snprintf(&(errorDetails[len]), detailsSize - len,
                         "  Message: %s\n", error->message);
     }
     if (error && error->resource) {
-        len += snprintf(&(errorDetailsG[len]), sizeof(errorDetailsG) - len,
+        len += snprintf(&(errorDetails[len]), detailsSize - len,
                         "  Resource: %s\n", error->resource);
     }
     if (error && error->furtherDetails) {
-        len += snprintf(&(errorDetailsG[len]), sizeof(errorDetailsG) - len,
+        len += snprintf(&(errorDetails[len]), detailsSize - len,
                         "  Further Details: %s\n", error->furtherDetails);
     }
     if (error && error->extraDetailsCount) {
-        len += snprintf(&(errorDetailsG[len]), sizeof(errorDetailsG) - len,
+        len += snprintf(&(errorDetails[len]), detailsSize - len,
                         "%s", "  Extra Details:\n");
         int i;
         for (i = 0; i < error->extraDetailsCount; i++) {
-            len += snprintf(&(errorDetailsG[len]),
-                            sizeof(errorDetailsG) - len, "    %s: %s\n",
+            len += snprintf(&(errorDetails[len]),
+                            detailsSize - len, "    %s: %s\n",
                             error->extraDetails[i].name,
                             error->extraDetails[i].value);
         }
@@ -165,6 +187,7 @@ void cloud_print_error() {
 // List Services --------------------------------------------------------------
 
 typedef struct list_service_data {
+    request_status rs;
     list_service_filler_t filler;
 } list_service_data;
 
@@ -183,6 +206,7 @@ static S3Status listServiceCallback(const char *ownerId UNUSED,
 S3Status cloud_list_service(list_service_filler_t filler) {
     list_service_data data;
 
+    request_status_init(&data.rs);
     data.filler = filler;
 
     S3ListServiceHandler listServiceHandler =
@@ -194,11 +218,14 @@ S3Status cloud_list_service(list_service_filler_t filler) {
     S3_list_service(protocolG, accessKeyIdG, secretAccessKeyG, 0, 0,
                     &listServiceHandler, &data);
 
-    return static_cast<S3Status>(statusG);
+    return request_status_finish(&data.rs);
 }
 
 
 S3Status cloud_create_bucket(const char *bucketName) {
+    request_status rs;
+    request_status_init(&rs);
+
     S3ResponseHandler responseHandler =
             {
                     &responsePropertiesCallback, &responseCompleteCallback
@@ -206,24 +233,28 @@ S3Status cloud_create_bucket(const char *bucketName) {
 
     S3_create_bucket(protocolG, accessKeyIdG, secretAccessKeyG,
                      0, bucketName, cannedAcl, 0, 0,
-                     &responseHandler, 0);
-    return static_cast<S3Status>(statusG);
+                     &responseHandler, &rs);
+    return request_status_finish(&rs);
 }
 
 S3Status cloud_delete_bucket(const char *bucketName) {
+    request_status rs;
+    request_status_init(&rs);
+
     S3ResponseHandler responseHandler =
             {
                     &responsePropertiesCallback, &responseCompleteCallback
             };
 
     S3_delete_bucket(protocolG, uriStyleG, accessKeyIdG, secretAccessKeyG,
-                     0, bucketName, 0, &responseHandler, 0);
-    return static_cast<S3Status>(statusG);
+                     0, bucketName, 0, &responseHandler, &rs);
+    return request_status_finish(&rs);
 }
 
 // List bucket ----------------------------------------------------------------
 
 typedef struct list_bucket_callback_data {
+    request_status rs;
     int isTruncated;
     char nextMarker[1024];
     int keyCount;
@@ -286,6 +317,7 @@ S3Status cloud_list_bucket(const char *bucketName, list_bucket_filler_t filler)
 
     const char *prefix = 0, *marker = 0, *delimiter = 0;
     int maxkeys = 0;
+    request_status_init(&data.rs);
     snprintf(data.nextMarker, sizeof(data.nextMarker), "%s", marker);
     data.filler = filler;
 
@@ -293,20 +325,22 @@ S3Status cloud_list_bucket(const char *bucketName, list_bucket_filler_t filler)
         data.isTruncated = 0;
         S3_list_bucket(&bucketContext, prefix, data.nextMarker,
                        delimiter, maxkeys, 0, &listBucketHandler, &data);
-        if (statusG != S3StatusOK) {
+        if (data.rs.status != S3StatusOK) {
             break;
         }
     } while (data.isTruncated);
 
-    return static_cast<S3Status>(statusG);
+    return request_status_finish(&data.rs);
 }
 
 // Put object -----------------------------------------------------------------
 typedef struct put_object_callback_data {
+    request_status rs;
     uint64_t offset;
     uint64_t remainingLength;
     uint64_t contentLength;
     put_filler_t filler;
+    void *userdata;
     int noStatus;
 } put_object_callback_data;
 
@@ -320,7 +354,7 @@ static int putObjectDataCallback(int bufferSize, char *buffer,
     if (data->remainingLength) {
         int toRead = ((data->remainingLength > (unsigned) bufferSize) ?
                       (unsigned) bufferSize : data->remainingLength);
-        ret = data->filler(buffer, toRead);
+        ret = data->filler(buffer, toRead, data->userdata);
     }
 
     data->offset += ret;
@@ -341,7 +375,8 @@ static int putObjectDataCallback(int bufferSize, char *buffer,
 }
 
 S3Status cloud_put_object(const char *bucketName, const char *key,
-                          uint64_t contentLength, put_filler_t filler) {
+                          uint64_t contentLength, put_filler_t filler,
+                          void *userdata) {
 
     S3BucketContext bucketContext =
             {
@@ -374,33 +409,47 @@ S3Status cloud_put_object(const char *bucketName, const char *key,
 
     put_object_callback_data data;
 
+    request_status_init(&data.rs);
     data.offset = 0;
     data.contentLength = data.remainingLength = contentLength;
     data.filler = filler;
+    data.userdata = userdata;
     data.noStatus = 0;
 
     S3_put_object(&bucketContext, key, contentLength, &putProperties, 0,
                   &putObjectHandler, &data);
 
-    return static_cast<S3Status>(statusG);
+    return request_status_finish(&data.rs);
 }
 
 // Get object -----------------------------------------------------------------
 
+typedef struct get_object_callback_data {
+    request_status rs;
+    get_filler_t filler;
+    void *userdata;
+} get_object_callback_data;
+
 static S3Status getObjectDataCallback(int bufferSize, const char *buffer,
                                       void *callbackData) {
-    get_filler_t filler = (get_filler_t) callbackData;
+    get_object_callback_data *data =
+            (get_object_callback_data *) callbackData;
 
-    int wrote = filler(buffer, (uint64_t) bufferSize);
+    int wrote = data->filler(buffer, bufferSize, data->userdata);
 
     return ((wrote < bufferSize) ?
             S3StatusAbortedByCallback : S3StatusOK);
 }
 
 S3Status cloud_get_object(const char *bucketName, const char *key,
-                          get_filler_t filler) {
+                          get_filler_t filler, void *userdata) {
+    return cloud_get_object_range(bucketName, key, 0, 0, filler, userdata);
+}
+
+S3Status cloud_get_object_range(const char *bucketName, const char *key,
+                                uint64_t startByte, uint64_t byteCount,
+                                get_filler_t filler, void *userdata) {
 
-    uint64_t startByte = 0, byteCount = 0;
     int64_t ifModifiedSince = -1, ifNotModifiedSince = -1;
     const char *ifMatch = 0, *ifNotMatch = 0;
 
@@ -428,13 +477,22 @@ S3Status cloud_get_object(const char *bucketName, const char *key,
                     &getObjectDataCallback
             };
 
+    get_object_callback_data data;
+
+    request_status_init(&data.rs);
+    data.filler = filler;
+    data.userdata = userdata;
+
     S3_get_object(&bucketContext, key, &getConditions, startByte,
-                  byteCount, 0, &getObjectHandler, reinterpret_cast<void *>(filler));
+                  byteCount, 0, &getObjectHandler, &data);
 
-    return static_cast<S3Status>(statusG);
+    return request_status_finish(&data.rs);
 }
 
 S3Status cloud_delete_object(const char *bucketName, const char *key) {
+    request_status rs;
+    request_status_init(&rs);
+
     S3BucketContext bucketContext =
             {
                     0,
@@ -451,9 +509,9 @@ S3Status cloud_delete_object(const char *bucketName, const char *key) {
                     &responseCompleteCallback
             };
 
-    S3_delete_object(&bucketContext, key, 0, &responseHandler, 0);
+    S3_delete_object(&bucketContext, key, 0, &responseHandler, &rs);
 
-    return static_cast<S3Status>(statusG);
+    return request_status_finish(&rs);
 }
 
 #endif
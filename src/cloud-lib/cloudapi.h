@@ -4,9 +4,12 @@
 #include "libs3.h"
 
 // Call back functions for read/write objects and list buckets
-typedef int(* put_filler_t) (char *buffer, int bufferLength);
+// The userdata pointer given to cloud_put_object/cloud_get_object is handed
+// back to the filler unchanged, so each request can carry its own state.
+typedef int(* put_filler_t) (char *buffer, int bufferLength, void *userdata);
 
-typedef int(* get_filler_t) (const char *buffer, int bufferLength);
+typedef int(* get_filler_t) (const char *buffer, int bufferLength,
+                             void *userdata);
 
 typedef int(* list_bucket_filler_t) (const char *key, time_t modified_time,
                                      uint64_t size);
@@ -21,6 +24,8 @@ void cloud_destroy();
 
 // Print out return status of libs3 client library to stdout
 // It help show the error message after each libs3 call 
+// The status is tracked per calling thread, so it reports the last request
+// issued by the same thread.
 void cloud_print_error();
 
 // Basic S3 APIs: LIST, PUT, GET, DELETE   
@@ -34,10 +39,17 @@ S3Status cloud_list_bucket(const char *bucketName,
                            list_bucket_filler_t filler);
 
 S3Status cloud_put_object(const char *bucketName, const char *key,
-                          uint64_t contentLength, put_filler_t filler);
+                          uint64_t contentLength, put_filler_t filler,
+                          void *userdata);
 
 S3Status cloud_get_object(const char *bucketName, const char *key,
-                          get_filler_t filler);
+                          get_filler_t filler, void *userdata);
+
+// Fetches byteCount bytes starting at startByte; byteCount 0 means up to the
+// end of the object
+S3Status cloud_get_object_range(const char *bucketName, const char *key,
+                                uint64_t startByte, uint64_t byteCount,
+                                get_filler_t filler, void *userdata);
 
 S3Status cloud_delete_object(const char *bucketName, const char *key);
 
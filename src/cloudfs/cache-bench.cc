@@ -0,0 +1,135 @@
+//
+// Created by Wilson_Xu on 2021/12/07.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <openssl/md5.h>
+#include <time.h>
+
+#include <string>
+#include <vector>
+
+#include "cloudfs.h"
+#include "mycache.h"
+
+void usage(const char *program) {
+    printf("\n");
+    printf("This program times the segment cache index: inserting\n");
+    printf("entries, promoting hits to the head of the LRU list and\n");
+    printf("evicting from its tail, for cache sizes from 1k entries\n");
+    printf("up to <max-entries> in steps of 10x. An eviction also\n");
+    printf("drops the segment from the slab store, and every\n");
+    printf("operation is persisted to the cache journal, as in cloudfs.\n");
+    printf("10M entries need about 3 GB of memory.\n\n");
+    printf("Usage : %s -n <max-entries> -o <ops-per-size> -d <scratch-dir>\n", program);
+    printf("           -p <cache-policy>\n\n");
+}
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static std::string make_key(long i) {
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    char key[2 * MD5_DIGEST_LENGTH + 1];
+    MD5((unsigned char *) &i, sizeof(i), digest);
+    for (int b = 0; b < MD5_DIGEST_LENGTH; b++) {
+        sprintf(key + 2 * b, "%02x", digest[b]);
+    }
+    return std::string(key);
+}
+
+int main(int argc, const char *argv[]) {
+    long max_entries = 10000000;
+    long ops = 1000000;
+    char dir[PATH_MAX] = "/tmp/cache-bench";
+    char policy[16] = "lru";
+
+    int c;
+    while ((c = getopt(argc, (char *const *) argv, "n:o:d:p:")) != -1) {
+        switch (c) {
+            case 'n':
+                max_entries = atol(optarg);
+                break;
+            case 'o':
+                ops = atol(optarg);
+                break;
+            case 'd':
+                strncpy(dir, optarg, sizeof dir - 1);
+                break;
+            case 'p':
+                strncpy(policy, optarg, sizeof policy - 1);
+                break;
+            default:
+                usage(argv[0]);
+                exit(1);
+        }
+    }
+
+    // the cache keeps its master file and slab store under the SSD root
+    struct cloudfs_state state;
+    memset(&state, 0, sizeof(state));
+    snprintf(state.ssd_path, MAX_PATH_LEN, "%s/", dir);
+    std::string sub(state.ssd_path);
+    mkdir(dir, 0755);
+    mkdir((sub + ".master").c_str(), 0755);
+    mkdir((sub + ".cache").c_str(), 0755);
+    std::string master = sub + ".master/cache.master";
+    std::string journal = sub + ".master/cache.journal";
+    unlink(master.c_str());
+    unlink(journal.c_str());
+    state.cache_size = INT_MAX;
+    strcpy(state.cache_policy, policy);
+    mycache_init(stderr, &state);
+
+    std::vector <std::string> keys;
+    keys.reserve(max_entries + ops);
+    for (long i = 0; i < max_entries + ops; i++) {
+        keys.push_back(make_key(i));
+    }
+
+    printf("%12s %14s %14s %14s\n", "entries", "insert ns/op", "hit ns/op", "evict ns/op");
+    srand(1);
+    for (long n = 1000; n <= max_entries; n *= 10) {
+        unlink(master.c_str());
+        unlink(journal.c_str());
+        mycache_rebuild();
+        state.cache_size = INT_MAX;
+
+        double t0 = now_ns();
+        for (long i = 0; i < n; i++) {
+            cache_put(keys[i], 1, 0);
+            mycache_store();
+        }
+        double t1 = now_ns();
+        for (long i = 0; i < ops; i++) {
+            cache_get(keys[((long) rand() * RAND_MAX + rand()) % n]);
+            mycache_store();
+        }
+        double t2 = now_ns();
+        // full cache: every new key pushes the least recently used one out
+        state.cache_size = n;
+        for (long i = 0; i < ops; i++) {
+            cache_put(keys[max_entries + i], 1, 0);
+            mycache_store();
+        }
+        double t3 = now_ns();
+
+        printf("%12ld %14.1f %14.1f %14.1f\n", n, (t1 - t0) / n, (t2 - t1) / ops, (t3 - t2) / ops);
+        fflush(stdout);
+    }
+
+    unlink(master.c_str());
+    unlink(journal.c_str());
+    mycache_rebuild();
+    mycache_destroy();
+    return 0;
+}
@@ -63,6 +63,9 @@
 #include "mydedup.h"
 #include "mycache.h"
 #include "mysnapshot.h"
+#include "mylock.h"
+#include "mymeta.h"
+#include "myrecipe.h"
 #include "snapshot-api.h"
 
 
@@ -105,6 +108,8 @@
 
 #define ON_SSD 0
 #define ON_CLOUD 1
+// fi->fh of a read-only no-dedup open served by ranged gets
+#define REMOTE_FH ((uint64_t) -1)
 #define N_DIRTY 0
 #define DIRTY 1
 #define MAX_SEG_AMOUNT 2048
@@ -127,21 +132,53 @@ static struct cloudfs_state *fstate;
 FILE *logfile;
 static struct fuse_operations cloudfs_operations;
 
-FILE *infile;
-FILE *outfile;
-
-int get_buffer(const char *buffer, int bufferLength) {
-
+int get_buffer(const char *buffer, int bufferLength, void *userdata) {
+    FILE *outfile = (FILE *) userdata;
 //    PF("[%s]get buffer %d\n",__func__, bufferLength);
     return fwrite(buffer, 1, bufferLength, outfile);
 }
 
 
-int put_buffer(char *buffer, int bufferLength) {
+int put_buffer(char *buffer, int bufferLength, void *userdata) {
+    FILE *infile = (FILE *) userdata;
 //    PF("[%s]put buffer %d\n",__func__, bufferLength);
     return fread(buffer, 1, bufferLength, infile);
 }
 
+// Destination of a ranged get: object bytes [off, off + len) land in buf.
+struct range_buffer {
+    char *buf;
+    size_t off;
+    size_t len;
+    size_t pos;     // bytes received so far
+    int whole;      // the server ignored Range and sends the whole object
+};
+
+/*
+ * Takes the body of a ranged get. Up to len bytes are taken to be the range
+ * itself; more than that means the server sent the whole object, and buf is
+ * then filled from the bytes at off on.
+ */
+static int get_buffer_range(const char *buffer, int bufferLength, void *userdata) {
+    struct range_buffer *rb = (struct range_buffer *) userdata;
+    size_t n = bufferLength;
+    if (!rb->whole && rb->pos + n > rb->len) {
+        rb->whole = 1;
+        if (rb->off < rb->pos) {
+            memmove(rb->buf, rb->buf + rb->off, rb->pos - rb->off);
+        }
+    }
+    // position in the body of buf[0]
+    size_t base = rb->whole ? rb->off : 0;
+    size_t from = rb->pos > base ? rb->pos : base;
+    size_t to = rb->pos + n < base + rb->len ? rb->pos + n : base + rb->len;
+    if (from < to) {
+        memcpy(rb->buf + from - base, buffer + from - rb->pos, to - from);
+    }
+    rb->pos += n;
+    return bufferLength;
+}
+
 //char ssd_path[MAX_PATH_LEN];
 //char fuse_path[MAX_PATH_LEN];
 //char hostname[MAX_HOSTNAME_LEN];
@@ -210,6 +247,9 @@ void *cloudfs_init(struct fuse_conn_info *conn UNUSED) {
     char temp_dir_ssd[MAX_PATH_LEN];
 
 
+    mylock_init(fstate->multi_thread);
+    mymeta_init();
+
     cloud_init(state_.hostname);
     cloud_print_error();
 
@@ -224,9 +264,6 @@ void *cloudfs_init(struct fuse_conn_info *conn UNUSED) {
     mkdir(temp_dir_ssd, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
 
 
-    snprintf(temp_dir_ssd, MAX_PATH_LEN, "%s%s", fstate->ssd_path, SEGPROXYDIR);
-    mkdir(temp_dir_ssd, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
-
     snprintf(temp_dir_ssd, MAX_PATH_LEN, "%s%s", fstate->ssd_path, TEMPSEGDIR);
     mkdir(temp_dir_ssd, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
 
@@ -284,6 +321,8 @@ void cloudfs_destroy(void *data UNUSED) {
 
     mydedup_destroy();
     mycache_destroy();
+    mylock_destroy();
+    mymeta_destroy();
 }
 
 void get_path_s(char *full_path, const char *pathname, int bufsize) {
@@ -315,8 +354,14 @@ int cloudfs_ioctl(const char *path, int cmd, void *arg,
         return -1;
     }
     PF("[%s]\n",__func__);
+    // snapshot commands rewrite files behind the back of every other
+    // operation, so none may run meanwhile
+    fs_guard guard;
     if (cmd == CLOUDFS_SNAPSHOT) {
         PF("[%s]cmd == CLOUDFS_SNAPSHOT\n",__func__);
+        if (!fstate->no_dedup) {
+            mydedup_flush_all();
+        }
         timestamp_t ret = mysnap_create();
         if(ret < 0){
 
@@ -442,16 +487,13 @@ int cloudfs_getattr_(const char *pathname, struct stat *statbuf) {
             if (fstate->no_dedup) {
                 get_from_proxy(path_s, statbuf);
             } else {
-                get_from_proxy(path_s, statbuf);
-                std::string md5;
-                std::ifstream proxy(path_s);
-                statbuf->st_size = 0;
-                size_t seg_size = 0;
-                while (proxy >> md5 >> seg_size) {
-                    statbuf->st_size += seg_size;
+                mymeta_get_proxy(path_s, statbuf);
+                off_t size = 0;
+                if (mymeta_get_size(path_s, &size) < 0) {
+                    recipe_size(path_s, &size);
+                    mymeta_set_size(path_s, size, 0);
                 }
-
-                proxy.close();
+                statbuf->st_size = size;
             }
         }
     }
@@ -467,6 +509,9 @@ int cloudfs_getattr_(const char *pathname, struct stat *statbuf) {
 int cloudfs_getattr(const char *pathname, struct stat *statbuf) {
     int ret = 0;
     PF("[%s]:\tpathname %s\n", __func__, pathname);
+    char path_s[MAX_PATH_LEN];
+    get_path_s(path_s, pathname, MAX_PATH_LEN);
+    inode_guard guard(path_s, INODE_LOCK_READ);
 //    if (strcmp(pathname, SNAPSHOTPATH) == 0) {
 ////        int ret;
 ////        char path_s[MAX_PATH_LEN];
@@ -498,8 +543,12 @@ int cloudfs_open(const char *pathname, struct fuse_file_info *fi) {
 //    char path_c[MAX_PATH_LEN];
     get_path_s(path_s, pathname, MAX_PATH_LEN);
 //    chmod_recover(path_s);
+    inode_guard guard(path_s, INODE_LOCK_WRITE);
 
 //    get_path_c(path_c, path_s);
+    if (!fstate->no_dedup) {
+        return mydedup_open(pathname, fi);
+    }
 
     if (is_on_cloud(path_s)) {
         if(fstate->no_dedup){
@@ -508,6 +557,11 @@ int cloudfs_open(const char *pathname, struct fuse_file_info *fi) {
             char path_t[MAX_PATH_LEN];
             get_path_c(path_c, path_s);
             get_path_t(path_t, pathname, MAX_PATH_LEN);
+            if ((fi->flags & O_ACCMODE) == O_RDONLY && access(path_t, F_OK) != 0) {
+                // nothing to stage: reads fetch just the bytes they need
+                fi->fh = REMOTE_FH;
+                return 0;
+            }
             cloud_get(path_t, path_c);
             PF("[%s]:\t get statbuf of %s\n", __func__, path_t);
             struct stat statbuf;
@@ -552,6 +606,7 @@ int cloudfs_opendir(const char *pathname UNUSED, struct fuse_file_info *fi UNUSE
     DIR *d = NULL;
     char path_s[MAX_PATH_LEN];
     get_path_s(path_s, pathname, MAX_PATH_LEN);
+    inode_guard guard(path_s, INODE_LOCK_READ);
     d = opendir(path_s);
     if (!d) {
         return cloudfs_error(__func__);
@@ -569,8 +624,10 @@ int cloudfs_mkdir(const char *pathname, mode_t mode) {
 
     char path_s[MAX_PATH_LEN];
     get_path_s(path_s, pathname, MAX_PATH_LEN);
+    inode_guard guard(path_s, INODE_LOCK_WRITE);
     PF("[mkdir] path_s is %s\n", path_s);
     TRY(mkdir(path_s, mode));
+    mymeta_forget(path_s);
 //    ret = mkdir(path_s, mode);
 //    if (ret < 0) {
 //        return cloudfs_error("mkdir failed");
@@ -588,6 +645,7 @@ int cloudfs_utimens(const char *pathname, const struct timespec tv[2]) {
 
     char path_s[MAX_PATH_LEN];
     get_path_s(path_s, pathname, MAX_PATH_LEN);
+    inode_guard guard(path_s, INODE_LOCK_WRITE);
     PF("[utimens] path_s is %s\n", path_s);
 
     TRY(utimensat(0, path_s, tv, AT_SYMLINK_NOFOLLOW));
@@ -626,6 +684,10 @@ int cloudfs_readdir(const char *pathname UNUSED, void *buf UNUSED, fuse_fill_dir
     get_path_s(ignore8, MASTERDIR, MAX_PATH_LEN);
 
 
+    char path_s[MAX_PATH_LEN];
+    get_path_s(path_s, pathname, MAX_PATH_LEN);
+    inode_guard guard(path_s, INODE_LOCK_READ);
+
     dp = (DIR * )(uintptr_t)
     fi->fh;
     de = readdir(dp);
@@ -681,6 +743,7 @@ int cloudfs_getxattr(const char *pathname, const char *name, char *value,
 //        get_path_s(path_s, SNAPPROXY, MAX_PATH_LEN);
 //    }else{
     get_path_s(path_s, pathname, MAX_PATH_LEN);
+    inode_guard guard(path_s, INODE_LOCK_READ);
 //    }
     PF("[%s] path_s : %s\t name : %s \tsize : %zu\n", __func__, path_s, name, size);
 
@@ -703,40 +766,36 @@ int cloudfs_setxattr(const char *pathname UNUSED, const char *name UNUSED, const
 //        get_path_s(path_s, SNAPPROXY, MAX_PATH_LEN);
 //    }else{
     get_path_s(path_s, pathname, MAX_PATH_LEN);
+    inode_guard guard(path_s, INODE_LOCK_WRITE);
 //    }
     TRY(lsetxattr(path_s, name, value, size, flags));
+    mymeta_forget(path_s);
     return ret;
 }
 
 //0 for ssd
 //1 for cloud
 int set_loc(const char *pathname, int value) {
-    int location = value;
-    int ret;
     PF("[%s]: \tset loc of %s as %d\n", __func__, pathname, value);
-    ret = lsetxattr(pathname, "user.location", &location, sizeof(int), 0);
-    return ret;
+    return mymeta_set_loc(pathname, value);
 }
 
 
 int set_dirty(const char *pathname, int value) {
-    int is_dirty = value;
-    int ret;
     PF("[%s]: \tset isdirty of %s as %d\n", __func__, pathname, value);
-    ret = lsetxattr(pathname, "user.isdirty", &is_dirty, sizeof(int), 0);
-    return ret;
+    return mymeta_set_dirty(pathname, value);
 }
 
 int get_loc(const char *pathname, int *value) {
     int ret;
-    ret = lgetxattr(pathname, "user.location", value, sizeof(int));
+    ret = mymeta_get_loc(pathname, value);
     PF("[%s]: \t%s loc is %d\n", __func__, pathname, *value);
     return ret;
 }
 
 int get_dirty(const char *pathname, int *value) {
     int ret;
-    ret = lgetxattr(pathname, "user.isdirty", value, sizeof(int));
+    ret = mymeta_get_dirty(pathname, value);
     PF("[%s]: \t%s isdirty is %d\n", __func__, pathname, *value);
     return ret;
 }
@@ -749,7 +808,9 @@ int cloudfs_mknod(const char *pathname, mode_t mode UNUSED, dev_t dev UNUSED) {
     int ret = 0;
     char path_s[MAX_PATH_LEN];
     get_path_s(path_s, pathname, MAX_PATH_LEN);
+    inode_guard guard(path_s, INODE_LOCK_WRITE);
     TRY(mknod(path_s, mode, dev));
+    mymeta_forget(path_s);
     //set as not dirty and on ssd
     RUN_M(set_loc(path_s, ON_SSD));
     RUN_M(set_dirty(path_s, N_DIRTY));
@@ -768,6 +829,22 @@ int cloudfs_read_node(const char *pathname, char *buf, size_t size, off_t offset
     char path_s[MAX_PATH_LEN];
     get_path_s(path_s, pathname, MAX_PATH_LEN);
 
+    if (fi->fh == REMOTE_FH) {
+        struct stat statbuf;
+        if (get_from_proxy(path_s, &statbuf) < 0) {
+            return cloudfs_error(__func__);
+        }
+        if (offset >= statbuf.st_size) {
+            return 0;
+        }
+        if (offset + (off_t) size > statbuf.st_size) {
+            size = statbuf.st_size - offset;
+        }
+        char path_c[MAX_PATH_LEN];
+        get_path_c(path_c, path_s);
+        return cloud_get_range(path_c, offset, buf, size);
+    }
+
     PF("[%s]:\t pread(fd: %d)\t file is %s\n", __func__, fi->fh, path_s);
     TRY(pread(fi->fh, buf, size, offset));
     return ret;
@@ -914,6 +991,9 @@ int cloudfs_read(const char *pathname UNUSED, char *buf UNUSED, size_t size UNUS
 //        return 0;
 //    }
     size_t ret = 0;
+    char path_s[MAX_PATH_LEN];
+    get_path_s(path_s, pathname, MAX_PATH_LEN);
+    inode_guard guard(path_s, INODE_LOCK_READ);
     if (fstate->no_dedup) {
         ret = cloudfs_read_node(pathname, buf, size, offset, fi);
         PF("[OUTPUT] cloudfs_read, %s, buf, %zu, %zu return %d\n", pathname, size, offset, ret);
@@ -1114,6 +1194,7 @@ int cloudfs_write(const char *pathname UNUSED, const char *buf UNUSED, size_t si
     char path_s[MAX_PATH_LEN];
     get_path_s(path_s, pathname, MAX_PATH_LEN);
 //    chmod_recover(path_s);
+    inode_guard guard(path_s, INODE_LOCK_WRITE);
 
     struct stat statbuf;
     lstat(path_s, &statbuf);
@@ -1164,8 +1245,8 @@ int cloudfs_release2(const char *pathname UNUSED, struct fuse_file_info *fi UNUS
 
 void cloud_put(const char *path_s, const char *path_c, long size) {
 
-    infile = FFOPEN__(path_s, "rb");
-    cloud_put_object(BUCKET, path_c, size, put_buffer);
+    FILE *infile = FFOPEN__(path_s, "rb");
+    cloud_put_object(BUCKET, path_c, size, put_buffer, infile);
     cloud_print_error();
 
     PF("[%s]:\t put %s on cloud with key:[%s], size : %zu\n", __func__, path_s, path_c, size);
@@ -1205,8 +1286,8 @@ void cloud_put(const char *path_s, const char *path_c, long size) {
 
 void cloud_put_old(char *path_s, char *path_c, struct stat *statbuf_p) {
 
-    infile = FFOPEN__(path_s, "rb");
-    cloud_put_object(BUCKET, path_c, statbuf_p->st_size, put_buffer);
+    FILE *infile = FFOPEN__(path_s, "rb");
+    cloud_put_object(BUCKET, path_c, statbuf_p->st_size, put_buffer, infile);
     cloud_print_error();
 
     PF("[%s]:\t put %s on cloud with key:[%s], size : %zu\n", __func__, path_s, path_c, statbuf_p->st_size);
@@ -1246,8 +1327,8 @@ void cloud_put_old(char *path_s, char *path_c, struct stat *statbuf_p) {
 void cloud_get(const char *path_s, const char *path_c) {
 
     PF("[%s]:\t path_s = [%s]\n", __func__, path_s);
-    outfile = FFOPEN__(path_s, "wb");
-    cloud_get_object(BUCKET, path_c, get_buffer);
+    FILE *outfile = FFOPEN__(path_s, "wb");
+    cloud_get_object(BUCKET, path_c, get_buffer, outfile);
     cloud_print_error();
     PF("[%s]:\t get %s(FD:%d) from cloud with key:[%s]\n", __func__, path_s, outfile, path_c);
     PF("[%s]:\t return\n", __func__);
@@ -1268,64 +1349,41 @@ void cloud_get(const char *path_s, const char *path_c) {
 //    FFCLOSE__(fp);
 }
 
+/*
+ * Reads len bytes at offset off of object path_c into buf without touching
+ * the SSD. The range has to lie within the object, which is also how a
+ * server that ignores Range is told apart. Returns the number of bytes read
+ * or -EIO.
+ */
+int cloud_get_range(const char *path_c, size_t off, char *buf, size_t len) {
+    struct range_buffer rb = {buf, off, len, 0, 0};
+    S3Status status = cloud_get_object_range(BUCKET, path_c, off, len, get_buffer_range, &rb);
+    cloud_print_error();
+    if (status != S3StatusOK) {
+        return -EIO;
+    }
+    size_t copied = rb.pos < rb.len ? rb.pos : rb.len;
+    if (rb.whole) {
+        copied = rb.pos <= off ? 0 : rb.pos - off < len ? rb.pos - off : len;
+    }
+    PF("[%s]:\t got %zu bytes at %zu from cloud with key:[%s]\n", __func__, copied, off, path_c);
+    return copied;
+}
+
 
 int clone_2_proxy(char *path_s, struct stat *statbuf_p) {
     PF("[%s]: save attr to %s\n", __func__, path_s);
-    int ret = 0;
-//    struct stat {
-//        dev_t     st_dev;         /* ID of device containing file */
-//        ino_t     st_ino;         /* Inode number */
-//        mode_t    st_mode;        /* File type and mode */
-//        nlink_t   st_nlink;       /* Number of hard links */
-//        uid_t     st_uid;         /* User ID of owner */
-//        gid_t     st_gid;         /* Group ID of owner */
-//        dev_t     st_rdev;        /* Device ID (if special file) */
-//        off_t     st_size;        /* Total size, in bytes */
-//        blksize_t st_blksize;     /* Block size for filesystem I/O */
-//        blkcnt_t  st_blocks;      /* Number of 512B blocks allocated */
-    TRY(lsetxattr(path_s, "user.st_dev", &statbuf_p->st_dev, sizeof(dev_t), 0));
-    TRY(lsetxattr(path_s, "user.st_ino", &statbuf_p->st_ino, sizeof(ino_t), 0));
-//    TRY(lsetxattr(path_s, "user.st_mode", &statbuf_p->st_mode, sizeof(mode_t), 0));
-    TRY(lsetxattr(path_s, "user.st_nlink", &statbuf_p->st_nlink, sizeof(nlink_t), 0));
-    TRY(lsetxattr(path_s, "user.st_uid", &statbuf_p->st_uid, sizeof(uid_t), 0));
-    TRY(lsetxattr(path_s, "user.st_gid", &statbuf_p->st_gid, sizeof(gid_t), 0));
-    TRY(lsetxattr(path_s, "user.st_rdev", &statbuf_p->st_rdev, sizeof(dev_t), 0));
-    TRY(lsetxattr(path_s, "user.st_size", &statbuf_p->st_size, sizeof(off_t), 0));
-
     PF("[%s]: save size = %zu to %s\n", __func__, statbuf_p->st_size, path_s);
-    TRY(lsetxattr(path_s, "user.st_blksize", &statbuf_p->st_blksize, sizeof(blksize_t), 0));
-    TRY(lsetxattr(path_s, "user.st_blocks", &statbuf_p->st_blocks, sizeof(blkcnt_t), 0));
+    int ret = 0;
+    TRY(mymeta_set_proxy(path_s, statbuf_p));
     return ret;
 }
 
 int get_from_proxy(const char *path_s, struct stat *statbuf_p) {
     int ret = 0;
-//    struct stat {
-//        dev_t     st_dev;         /* ID of device containing file */
-//        ino_t     st_ino;         /* Inode number */
-//        mode_t    st_mode;        /* File type and mode */
-//        nlink_t   st_nlink;       /* Number of hard links */
-//        uid_t     st_uid;         /* User ID of owner */
-//        gid_t     st_gid;         /* Group ID of owner */
-//        dev_t     st_rdev;        /* Device ID (if special file) */
-//        off_t     st_size;        /* Total size, in bytes */
-//        blksize_t st_blksize;     /* Block size for filesystem I/O */
-//        blkcnt_t  st_blocks;      /* Number of 512B blocks allocated */
     lstat(path_s, statbuf_p);
-    TRY(lgetxattr(path_s, "user.st_dev", &statbuf_p->st_dev, sizeof(dev_t)));
-    TRY(lgetxattr(path_s, "user.st_ino", &statbuf_p->st_ino, sizeof(ino_t)));
-//    TRY(lgetxattr(path_s, "user.st_mode", &statbuf_p->st_mode, sizeof(mode_t)));
-    TRY(lgetxattr(path_s, "user.st_nlink", &statbuf_p->st_nlink, sizeof(nlink_t)));
-    TRY(lgetxattr(path_s, "user.st_uid", &statbuf_p->st_uid, sizeof(uid_t)));
-    TRY(lgetxattr(path_s, "user.st_gid", &statbuf_p->st_gid, sizeof(gid_t)));
-    TRY(lgetxattr(path_s, "user.st_rdev", &statbuf_p->st_rdev, sizeof(dev_t)));
-    TRY(lgetxattr(path_s, "user.st_size", &statbuf_p->st_size, sizeof(off_t)));
-
-
+    TRY(mymeta_get_proxy(path_s, statbuf_p));
     PF("[%s]: get size = %zu from %s\n", __func__, statbuf_p->st_size, path_s);
-//    fprintf(logfile, "[%s]: setting %s has mode :%zu\n", __func__, path_s, statbuf_p->st_mode);
-    TRY(lgetxattr(path_s, "user.st_blksize", &statbuf_p->st_blksize, sizeof(blksize_t)));
-    TRY(lgetxattr(path_s, "user.st_blocks", &statbuf_p->st_blocks, sizeof(blkcnt_t)));
     return ret;
 }
 
@@ -1345,6 +1403,9 @@ int cloudfs_release_node(const char *pathname UNUSED, struct fuse_file_info *fi
        path_t);
 //    size_t size_f = 0;
 
+    if (fi->fh == REMOTE_FH) {
+        return 0;
+    }
 
     if (close(fi->fh) < 0) {
         return cloudfs_error("release failed");
@@ -1460,11 +1521,26 @@ int cloudfs_release_node(const char *pathname UNUSED, struct fuse_file_info *fi
 int cloudfs_release_de(const char *pathname UNUSED, struct fuse_file_info *fi UNUSED) {
     PF("[%s]:\t pathname: %s\n", __func__, pathname);
     INFOF();
+    return mydedup_release(pathname, fi);
 
 }
 
+int cloudfs_flush(const char *pathname UNUSED, struct fuse_file_info *fi UNUSED) {
+    int ret = 0;
+    char path_s[MAX_PATH_LEN];
+    get_path_s(path_s, pathname, MAX_PATH_LEN);
+    inode_guard guard(path_s, INODE_LOCK_WRITE);
+    if (!fstate->no_dedup) {
+        ret = mydedup_flush(pathname, fi);
+    }
+    return ret;
+}
+
 int cloudfs_release(const char *pathname UNUSED, struct fuse_file_info *fi UNUSED) {
     int ret = 0;
+    char path_s[MAX_PATH_LEN];
+    get_path_s(path_s, pathname, MAX_PATH_LEN);
+    inode_guard guard(path_s, INODE_LOCK_WRITE);
     if (fstate->no_dedup) {
         ret = cloudfs_release_node(pathname, fi);
     } else {
@@ -1482,6 +1558,7 @@ int cloudfs_access(const char *pathname UNUSED, int mask UNUSED) {
     int ret = 0;
     char path_s[MAX_PATH_LEN];
     get_path_s(path_s, pathname, MAX_PATH_LEN);
+    inode_guard guard(path_s, INODE_LOCK_READ);
 
 
     TRY(access(path_s, mask));
@@ -1525,6 +1602,7 @@ int cloudfs_chmod(const char *pathname UNUSED, mode_t mode UNUSED) {
 
     char path_s[MAX_PATH_LEN];
     get_path_s(path_s, pathname, MAX_PATH_LEN);
+    inode_guard guard(path_s, INODE_LOCK_WRITE);
 
     if (is_on_cloud(path_s)) {
         fprintf(logfile, "[%s]: path_s: %s is on cloud\n", __func__, path_s);
@@ -1572,6 +1650,7 @@ int cloudfs_rmdir(const char *pathname UNUSED) {
 
     char path_s[MAX_PATH_LEN];
     get_path_s(path_s, pathname, MAX_PATH_LEN);
+    inode_guard guard(path_s, INODE_LOCK_WRITE);
     PF("[utimens] path_s is %s\n", path_s);
 
     ret = rmdir(path_s);
@@ -1590,11 +1669,20 @@ int cloudfs_rmdir(const char *pathname UNUSED) {
 
 int cloudfs_unlink(const char *pathname UNUSED) {
     int ret = 0;
+    char path_s[MAX_PATH_LEN];
+    get_path_s(path_s, pathname, MAX_PATH_LEN);
+    inode_guard guard(path_s, INODE_LOCK_WRITE);
+    // the name is gone afterwards, and with the last one the inode number
+    struct stat statbuf;
+    int known = lstat(path_s, &statbuf) == 0;
     if (fstate->no_dedup) {
         ret = cloudfs_unlink_node(pathname);
     } else {
         ret = mydedup_unlink(pathname);
     }
+    if (known) {
+        mymeta_forget_ino(statbuf.st_ino);
+    }
     return ret;
 }
 
@@ -1664,6 +1752,9 @@ int cloudfs_truncate_node(const char *pathname UNUSED, off_t newsize UNUSED) {
 
 int cloudfs_truncate(const char *pathname UNUSED, off_t newsize UNUSED) {
     int ret = 0;
+    char path_s[MAX_PATH_LEN];
+    get_path_s(path_s, pathname, MAX_PATH_LEN);
+    inode_guard guard(path_s, INODE_LOCK_WRITE);
     if (fstate->no_dedup) {
         ret = cloudfs_truncate_node(pathname, newsize);
     } else {
@@ -1683,6 +1774,7 @@ int cloudfs_link(const char *pathname UNUSED, const char *newpath UNUSED) {
     char path_s_n[MAX_PATH_LEN];
     get_path_s(path_s, pathname, MAX_PATH_LEN);
     get_path_s(path_s_n, newpath, MAX_PATH_LEN);
+    inode_guard guard(path_s, INODE_LOCK_WRITE);
     if (is_on_cloud(path_s)) {
         fprintf(logfile, "[%s]:\tpath_s:%s is on cloud\n", __func__, path_s);
     } else {
@@ -1696,6 +1788,7 @@ int cloudfs_link(const char *pathname UNUSED, const char *newpath UNUSED) {
 
     }
     TRY(link(path_s, path_s_n));
+    mymeta_forget(path_s);
     return ret;
 
 
@@ -1735,6 +1828,7 @@ int cloudfs_symlink(const char *pathname UNUSED, const char *newpath UNUSED) {
 
     char path_s_n[MAX_PATH_LEN];
     get_path_s(path_s_n, newpath, MAX_PATH_LEN);
+    inode_guard guard(path_s_n, INODE_LOCK_WRITE);
     if (is_on_cloud(path_s_n)) {
         fprintf(logfile, "[%s]:\tpath_s_n:%s is on cloud\n", __func__, path_s_n);
     } else {
@@ -1746,6 +1840,7 @@ int cloudfs_symlink(const char *pathname UNUSED, const char *newpath UNUSED) {
     if (ret == -1) {
         return -errno;
     }
+    mymeta_forget(path_s_n);
 
     return 0;
 
@@ -1785,6 +1880,7 @@ int cloudfs_readlink(const char *pathname UNUSED, char *buf UNUSED, size_t bufsi
 
     char path_s[MAX_PATH_LEN];
     get_path_s(path_s, pathname, MAX_PATH_LEN);
+    inode_guard guard(path_s, INODE_LOCK_READ);
     PF("[utimens] path_s is %s\n", path_s);
 
     ret = readlink(path_s, buf, bufsize);
@@ -1837,6 +1933,7 @@ int cloudfs_start(struct cloudfs_state *state,
     cloudfs_operations.mknod = cloudfs_mknod;
     cloudfs_operations.read = cloudfs_read;
     cloudfs_operations.write = cloudfs_write;
+    cloudfs_operations.flush = cloudfs_flush;
     cloudfs_operations.release = cloudfs_release;
     cloudfs_operations.init = cloudfs_init;
     cloudfs_operations.access = cloudfs_access;
@@ -1855,8 +1952,10 @@ int cloudfs_start(struct cloudfs_state *state,
     strcpy(argv[argc++], fuse_runtime_name);
     argv[argc] = (char *) malloc(strlen(state->fuse_path) + 1);
     strcpy(argv[argc++], state->fuse_path);
-    argv[argc] = (char *) malloc(strlen("-s") + 1);
-    strcpy(argv[argc++], "-s"); // set the fuse mode to single thread
+    if (!state->multi_thread) {
+        argv[argc] = (char *) malloc(strlen("-s") + 1);
+        strcpy(argv[argc++], "-s"); // set the fuse mode to single thread
+    }
     // argv[argc] = (char *) malloc(sizeof("-f") * sizeof(char));
     // argv[argc++] = "-f"; // run fuse in foreground
 
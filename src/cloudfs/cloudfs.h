@@ -15,16 +15,21 @@ struct cloudfs_state {
     int min_seg_size;
     int max_seg_size;
     int cache_size;
+    char cache_policy[16];
+    char cache_admission;
+    int mem_cache_size;
+    int scan_threshold;
     int rabin_window_size;
+    char chunker[16];
+    int ingest_threads;
+    char ingest_regions;
     char no_dedup;
+    char multi_thread;
 };
 
-extern FILE *infile;
-extern FILE *outfile;
+int get_buffer(const char *buffer, int bufferLength, void *userdata);
 
-int get_buffer(const char *buffer, int bufferLength);
-
-int put_buffer(char *buffer, int bufferLength);
+int put_buffer(char *buffer, int bufferLength, void *userdata);
 
 int cloudfs_start(struct cloudfs_state *state,
                   const char *fuse_runtime_name);
@@ -51,11 +56,9 @@ void cloud_put(const char *path_s, const char *path_c, long size);
 
 void cloud_get(const char *path_s, const char *path_c);
 
-bool is_on_cloud(char *pathname);
-
-int put_buffer(char *buffer, int bufferLength);
+int cloud_get_range(const char *path_c, size_t off, char *buf, size_t len);
 
-int get_buffer(const char *buffer, int bufferLength);
+bool is_on_cloud(char *pathname);
 
 int cloudfs_read_de(const char *pathname, char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
 
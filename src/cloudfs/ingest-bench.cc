@@ -0,0 +1,216 @@
+//
+// Created by Wilson_Xu on 2021/12/13.
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <openssl/md5.h>
+#include <time.h>
+
+#include <string>
+#include <vector>
+
+#include "dedup.h"
+#include "mychunker.h"
+
+#define BUF_SIZE (1024)
+
+void usage(const char *program) {
+    printf("\n");
+    printf("This program times segmenting one large file the way a\n");
+    printf("file migrating to the cloud is: first with the serial loop\n");
+    printf("of mydedup_segmentation (1 KB reads, chunk, MD5), then with\n");
+    printf("the chunk-and-hash pipeline for 1, 2, 4, ... <max-threads>\n");
+    printf("threads, chunking on one thread and then in regions, and\n");
+    printf("checks that every run gives the same segments.\n");
+    printf("Without -f a file of <size-MB> random bytes is made in /tmp.\n\n");
+    printf("Usage : %s [-f <file>] -s <size-MB> -t <max-threads>\n", program);
+    printf("           -e <rabin|gear> -r <rounds>\n\n");
+}
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static rabinpoly_t *chunker_new(int engine) {
+    return rabin_init_engine(engine, 48, 4096, 3072, 6144);
+}
+
+static int serial_segments(int fd, int engine, std::vector <std::string> &keys) {
+    rabinpoly_t *rp = chunker_new(engine);
+    MD5_CTX ctx;
+    unsigned char md5[MD5_DIGEST_LENGTH];
+    char md5string[2 * MD5_DIGEST_LENGTH + 1];
+    char buf[BUF_SIZE];
+    int bytes, new_segment = 0;
+    long segment_len = 0;
+
+    lseek(fd, 0, SEEK_SET);
+    MD5_Init(&ctx);
+    while ((bytes = read(fd, buf, sizeof buf)) > 0) {
+        char *buftoread = buf;
+        int len;
+        while (bytes > 0 && (len = rabin_segment_next(rp, buftoread, bytes, &new_segment)) > 0) {
+            MD5_Update(&ctx, buftoread, len);
+            segment_len += len;
+            if (new_segment) {
+                MD5_Final(md5, &ctx);
+                for (int b = 0; b < MD5_DIGEST_LENGTH; b++) {
+                    sprintf(md5string + b * 2, "%02x", md5[b]);
+                }
+                keys.push_back(md5string);
+                MD5_Init(&ctx);
+                segment_len = 0;
+            }
+            buftoread += len;
+            bytes -= len;
+        }
+    }
+    if (segment_len > 0) {
+        MD5_Final(md5, &ctx);
+        for (int b = 0; b < MD5_DIGEST_LENGTH; b++) {
+            sprintf(md5string + b * 2, "%02x", md5[b]);
+        }
+        keys.push_back(md5string);
+    }
+    rabin_free(&rp);
+    return 0;
+}
+
+static int pipeline_segments(int fd, off_t size, int engine, std::vector <std::string> &keys) {
+    rabinpoly_t *rp = chunker_new(engine);
+    std::vector <seg_info_p> segs;
+    int ret = chunker_segment_fd(fd, size, rp, segs);
+    for (size_t i = 0; i < segs.size(); i++) {
+        keys.push_back(segs[i]->md5);
+        free(segs[i]);
+    }
+    rabin_free(&rp);
+    return ret;
+}
+
+int main(int argc, const char *argv[]) {
+    char fname[PATH_MAX] = {0};
+    long size_mb = 512;
+    int max_threads = 8;
+    int rounds = 3;
+    char engine_name[16] = "rabin";
+
+    int c;
+    while ((c = getopt(argc, (char *const *) argv, "f:s:t:e:r:")) != -1) {
+        switch (c) {
+            case 'f':
+                strncpy(fname, optarg, sizeof fname - 1);
+                break;
+            case 's':
+                size_mb = atol(optarg);
+                break;
+            case 't':
+                max_threads = atoi(optarg);
+                break;
+            case 'e':
+                strncpy(engine_name, optarg, sizeof engine_name - 1);
+                break;
+            case 'r':
+                rounds = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                exit(1);
+        }
+    }
+    int engine = dedup_engine_find(engine_name);
+    if (engine < 0 || rounds <= 0) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    bool scratch = !fname[0];
+    if (scratch) {
+        snprintf(fname, sizeof fname, "/tmp/ingest-bench.%d", getpid());
+        int fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            fprintf(stderr, "cannot create %s: %s\n", fname, strerror(errno));
+            exit(1);
+        }
+        std::vector<char> block(1 << 20);
+        srand(1);
+        for (long i = 0; i < size_mb; i++) {
+            for (size_t k = 0; k < block.size(); k++) {
+                block[k] = rand();
+            }
+            if (write(fd, block.data(), block.size()) != (ssize_t) block.size()) {
+                fprintf(stderr, "cannot write %s: %s\n", fname, strerror(errno));
+                exit(1);
+            }
+        }
+        close(fd);
+    }
+    int fd = open(fname, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "cannot open %s: %s\n", fname, strerror(errno));
+        exit(1);
+    }
+    double mb = st.st_size / 1048576.0;
+
+    printf("%.1f MB, %s engine, best of %d rounds, page cache warm\n", mb, engine_name, rounds);
+    printf("%-10s %10s %10s %10s\n", "threads", "MB/s", "regions", "segments");
+
+    std::vector <std::string> ref;
+    double best = 0;
+    for (int r = 0; r < rounds; r++) {
+        ref.clear();
+        double t0 = now_sec();
+        serial_segments(fd, engine, ref);
+        double t1 = now_sec();
+        if (r == 0 || t1 - t0 < best) {
+            best = t1 - t0;
+        }
+    }
+    printf("%-10s %10.1f %10s %10zu\n", "serial", mb / best, "", ref.size());
+
+    for (int regions = 0; regions <= 1; regions++) {
+        for (int threads = 1; threads <= max_threads; threads *= 2) {
+            // the caller works too, so one thread means no worker at all
+            int ret = chunker_init(threads, regions);
+            if (ret < 0) {
+                fprintf(stderr, "cannot start %d threads: %s\n", threads, strerror(-ret));
+                exit(1);
+            }
+            std::vector <std::string> keys;
+            for (int r = 0; r < rounds; r++) {
+                keys.clear();
+                double t0 = now_sec();
+                ret = pipeline_segments(fd, st.st_size, engine, keys);
+                double t1 = now_sec();
+                if (ret < 0) {
+                    fprintf(stderr, "segmenting failed: %s\n", strerror(-ret));
+                    exit(1);
+                }
+                if (r == 0 || t1 - t0 < best) {
+                    best = t1 - t0;
+                }
+            }
+            chunker_destroy();
+            printf("%-10d %10.1f %10s %10zu%s\n", threads, mb / best, regions ? "yes" : "no", keys.size(),
+                   keys == ref ? "" : "  segments differ from the serial loop");
+            fflush(stdout);
+        }
+    }
+
+    close(fd);
+    if (scratch) {
+        unlink(fname);
+    }
+    return 0;
+}
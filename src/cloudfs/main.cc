@@ -4,6 +4,8 @@
 #include <string.h>
 #include <strings.h>
 #include "cloudfs.h"
+#include "dedup.h"
+#include "mypolicy.h"
 
 
 static void usageExit(FILE *out)
@@ -23,6 +25,20 @@ static void usageExit(FILE *out)
 "   -/--max-seg-size    :  Desired maximum segment size for deduplication(in KB)\n"
 "   -/--rabin-window-size: Size of the internal rolling window used for"
 "                           calculating Rabin fingerprint(in bytes)\n"
+"   -/--chunker         :  Content-defined chunking engine(rabin, gear)\n"
+"   -/--ingest-threads  :  Threads that chunk and hash a large file moving to"
+                            " the cloud\n"
+"   -/--ingest-regions  :  Also split the chunking of such a file among the"
+                            " ingest threads\n"
+"   -/--multi-thread    :  Serve FUSE requests from multiple threads\n"
+"   -/--cache-policy    :  Replacement policy of the segment cache"
+                            "(lru, arc, s3fifo, gdsf)\n"
+"   -/--cache-admission :  Only cache a downloaded segment if it is used more"
+                            " often than the one it would evict\n"
+"   -/--mem-cache-size  :  The size of the RAM tier above the segment cache"
+                            "(in KB)\n"
+"   -/--scan-threshold  :  Files at least this large that are read"
+                            " sequentially bypass the segment cache(in KB)\n"
 "\n"
 " Commands (with <required parameters> and [optional parameters]) :\n"
 "\n");
@@ -42,6 +58,14 @@ static struct option longOptionsG[] =
     { "min-seg-size",		required_argument,			0,  'm' },
     { "max-seg-size",		required_argument,			0,  'M' },
     { "cache-size",		required_argument,			0,  'c' },
+    { "multi-thread",		no_argument,				0,  'T' },
+    { "cache-policy",		required_argument,			0,  'P' },
+    { "cache-admission",	no_argument,				0,  'A' },
+    { "mem-cache-size",	required_argument,			0,  'R' },
+    { "scan-threshold",	required_argument,			0,  'C' },
+    { "chunker",			required_argument,			0,  'G' },
+    { "ingest-threads",	required_argument,			0,  'I' },
+    { "ingest-regions",	no_argument,				0,  'J' },
     { 0,					0,							0,   0	}
 };
 
@@ -59,7 +83,15 @@ static void parse_arguments(int argc, char* argv[],
     state->avg_seg_size = 4096;
     state->max_seg_size = 6144;
     state->rabin_window_size = 48;
+    strcpy(state->chunker, "rabin");
+    state->ingest_threads = 1; // Default: chunk and hash on the calling thread.
+    state->ingest_regions = 0;
     state->cache_size = 0; // Default: no cache.
+    state->multi_thread = 0; // Default: single threaded FUSE.
+    strcpy(state->cache_policy, CACHE_POLICY_DEFAULT);
+    state->cache_admission = 0;
+    state->mem_cache_size = 0; // Default: no RAM tier.
+    state->scan_threshold = 0; // Default: no scan detection.
 
     // Parse args
     while (1) {
@@ -105,6 +137,38 @@ static void parse_arguments(int argc, char* argv[],
        case 'w': 
             state->rabin_window_size = atoi(optarg);
             break;
+       case 'T':
+            state->multi_thread = 1;
+            break;
+       case 'P':
+            if (cache_policy_find(optarg) == NULL) {
+                fprintf(stderr, "\nERROR: Unknown cache policy: %s\n", optarg);
+                usageExit(stderr);
+            }
+            strcpy(state->cache_policy, optarg);
+            break;
+       case 'A':
+            state->cache_admission = 1;
+            break;
+       case 'R':
+            state->mem_cache_size = atoi(optarg)*1024;
+            break;
+       case 'C':
+            state->scan_threshold = atoi(optarg)*1024;
+            break;
+       case 'G':
+            if (dedup_engine_find(optarg) < 0) {
+                fprintf(stderr, "\nERROR: Unknown chunker: %s\n", optarg);
+                usageExit(stderr);
+            }
+            strcpy(state->chunker, optarg);
+            break;
+       case 'I':
+            state->ingest_threads = atoi(optarg);
+            break;
+       case 'J':
+            state->ingest_regions = 1;
+            break;
         default:
             fprintf(stderr, "\nERROR: Unknown option: -%c\n", c);
             // Usage exit
@@ -25,6 +25,9 @@
 #include <fstream>
 #include <string>
 #include <map>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
 #include <unordered_map>
 
 #include "cloudapi.h"
@@ -32,6 +35,11 @@
 #include "cloudfs.h"
 #include "mydedup.h"
 #include "mycache.h"
+#include "mysegidx.h"
+#include "mypolicy.h"
+#include "mysketch.h"
+#include "mymemcache.h"
+#include "myslab.h"
 
 #define BUF_SIZE (1024)
 
@@ -73,19 +81,109 @@
 #define CACHEDIR (".cache")
 #define MASTERDIR (".master")
 #define CACHEMASTER ("cache.master")
+#define CACHEJOURNAL ("cache.journal")
+// compact once the journal holds this many records and twice the live entries
+#define JOURNAL_MIN_RECORDS 4096
+// the flusher starts above this share of cache_size in dirty segments and
+// stops below the low one
+#define DIRTY_HIGH_PCT 50
+#define DIRTY_LOW_PCT 25
+// bounds on the slab files of the segment store
+#define SLAB_SIZE_MIN (256 * 1024)
+#define SLAB_SIZE_MAX (64 * 1024 * 1024)
 
 struct cache_config ca_cfg_s;
 struct cache_config *ca_cfg;
 
-DLinkedNode *head; // pseudo head
-DLinkedNode *tail; // pseudo head
 size_t total_size;
 int cache_cnt;
 
 int get, put;
 size_t get_size, put_size;
 
-//std::unordered_map<std::string, DLinkedNode *> cachemap;
+// Guards the policy queues, the index and the counters above. Taken only by the
+// public cloud_*_cache entry points and mycache_rebuild, and never held
+// across a cloud request: nodes being downloaded or uploaded meanwhile are
+// marked loading or flushing instead.
+static std::mutex cache_mutex;
+
+// key -> node, so lookup, promotion and eviction are O(1); the order of
+// the nodes is up to the replacement policy
+static std::unordered_map<std::string, DLinkedNode *> cachemap;
+static struct cache_policy *policy;
+// access frequencies for --cache-admission, empty otherwise
+static struct sketch admit_sketch;
+
+/*
+ * Dirty segments, in the order they became dirty, with their bytes. The
+ * flusher thread uploads from the oldest end once dirty_size passes the
+ * high watermark, until it is below the low one, so eviction mostly finds
+ * clean segments and a foreground cache_put no longer pays for uploads.
+ */
+static DLinkedNode dirty_head, dirty_tail;
+static size_t dirty_size;
+static std::thread flusher;
+static bool flusher_stop;
+// signalled when dirty_size passes the high watermark and when a download
+// or upload ends
+static std::condition_variable flush_cond;
+
+/*
+ * Dirty victims cache_shrink chose, with their sizes, marked flushing and
+ * left in the cache until cache_writeback has uploaded them. writeback_size
+ * is their total, which the cache may be over its size by meanwhile.
+ */
+static std::vector<std::pair<std::string, size_t>> writeback;
+static size_t writeback_size;
+
+static void flush_loop();
+
+static void cache_writeback();
+
+/*
+ * (Re)opens the slab store under the cache directory, rescanning it. Slabs
+ * are an eighth of the cache, so compaction moves little at a time.
+ */
+static void cache_store_open() {
+    size_t cache_size = ca_cfg->fstate->cache_size;
+    size_t slab_size = cache_size / 8;
+    if (slab_size < SLAB_SIZE_MIN) {
+        slab_size = SLAB_SIZE_MIN;
+    }
+    if (slab_size > SLAB_SIZE_MAX) {
+        slab_size = SLAB_SIZE_MAX;
+    }
+    size_t dead_limit = cache_size / 4;
+    if (dead_limit < slab_size) {
+        dead_limit = slab_size;
+    }
+    std::string dir = std::string(ca_cfg->fstate->ssd_path) + CACHEDIR;
+    slab_destroy();
+    int ret = slab_init(dir.c_str(), slab_size, dead_limit);
+    if (ret < 0) {
+        PF("[%s] slab store: %s\n", __func__, strerror(-ret));
+    }
+}
+
+/*
+ * cache.master holds the cached segments as of the last compaction, one
+ * "key size dirty queue" line each, least recent of each policy queue
+ * first. Changes since then are appended to cache.journal, one record per
+ * line:
+ *
+ *   P key size dirty     put or update, counts as an access
+ *   G key                access
+ *   E key                evict
+ *   C key                uploaded by the flusher, now clean
+ *
+ * Replaying the journal restores the cached set exactly; placement within
+ * the policy queues is exact as of the last compaction.
+ *
+ * Records are buffered in journal_buf and written out by mycache_store.
+ */
+static int journal_fd = -1;
+static std::string journal_buf;
+static long journal_records = 0;
 
 //struct cloudfs_state {
 //    char ssd_path[MAX_PATH_LEN];
@@ -101,23 +199,6 @@ size_t get_size, put_size;
 //    char no_dedup;
 //};
 
-FILE *infile_c;
-FILE *outfile_c;
-
-
-int get_buffer_c(const char *buffer, int bufferLength) {
-
-//    PF("[%s]get buffer %d\n",__func__, bufferLength);
-    return fwrite(buffer, 1, bufferLength, outfile_c);
-}
-
-
-int put_buffer_c(char *buffer, int bufferLength) {
-//    PF("[%s]put buffer %d\n",__func__, bufferLength);
-    return fread(buffer, 1, bufferLength, infile_c);
-}
-
-
 void get_cache_path(char *cache_path, const char *md5, int bufsize) {
 
     snprintf(cache_path, bufsize, "%s%s/%s.cache", ca_cfg->fstate->ssd_path, CACHEDIR, md5);
@@ -139,25 +220,48 @@ std::string cachemaster_path_() {
     return ret;
 }
 
-void cache_download(std::string key) {
-    cache_download_c(key.c_str());
+static void journal_record(char op, DLinkedNode *n) {
+    char line[MAX_PATH_LEN];
+    int len;
+    if (op == 'P') {
+        len = snprintf(line, sizeof(line), "P %s %zu %d\n", n->key.c_str(), n->size, n->dirty);
+    } else {
+        len = snprintf(line, sizeof(line), "%c %s\n", op, n->key.c_str());
+    }
+    journal_buf.append(line, len);
+    journal_records++;
 }
 
-void cache_download(const char *key) {
-    cache_download_c(key);
+std::string cachejournal_path_() {
+    std::string ret;
+    ret.assign(ca_cfg->fstate->ssd_path).append(MASTERDIR).append("/").append(CACHEJOURNAL);
+    return ret;
 }
 
-void cache_download_c(const char *key) {
-    char path_cache[MAX_PATH_LEN];
-    get_cache_path(path_cache, key, MAX_PATH_LEN);
+int cache_download(std::string key) {
+    return cache_download_c(key.c_str());
+}
 
-    outfile_c = FFOPEN__(path_cache, "wb");
-    cloud_get_object(BUCKET, key, get_buffer_c);
-    get++;
+int cache_download(const char *key) {
+    return cache_download_c(key);
+}
+
+// Returns 0 or -EIO.
+int cache_download_c(const char *key) {
+    char *data = NULL;
+    size_t size = 0;
+    FILE *outfile_c = open_memstream(&data, &size);
+    S3Status status = cloud_get_object(BUCKET, key, get_buffer, outfile_c);
     cloud_print_error();
-    PF("[%s]:\t get %s(FD:%d) from cloud with key:[%s]\n", __func__, path_cache, outfile_c, key);
-    PF("[%s]:\t return\n", __func__);
     FFCLOSE__(outfile_c);
+    PF("[%s]:\t get %zu bytes from cloud with key:[%s]\n", __func__, size, key);
+    int ret = status == S3StatusOK ? slab_put(key, data, size) : -EIO;
+    if (ret < 0) {
+        PF("[%s]:\t storing %s failed\n", __func__, key);
+    }
+    free(data);
+    PF("[%s]:\t return\n", __func__);
+    return ret < 0 ? -EIO : 0;
 }
 
 void cache_upload(std::string key, long size) {
@@ -176,24 +280,26 @@ void cache_upload(DLinkedNode *node) {
 }
 
 void cache_upload_c(const char *key, long size) {
-    char path_cache[MAX_PATH_LEN];
-    get_cache_path(path_cache, key, MAX_PATH_LEN);
-
-    if (!file_exist(path_cache)) {
-        PF("[%s]:\t path_cache %s not exist!\n", __func__, path_cache);
+    char *buf = (char *) malloc(size);
+    if (slab_read(key, 0, buf, size) != size) {
+        PF("[%s]:\t %s not in the slab store!\n", __func__, key);
+        free(buf);
+        return;
     }
-    infile_c = FFOPEN__(path_cache, "rb");
-    cloud_put_object(BUCKET, key, size, put_buffer_c);
+    FILE *infile_c = fmemopen(buf, size, "rb");
+    cloud_put_object(BUCKET, key, size, put_buffer, infile_c);
     PF("put[%s]\n", key);
     put++;
     put_size += size;
+    segidx_set_loc(key, SEG_LOC_CLOUD);
 
     PF("get[%d]put[%d]getsize[%zu]putsize[%zu]\n", get, put, get_size, put_size);
     cloud_print_error();
 
-    PF("[%s]:\t put %s(fp:%p) into cloud with key:[%s]\n", __func__, path_cache, infile_c, key);
+    PF("[%s]:\t put %s into cloud\n", __func__, key);
     PF("[%s]:\t return\n", __func__);
     FFCLOSE__(infile_c);
+    free(buf);
 }
 
 
@@ -202,6 +308,19 @@ void mycache_init(FILE *logfile, struct cloudfs_state *fstate) {
     ca_cfg = &ca_cfg_s;
     ca_cfg->logfile = logfile;
     ca_cfg->fstate = fstate;
+    policy = cache_policy_find(fstate->cache_policy);
+    if (policy == nullptr) {
+        policy = cache_policy_find(CACHE_POLICY_DEFAULT);
+    }
+    if (fstate->cache_admission && fstate->cache_size > 0) {
+        sketch_init(&admit_sketch, fstate->cache_size / fstate->avg_seg_size);
+    }
+    if (fstate->mem_cache_size > 0 && fstate->cache_size > 0) {
+        int ret = memcache_init(fstate->mem_cache_size, fstate->max_seg_size, slab_put);
+        if (ret < 0) {
+            PF("[%s] RAM tier disabled: %s\n", __func__, strerror(-ret));
+        }
+    }
     get = 0;
     put = 0;
     get_size = 0;
@@ -219,50 +338,295 @@ void mycache_init(FILE *logfile, struct cloudfs_state *fstate) {
 //    cachemap.insert(std::pair<std::string, DLinkedNode *>(a, head));
     PF("[%s]:\n", __func__);
     mycache_store();
+    if (fstate->cache_size > 0) {
+        flusher_stop = false;
+        flusher = std::thread(flush_loop);
+    }
 }
 
 void mycache_destroy() {
 
     PF("[%s] \n", __func__);
+    cache_writeback();
+    if (flusher.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(cache_mutex);
+            flusher_stop = true;
+            flush_cond.notify_all();
+        }
+        flusher.join();
+    }
+    memcache_destroy();
+    slab_destroy();
+
+}
+
+
+
+
+static void node_set_dirty(DLinkedNode *node, int dirty) {
+    if (node->dirty == dirty) {
+        return;
+    }
+    node->dirty = dirty;
+    if (dirty) {
+        node->dirty_next = dirty_head.dirty_next;
+        node->dirty_prev = &dirty_head;
+        dirty_head.dirty_next->dirty_prev = node;
+        dirty_head.dirty_next = node;
+        dirty_size += node->size;
+        if (dirty_size > (size_t) ca_cfg->fstate->cache_size / 100 * DIRTY_HIGH_PCT) {
+            flush_cond.notify_all();
+        }
+    } else {
+        node->dirty_prev->dirty_next = node->dirty_next;
+        node->dirty_next->dirty_prev = node->dirty_prev;
+        node->dirty_prev = nullptr;
+        node->dirty_next = nullptr;
+        dirty_size -= node->size;
+    }
+}
+
+/*
+ * Uploads a dirty node with cache_mutex dropped, marked flushing meanwhile,
+ * and marks it clean if that worked. Called and returns with the lock
+ * held; only a rebuild may have dropped the node by then.
+ * Returns 0, or -EIO if the segment could not be read or uploaded.
+ */
+static int node_upload(std::unique_lock<std::mutex> &lock, DLinkedNode *node) {
+    std::string key = node->key;
+    size_t size = node->size;
+    char *buf = (char *) malloc(size);
+
+    memcache_settle(key);
+    if (slab_read(key, 0, buf, size) != (ssize_t) size) {
+        PF("[%s] read %s failed\n", __func__, key.c_str());
+        free(buf);
+        node->flushing = 0;
+        return -EIO;
+    }
+    node->flushing = 1;
+    lock.unlock();
+
+    FILE *fp = fmemopen(buf, size, "rb");
+    S3Status status = cloud_put_object(BUCKET, key.c_str(), size, put_buffer, fp);
+    if (status == S3StatusOK) {
+        segidx_set_loc(key.c_str(), SEG_LOC_CLOUD);
+    }
+    FFCLOSE__(fp);
+    free(buf);
+
+    lock.lock();
+    put++;
+    put_size += size;
+    // a rebuild may have replaced the node meanwhile
+    node = cache_find(key);
+    if (node != nullptr && node->flushing) {
+        node->flushing = 0;
+        if (status == S3StatusOK) {
+            node_set_dirty(node, 0);
+            journal_record('C', node);
+        }
+    }
+    flush_cond.notify_all();
+    if (status != S3StatusOK) {
+        PF("[%s] put %s failed\n", __func__, key.c_str());
+        return -EIO;
+    }
+    return 0;
+}
 
+/*
+ * Body of the flusher thread. Holds cache_mutex except while uploading,
+ * skipping segments some eviction is uploading already.
+ */
+static void flush_loop() {
+    size_t high = (size_t) ca_cfg->fstate->cache_size / 100 * DIRTY_HIGH_PCT;
+    size_t low = (size_t) ca_cfg->fstate->cache_size / 100 * DIRTY_LOW_PCT;
+
+    std::unique_lock<std::mutex> lock(cache_mutex);
+    while (!flusher_stop) {
+        if (dirty_size <= high) {
+            flush_cond.wait(lock);
+            continue;
+        }
+        while (dirty_size > low && !flusher_stop) {
+            DLinkedNode *node = dirty_tail.dirty_prev;
+            while (node != &dirty_head && node->flushing) {
+                node = node->dirty_prev;
+            }
+            if (node == &dirty_head) {
+                flush_cond.wait(lock);
+                break;
+            }
+            std::string key = node->key;
+            int ret = node_upload(lock, node);
+            mycache_store();
+            if (ret < 0) {
+                // retry it last, and back off until more segments become dirty
+                node = cache_find(key);
+                if (node != nullptr && node->dirty && !node->flushing) {
+                    node_set_dirty(node, 0);
+                    node_set_dirty(node, 1);
+                }
+                flush_cond.wait(lock);
+                break;
+            }
+        }
+    }
 }
 
+/*
+ * Uploads the dirty victims cache_shrink queued, with cache_mutex dropped,
+ * and evicts those the cache still has no room for. A failed upload leaves
+ * the segment cached and dirty, for the flusher or a later eviction to
+ * retry. Called without the lock by every entry point that may have made
+ * cache_put evict.
+ */
+static void cache_writeback() {
+    std::unique_lock<std::mutex> lock(cache_mutex);
+    while (!writeback.empty()) {
+        std::string key = writeback.back().first;
+        size_t size = writeback.back().second;
+        writeback.pop_back();
+
+        DLinkedNode *node = cache_find(key);
+        // or replaced by a rebuild
+        if (node != nullptr && node->flushing) {
+            node_upload(lock, node);
+            node = cache_find(key);
+        }
+        writeback_size -= size;
+        if (node != nullptr && !node->dirty && !node->flushing && !node->loading &&
+            total_size > (size_t) ca_cfg->fstate->cache_size + writeback_size) {
+            policy->remove(node);
+            cache_evict(node, true);
+        }
+        mycache_store();
+    }
+}
 
+/*
+ * Evicts victims until the cache fits its size, short of the dirty ones
+ * queued for cache_writeback. A dirty victim is marked flushing and queued
+ * there too, and one being downloaded or uploaded already is skipped; both
+ * go back into the policy's queues. Each node is looked at once at most.
+ */
+static void cache_shrink() {
+    size_t cache_size = ca_cfg->fstate->cache_size;
+    for (int tries = cache_cnt; tries > 0 && total_size > cache_size + writeback_size; tries--) {
+        DLinkedNode *removed = policy->victim(cache_size);
+        if (removed == nullptr) {
+            break;
+        }
+        if (!removed->dirty && !removed->flushing && !removed->loading) {
+            cache_evict(removed, true);
+            continue;
+        }
+        if (removed->dirty && !removed->flushing) {
+            removed->flushing = 1;
+            writeback.push_back(std::make_pair(removed->key, removed->size));
+            writeback_size += removed->size;
+        }
+        policy->restore(removed, removed->queue);
+    }
+}
 
+// waits out a download of key by another thread; cache_mutex must be held
+static void cache_wait_loaded(std::unique_lock<std::mutex> &lock, const std::string &key) {
+    DLinkedNode *n;
+    while ((n = cache_find(key)) != nullptr && n->loading) {
+        flush_cond.wait(lock);
+    }
+}
+
+/*
+ * Downloads key into the node cache_put just made for it, with cache_mutex
+ * dropped. The node is marked loading meanwhile, which keeps eviction and
+ * deletes off it and has other readers wait for it. A failed download
+ * drops the node again.
+ * Returns 0 or -EIO.
+ */
+static int cache_load(std::unique_lock<std::mutex> &lock, const std::string &key) {
+    cache_find(key)->loading = 1;
+    lock.unlock();
+    int ret = cache_download(key);
+    lock.lock();
+    get++;
+    // a rebuild may have replaced the node meanwhile
+    DLinkedNode *n = cache_find(key);
+    if (n != nullptr && n->loading) {
+        n->loading = 0;
+        if (ret < 0) {
+            policy->remove(n);
+            cache_evict(n, false);
+        }
+    }
+    flush_cond.notify_all();
+    return ret;
+}
 
-int cloud_put_cache(char *key_c, size_t size) {
+/*
+ * TinyLFU admission: once the cache is full, a missed segment only takes
+ * the place of the policy's next victim if it was asked for more often
+ * lately. Keeps one-off segments of a cold scan from pushing out data
+ * that other files share, and saves the SSD writes of caching them.
+ */
+static bool cache_admit(const std::string &key, size_t size) {
+    if (!ca_cfg->fstate->cache_admission) {
+        return true;
+    }
+    if (total_size + size <= (size_t) ca_cfg->fstate->cache_size) {
+        return true;
+    }
+    DLinkedNode *victim = policy->peek(ca_cfg->fstate->cache_size);
+    if (victim == nullptr) {
+        return true;
+    }
+    return sketch_estimate(&admit_sketch, key) > sketch_estimate(&admit_sketch, victim->key);
+}
 
-    //FILE *infile;
+int cloud_put_cache(char *key_c, size_t size, FILE *infile) {
 
     std::string key(key_c);
 
     PF("[%s] key %s, size %zu\n", __func__, key.c_str(), size);
 
-    char path_cache[MAX_PATH_LEN];
-    get_cache_path(path_cache, key.c_str(), MAX_PATH_LEN);
     if (ca_cfg->fstate->cache_size == 0) {
-        cloud_put_object(BUCKET, key.c_str(), size, put_buffer);
+        cloud_put_object(BUCKET, key.c_str(), size, put_buffer, infile);
         return 1;
         PF("[%s] cache not enabled, saved %zu into cache\n", __func__, size);
     } else {
+        std::unique_lock<std::mutex> lock(cache_mutex);
 
         DLinkedNode *n = cache_get(key);
         if (n == nullptr) {
             //not in cache
-            cache_put(key, size, 1);
-
-            FILE *tfp = FFOPEN__(path_cache, "wb");
-
-
             char *buf;
             buf = (char *) malloc(sizeof(char) * size);
 
             fread(buf, 1, size, infile);
 
-            fwrite(buf, 1, size, tfp);
+            // a dirty segment exists nowhere else, so its SSD copy has to be
+            // stored before the journal records it; the RAM tier only keeps
+            // it hot
+            if (slab_put(key, buf, size) < 0) {
+                PF("[%s] storing %s failed, uploading it at once\n", __func__, key.c_str());
+                lock.unlock();
+                FILE *fp = fmemopen(buf, size, "rb");
+                if (cloud_put_object(BUCKET, key.c_str(), size, put_buffer, fp) == S3StatusOK) {
+                    segidx_set_loc(key.c_str(), SEG_LOC_CLOUD);
+                }
+                FFCLOSE__(fp);
+                free(buf);
+                return 1;
+            }
+            memcache_put(key, buf, size, false);
 
             free(buf);
-            FFCLOSE__(tfp);
+
+            // only now, a policy may evict (and upload) the new segment at once
+            cache_put(key, size, 1);
 
             PF("[%s], %s not in cache, saved %zu into cache\n", __func__, key.c_str(), size);
 
@@ -276,116 +640,214 @@ int cloud_put_cache(char *key_c, size_t size) {
 
 
         mycache_store();
+        lock.unlock();
+        cache_writeback();
         return 1;
     }
 
 }
 
 
-int cloud_get_cache(char *key_c, size_t size) {
+int cloud_get_cache(char *key_c, size_t size, FILE *outfile) {
 
-
-//    FILE *outfile;
     std::string key(key_c);
 
     PF("[%s] key %s, size %zu\n", __func__, key.c_str(), size);
 
-    char path_cache[MAX_PATH_LEN];
-    get_cache_path(path_cache, key.c_str(), MAX_PATH_LEN);
-
     if (ca_cfg->fstate->cache_size == 0) {
-        cloud_get_object(BUCKET, key.c_str(), get_buffer);
+        cloud_get_object(BUCKET, key.c_str(), get_buffer, outfile);
 
 
         return 1;
     } else {
+        // RAM tier hits skip the SSD tier altogether
+        if (memcache_write(key, outfile) == 0) {
+            return 1;
+        }
+        bool bypass = false;
+        {
+            std::unique_lock<std::mutex> lock(cache_mutex);
 
-        DLinkedNode *n = cache_get(key);
-        if (n == nullptr) {//not in cache
-            //download from cloud
+            cache_wait_loaded(lock, key);
+            DLinkedNode *n = cache_get(key);
+            if (n == nullptr && !cache_admit(key, size)) {
+                bypass = true;
+            } else if (n == nullptr) {//not in cache
+                //download from cloud
 
 //            struct stat statbuf;
 //            lstat(path_cache, &statbuf);
-            get_size += size;
-            PF("get[%s]\n", key.c_str());
-            PF("get[%d]put[%d]getsize[%zu]putsize[%zu]\n", get, put, get_size, put_size);
-            cache_put(key, size, 0);
+                get_size += size;
+                PF("get[%s]\n", key.c_str());
+                PF("get[%d]put[%d]getsize[%zu]putsize[%zu]\n", get, put, get_size, put_size);
+                cache_put(key, size, 0);
+
+                if (cache_find(key) == nullptr) {
+                    // the policy turned it straight out again
+                    bypass = true;
+                } else if (cache_load(lock, key) < 0) {
+                    bypass = true;
+                }
+            }
 
-            cache_download(key);
+            if (!bypass) {
+                // promote to the RAM tier and serve it from there
+                if (memcache_load(key, size, slab_read) < 0 || memcache_write(key, outfile) < 0) {
+                    char *buf;
+                    buf = (char *) malloc(sizeof(char) * size);
+                    if (slab_read(key, 0, buf, size) == (ssize_t) size) {
+                        fwrite(buf, 1, size, outfile);
+                    } else {
+                        // the download failed, try the cloud once more
+                        bypass = true;
+                    }
+                    free(buf);
+                }
+
+                mycache_store();
+            }
         }
-//        else{
-//        }
+        cache_writeback();
+        if (bypass) {
+            // not worth a place in the cache, pass it straight through
+            cloud_get_object(BUCKET, key.c_str(), get_buffer, outfile);
+        }
+        return 1;
+    }
 
+}
 
+/*
+ * Copies len bytes at offset off of segment key_c straight into buf. The
+ * bytes come from the RAM tier, or else from the cached copy of the
+ * segment, which is fetched on a miss and promoted to the RAM tier. A RAM
+ * hit leaves the SSD tier's order and journal alone. With the cache
+ * disabled, for a segment too large to ever be cached, or one the
+ * admission filter turns away, only the requested range is fetched from
+ * the cloud.
+ *
+ * With scan, the read is part of a sequential scan of a large file: a hit
+ * does not count as an access, a missed segment no other file shares is
+ * not cached at all and a shared one goes in where the policy evicts
+ * first. Nothing of it is promoted to the RAM tier.
+ * Returns the number of bytes copied or -errno.
+ */
+int cloud_read_cache(const char *key_c, size_t size, size_t off, char *buf, size_t len, bool scan) {
 
-        FILE *fp = FFOPEN__(path_cache, "rb");
-        char *buf;
-        buf = (char *) malloc(sizeof(char) * size);
-        fread(buf, 1, size, fp);
-        fwrite(buf, 1, size, outfile);
-        free(buf);
-        FFCLOSE__(fp);
+    std::string key(key_c);
+
+    PF("[%s] key %s, size %zu, off %zu, len %zu\n", __func__, key.c_str(), size, off, len);
+
+    if (ca_cfg->fstate->cache_size == 0) {
+        return cloud_get_range(key.c_str(), off, buf, len);
+    }
 
+    ssize_t ret = memcache_read(key, off, buf, len);
+    if (ret >= 0) {
+        return ret;
+    }
 
+    // unshared segments of a scan are not cached; if the index cannot tell,
+    // cache it anyway, if only cold
+    int refcnt = 0;
+    if (scan && segidx_get_ref(key.c_str(), &refcnt) < 0) {
+        refcnt = 2;
+    }
+    bool bypass = false;
+    {
+        std::unique_lock<std::mutex> lock(cache_mutex);
+
+        cache_wait_loaded(lock, key);
+        DLinkedNode *n = scan ? cache_find(key) : cache_get(key);
+        if (n == nullptr && (size > (size_t) ca_cfg->fstate->cache_size || (scan && refcnt <= 1) ||
+                             (!scan && !cache_admit(key, size)))) {
+            // not admitted, fetch just the part we need
+            bypass = true;
+        } else if (n == nullptr) {//not in cache
+            get_size += size;
+            PF("get[%s]\n", key.c_str());
+            cache_put(key, size, 0, scan);
+
+            if (cache_find(key) == nullptr) {
+                // the policy turned it straight out again
+                bypass = true;
+            } else if (cache_load(lock, key) < 0) {
+                bypass = true;
+            }
+        }
         mycache_store();
-        return 1;
+    }
+    cache_writeback();
+    if (bypass) {
+        return cloud_get_range(key.c_str(), off, buf, len);
     }
 
+    if (scan || memcache_load(key, size, slab_read) < 0 || (ret = memcache_read(key, off, buf, len)) < 0) {
+        ret = slab_read(key, off, buf, len);
+    }
+    if (ret == -ENOENT) {
+        // evicted by another thread once the lock was dropped, or never
+        // downloaded
+        ret = cloud_get_range(key.c_str(), off, buf, len);
+    }
+    return ret;
 }
 
 void cloud_delete_cache(const char *key_c) {
-    //    FILE *outfile;
     std::string key(key_c);
     PF("[%s] key %s\n", __func__, key.c_str());
 
     if (ca_cfg->fstate->cache_size == 0) {
         cloud_delete_object(BUCKET, key.c_str());
     } else {
-        DLinkedNode *n = cache_find(key);
+        std::unique_lock<std::mutex> lock(cache_mutex);
+        DLinkedNode *n;
+        // let a running download or upload land first, or it would outlive
+        // the delete
+        while ((n = cache_find(key)) != nullptr && (n->flushing || n->loading)) {
+            flush_cond.wait(lock);
+        }
+        bool remote = true;
         if (n == nullptr) {//not in cache
-            cloud_delete_object(BUCKET, key.c_str());
             PF("[%s] not in cache\n", __func__);
         } else {
             if (n->dirty == 1) {
                 //on cache, not on cloud yet
-                n->dirty = 0;
-
-            }else{
-
-                cloud_delete_object(BUCKET, key.c_str());
+                node_set_dirty(n, 0);
+                remote = false;
             }
-            cut_node(n);
+            policy->remove(n);
             cache_evict(n,false);
         }
 
 
+        mycache_store();
+        lock.unlock();
+        if (remote) {
+            cloud_delete_object(BUCKET, key.c_str());
+        }
     }
-
-    mycache_store();
 }
 
 DLinkedNode *cache_find(std::string key) {
-    DLinkedNode *n;
-    for (n = head->next; n != tail; n = n->next) {
-        if (n->key == key) {
-            return n;
-        }
+    auto it = cachemap.find(key);
+    if (it == cachemap.end()) {
+        return nullptr;
     }
-
-    mycache_store();
-    return nullptr;
+    return it->second;
 }
 
 DLinkedNode *cache_get(std::string key) {
 
     PF("[%s] key %s\n", __func__, key.c_str());
+    sketch_add(&admit_sketch, key);
     DLinkedNode *n = cache_find(key);
     if (n == nullptr) {
-        mycache_store();
         return nullptr;
     } else {
         DLinkedNode *node = n;
-        move_to_head(node);
+        policy->hit(node);
+        journal_record('G', node);
         return node;
     }
 }
@@ -393,121 +855,103 @@ DLinkedNode *cache_get(std::string key) {
 DLinkedNode *cache_get(char *key_c) {
     std::string key(key_c);
     PF("[%s] key %s\n", __func__, key.c_str());
+    sketch_add(&admit_sketch, key);
 
     DLinkedNode *n = cache_find(key);
     if (n == nullptr) {
-        mycache_store();
         return nullptr;
     } else {
         DLinkedNode *node = n;
-        move_to_head(node);
+        policy->hit(node);
+        journal_record('G', node);
 
         return node;
     }
 }
 
 
-void cache_evict(DLinkedNode *removed, bool upload) {
-    PF("[%s] key %s, size %zu, upload: %d\n", __func__, removed->key.c_str(), removed->size, upload);
+/*
+ * Drops a node the policy no longer holds, with its SSD copy. A dirty one
+ * is lost, so eviction writes it back first (cache_shrink). With settle,
+ * the RAM tier keeps its copy, once the SSD copy of it has landed;
+ * otherwise that goes too.
+ */
+void cache_evict(DLinkedNode *removed, bool settle) {
+    PF("[%s] key %s, size %zu, settle: %d\n", __func__, removed->key.c_str(), removed->size, settle);
     cache_cnt--;
     total_size -= removed->size;
-//    cachemap.erase(removed->key);
-    if (removed->dirty == 1 && upload) {
-        cache_upload(removed);
+    cachemap.erase(removed->key);
+    journal_record('E', removed);
+    if (settle) {
+        // the SSD copy may still be on its way down from the RAM tier
+        memcache_settle(removed->key);
+    } else {
+        memcache_drop(removed->key);
     }
-    char path_cache[MAX_PATH_LEN];
-    get_cache_path(path_cache, removed->key.c_str(), MAX_PATH_LEN);
-
-    remove(path_cache);
+    node_set_dirty(removed, 0);
+    slab_remove(removed->key);
     delete removed;
-
-    mycache_store();
 }
 
 
-void cache_put(std::string key, size_t size, int dirty) {
+// a resident node changing size is taken out of its queue and put back
+static void node_resize(DLinkedNode *node, size_t size) {
+    policy->remove(node);
+    total_size -= node->size;
+    if (node->dirty) {
+        dirty_size = dirty_size - node->size + size;
+    }
+    node->size = size;
+    total_size += size;
+    policy->restore(node, node->queue);
+}
+
+void cache_put(std::string key, size_t size, int dirty, bool cold) {
 
     PF("[%s] key %s, size %zu, dirty %d\n", __func__, key.c_str(), size, dirty);
 
-//    PF("[%s] cachemap.count(key) = %llu\n", __func__, cachemap.count(key));
     DLinkedNode *n = cache_find(key);
     if (n == nullptr) {
         PF("[%s] not in cachemap\n", __func__);
-        DLinkedNode *node = new DLinkedNode(key, size, dirty);
+        DLinkedNode *node = new DLinkedNode(key, size, 0);
+        node_set_dirty(node, dirty);
 
 
-//        cachemap[key] = node;
+        cachemap[key] = node;
 
 
 
-        add_to_head(node);
+        policy->insert(node, ca_cfg->fstate->cache_size);
+        if (cold) {
+            // goes before anything else if room has to be made
+            policy->cold(node);
+        }
+        journal_record('P', node);
 
         cache_cnt++;
 
         total_size += size;
 
 
-        if (total_size > ca_cfg->fstate->cache_size) {
+        if (total_size > (size_t) ca_cfg->fstate->cache_size) {
             PF("[%s] total_size %zu > cache_size: %d\n", __func__, total_size, ca_cfg->fstate->cache_size);
-            while (total_size > ca_cfg->fstate->cache_size) {
-                DLinkedNode *removed = remove_tail();
-                cache_evict(removed, true);
-//                cache_cnt--;
-//                total_size -= removed->size;
-//                cachemap.erase(removed->key);
-//                delete removed;
-            }
+            cache_shrink();
         }
         PF("[%s] put %s into cache\n", __func__, key.c_str());
-        mycache_store();
     } else {
         PF("[%s] in cachemap\n");
         DLinkedNode *node = n;
-        node->size = size;
-        node->dirty = dirty;
-        move_to_head(node);
+        if (node->size != size) {
+            node_resize(node, size);
+        }
+        node_set_dirty(node, dirty);
+        policy->hit(node);
+        journal_record('P', node);
     }
 
 
 }
 
-void add_to_head(DLinkedNode *node) {
-
-
-    PF("[%s] add %s to head\n", __func__, node->key.c_str());
-    node->next = head->next;
-
-    node->prev = head;
-
-    head->next->prev = node;
-
-    head->next = node;
-
-    mycache_store();
-
-}
-
-void cut_node(DLinkedNode *node) {
-    node->prev->next = node->next;
-    node->next->prev = node->prev;
-
-}
-
-void move_to_head(DLinkedNode *node) {
-    cut_node(node);
-    add_to_head(node);
-    mycache_store();
-}
-
-DLinkedNode *remove_tail() {
-    auto node = tail->prev;
-    cut_node(node);
-
-    return node;
-}
-
-
-
 //void mycache_rebuild() {
 //
 //    total_size = 0;
@@ -567,41 +1011,193 @@ DLinkedNode *remove_tail() {
 //}
 
 
+/*
+ * Puts a node back while rebuilding: a master line restores it into its
+ * queue, a journal record replays the access through the policy.
+ */
+static void replay_put(std::string key, size_t size, int dirty, int queue, bool journaled) {
+    DLinkedNode *node = cache_find(key);
+    if (node != nullptr) {
+        if (node->size != size) {
+            node_resize(node, size);
+        }
+        node_set_dirty(node, dirty);
+        policy->hit(node);
+        return;
+    }
+    node = new DLinkedNode(key, size, 0);
+    node_set_dirty(node, dirty);
+    cachemap[key] = node;
+    cache_cnt++;
+    total_size += size;
+    if (journaled) {
+        policy->insert(node, ca_cfg->fstate->cache_size);
+    } else {
+        policy->restore(node, queue);
+    }
+}
+
+static void compact_line(DLinkedNode *n, void *arg) {
+    std::ofstream *master = (std::ofstream *) arg;
+    *master << n->key << " " << n->size << " " << n->dirty << " " << n->queue << "\n";
+}
+
+/*
+ * Writes the whole list to cache.master and empties the journal. The new
+ * master is renamed into place, so a crash leaves either the old master
+ * with its journal or the new one; replaying the journal over the new one
+ * is harmless.
+ */
+static void mycache_compact() {
+    std::string cachemaster_path = cachemaster_path_();
+    std::string tmp_path = cachemaster_path + ".tmp";
+    std::ofstream master(tmp_path.c_str());
+    policy->walk(compact_line, &master);
+    master.close();
+    if (master.fail() || rename(tmp_path.c_str(), cachemaster_path.c_str()) < 0) {
+        PF("[%s] write %s failed\n", __func__, tmp_path.c_str());
+        unlink(tmp_path.c_str());
+        return;
+    }
+    journal_buf.clear();
+    journal_records = 0;
+    if (journal_fd >= 0 && ftruncate(journal_fd, 0) < 0) {
+        PF("[%s] truncate journal failed\n", __func__);
+    }
+}
+
 void mycache_rebuild() {
+    std::lock_guard<std::mutex> lock(cache_mutex);
 
+    for (auto it = cachemap.begin(); it != cachemap.end(); ++it) {
+        delete it->second;
+    }
+    cachemap.clear();
+    policy->reset();
     total_size = 0;
+    cache_cnt = 0;
+    dirty_head.dirty_next = &dirty_tail;
+    dirty_tail.dirty_prev = &dirty_head;
+    dirty_size = 0;
 
-    head = new DLinkedNode();
-    tail = new DLinkedNode();
-    head->next = tail;
-    tail->prev = head;
     std::string cachemaster_path = cachemaster_path_();
+    std::string cachejournal_path = cachejournal_path_();
 
 
     if (file_exist(cachemaster_path.c_str())) {
+        // masters written before the policies existed have no queue column
         std::ifstream master(cachemaster_path.c_str());
-        std::string key;
+        std::string line;
+        while (std::getline(master, line)) {
+            if (line.size() >= MAX_PATH_LEN) {
+                continue;
+            }
+            char key[MAX_PATH_LEN];
+            size_t size;
+            int dirty;
+            int queue = 0;
+            if (sscanf(line.c_str(), "%s %zu %d %d", key, &size, &dirty, &queue) >= 3) {
+                replay_put(key, size, dirty, queue, false);
+            }
+        }
+
+        master.close();
+    }
+
+    // a torn last record from a crash is skipped
+    std::ifstream journal(cachejournal_path.c_str());
+    std::string line;
+    while (std::getline(journal, line)) {
+        if (line.size() >= MAX_PATH_LEN) {
+            continue;
+        }
+        char op;
+        char key[MAX_PATH_LEN];
         size_t size;
         int dirty;
-        while (master >> key >> size >> dirty) {
-            total_size += size;
-            DLinkedNode *node = new DLinkedNode(key, size, dirty);
-            node->next = head->next;
-            node->prev = head;
-            head->next->prev = node;
-            head->next = node;
+        if (sscanf(line.c_str(), "P %s %zu %d", key, &size, &dirty) == 3) {
+            replay_put(key, size, dirty, 0, true);
+        } else if (sscanf(line.c_str(), "%c %s", &op, key) == 2 && (op == 'G' || op == 'E' || op == 'C')) {
+            DLinkedNode *node = cache_find(key);
+            if (node == nullptr) {
+                continue;
+            }
+            if (op == 'G') {
+                policy->hit(node);
+            } else if (op == 'C') {
+                node_set_dirty(node, 0);
+            } else {
+                node_set_dirty(node, 0);
+                policy->remove(node);
+                cachemap.erase(node->key);
+                cache_cnt--;
+                total_size -= node->size;
+                delete node;
+            }
+        }
+    }
+    journal.close();
+
+    if (ca_cfg->fstate->cache_size > 0) {
+        // a restored snapshot brings its own slabs; a crash may have left a
+        // segment stored but not journaled, or the other way round
+        cache_store_open();
+        std::vector<DLinkedNode *> lost;
+        for (auto it = cachemap.begin(); it != cachemap.end(); ++it) {
+            if (!slab_has(it->first)) {
+                lost.push_back(it->second);
+            }
+        }
+        for (size_t i = 0; i < lost.size(); i++) {
+            PF("[%s] %s not in the slab store\n", __func__, lost[i]->key.c_str());
+            node_set_dirty(lost[i], 0);
+            policy->remove(lost[i]);
+            cachemap.erase(lost[i]->key);
+            cache_cnt--;
+            total_size -= lost[i]->size;
+            delete lost[i];
+        }
+        std::vector<std::string> keys;
+        slab_keys(keys);
+        for (size_t i = 0; i < keys.size(); i++) {
+            if (cache_find(keys[i]) == nullptr) {
+                slab_remove(keys[i]);
+            }
         }
+    }
 
-        master.close();
+    // the journal of a restored snapshot replaces ours, so always reopen it
+    if (journal_fd >= 0) {
+        close(journal_fd);
     }
+    journal_fd = open(cachejournal_path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    mycache_compact();
 }
 
+/*
+ * Persists the changes made since the last call by appending their journal
+ * records, compacting the journal once it outgrows the list.
+ */
 void mycache_store() {
-    DLinkedNode *n;
-    std::string cachemaster_path = cachemaster_path_();
-    std::ofstream master(cachemaster_path.c_str());
-    for (n = tail->prev; n != head; n = n->prev) {
-        master << n->key << " " << n->size << " " << n->dirty << "\n";
+    if (journal_fd < 0) {
+        mycache_compact();
+        return;
+    }
+    size_t done = 0;
+    while (done < journal_buf.size()) {
+        ssize_t n = write(journal_fd, journal_buf.data() + done, journal_buf.size() - done);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // the list is still consistent in memory, rewrite it whole
+            mycache_compact();
+            return;
+        }
+        done += n;
+    }
+    journal_buf.clear();
+    if (journal_records > JOURNAL_MIN_RECORDS && journal_records > 2 * (long) cache_cnt) {
+        mycache_compact();
     }
-    master.close();
 }
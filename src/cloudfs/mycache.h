@@ -16,31 +16,36 @@ struct DLinkedNode {
     std::string key;
     size_t size;
     int dirty;
+    int queue; // which list of the replacement policy holds the node
+    int freq;  // policy private
+    double prio; // policy private
+    long seq;    // policy private
+    int flushing; // being uploaded, by the flusher or to be evicted
+    int loading;  // being downloaded, see cache_load
     DLinkedNode *prev;
     DLinkedNode *next;
+    DLinkedNode *dirty_prev; // dirty list, oldest at the tail
+    DLinkedNode *dirty_next;
 
-    DLinkedNode() : key(""), size(0), dirty(0), prev(nullptr), next(nullptr) {}
+    DLinkedNode() : key(""), size(0), dirty(0), queue(0), freq(0), prio(0), seq(0), flushing(0), loading(0),
+                    prev(nullptr), next(nullptr), dirty_prev(nullptr), dirty_next(nullptr) {}
 
-    DLinkedNode(std::string _key, size_t _size, int _dirty) : key(_key), size(_size), dirty(_dirty), prev(nullptr),
-                                                              next(nullptr) {}
+    DLinkedNode(std::string _key, size_t _size, int _dirty) : key(_key), size(_size), dirty(_dirty), queue(0),
+                                                              freq(0), prio(0), seq(0), flushing(0), loading(0),
+                                                              prev(nullptr), next(nullptr), dirty_prev(nullptr),
+                                                              dirty_next(nullptr) {}
 };
 
 
-int get_buffer_c(const char *buffer, int bufferLength) ;
-
-
-int put_buffer_c(char *buffer, int bufferLength) ;
-
-
 void get_cache_path(char *cache_path, const char *md5, int bufsize);
 
 void get_cachemaster_path(char *cachemaster_path, int bufsize) ;
 
-void cache_download(std::string key) ;
+int cache_download(std::string key) ;
 
-void cache_download(const char *key) ;
+int cache_download(const char *key) ;
 
-void cache_download_c(const char *key) ;
+int cache_download_c(const char *key) ;
 
 void cache_upload(std::string key, long size);
 
@@ -59,10 +64,12 @@ void mycache_init(FILE *logfile, struct cloudfs_state *fstate) ;
 void mycache_destroy() ;
 
 
-int cloud_put_cache(char *key_c, size_t size) ;
+int cloud_put_cache(char *key_c, size_t size, FILE *infile) ;
 
 
-int cloud_get_cache(char *key_c, size_t size);
+int cloud_get_cache(char *key_c, size_t size, FILE *outfile);
+
+int cloud_read_cache(const char *key_c, size_t size, size_t off, char *buf, size_t len, bool scan = false);
 
 void cloud_delete_cache(const char *key_c) ;
 
@@ -73,17 +80,10 @@ DLinkedNode *cache_get(std::string key) ;
 DLinkedNode *cache_get(char *key_c);
 
 
-void cache_evict(DLinkedNode *removed, bool upload) ;
-
-
-void cache_put(std::string key, size_t size, int dirty) ;
-
-void add_to_head(DLinkedNode *node);
-void cut_node(DLinkedNode *node) ;
+void cache_evict(DLinkedNode *removed, bool settle) ;
 
-void move_to_head(DLinkedNode *node) ;
 
-DLinkedNode *remove_tail();
+void cache_put(std::string key, size_t size, int dirty, bool cold = false) ;
 
 
 
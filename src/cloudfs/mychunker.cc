@@ -0,0 +1,361 @@
+//
+// Created by Wilson_Xu on 2021/12/13.
+//
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include "mychunker.h"
+
+// jobs of one file still queued or being run, under pool_mutex
+struct job_batch {
+    int pending;
+};
+
+// a stretch of the file chunked on its own, as if a segment started there
+struct chunk_region {
+    off_t start;
+    off_t end;
+    std::vector<off_t> cuts;    // where its segments end, up to end
+    int error;
+};
+
+// hashes segs, or else chunks region
+struct pool_job {
+    const char *base;               // the mapped file
+    std::vector <seg_info_p> segs;  // consecutive segments to hash
+    chunk_region *region;
+    const rabinpoly_t *rp;          // engine and sizes to chunk with
+    job_batch *batch;
+};
+
+static std::mutex pool_mutex;
+// signalled when a job is queued or finished
+static std::condition_variable pool_cond;
+static std::deque<pool_job> jobs;
+static std::vector<std::thread> workers;
+static bool pool_stop;
+static bool use_regions;
+
+static void hash_run(const pool_job &job) {
+    unsigned char md5[MD5_DIGEST_LENGTH];
+    for (size_t i = 0; i < job.segs.size(); i++) {
+        seg_info_p seg = job.segs[i];
+        MD5((const unsigned char *) job.base + seg->seg_offset, seg->seg_size, md5);
+        for (int b = 0; b < MD5_DIGEST_LENGTH; b++) {
+            sprintf(seg->md5 + b * 2, "%02x", md5[b]);
+        }
+    }
+}
+
+/*
+ * Hands the engine the bytes before a boundary at off, so that it carries
+ * on from there as if it had chunked the file up to it.
+ */
+static void chunk_resume(rabinpoly_t *rp, const char *base, off_t off) {
+    // the engine only reads the end of it, as far back as its window goes
+    off_t history = off < (off_t) UINT_MAX ? off : (off_t) UINT_MAX;
+    rabin_resume(rp, base + off - history, history);
+}
+
+/*
+ * Chunks base[off, end) with rp up to the first boundary, setting *cut if
+ * there is one. Returns the offset reached, or -errno.
+ */
+static off_t chunk_next(rabinpoly_t *rp, const char *base, off_t off, off_t end, bool *cut) {
+    *cut = false;
+    while (off < end && !*cut) {
+        unsigned int bytes = end - off < CHUNKER_BATCH ? end - off : CHUNKER_BATCH;
+        int new_segment = 0;
+        int len = rabin_segment_next(rp, base + off, bytes, &new_segment);
+        if (len < 0) {
+            return -EINVAL;
+        }
+        off += len;
+        *cut = new_segment;
+    }
+    return off;
+}
+
+static void region_run(const pool_job &job) {
+    chunk_region *region = job.region;
+    rabinpoly_t *rp = rabin_dup(job.rp);
+    if (rp == NULL) {
+        region->error = -ENOMEM;
+        return;
+    }
+    chunk_resume(rp, job.base, region->start);
+    off_t off = region->start;
+    bool cut;
+    while (off < region->end) {
+        off = chunk_next(rp, job.base, off, region->end, &cut);
+        if (off < 0) {
+            region->error = off;
+            break;
+        }
+        if (cut) {
+            region->cuts.push_back(off);
+        }
+    }
+    rabin_free(&rp);
+}
+
+/*
+ * Runs the front job outside the lock and marks it done. Called and
+ * returns with the lock held.
+ */
+static void job_take(std::unique_lock<std::mutex> &lock) {
+    pool_job job = std::move(jobs.front());
+    jobs.pop_front();
+    lock.unlock();
+    if (job.region != NULL) {
+        region_run(job);
+    } else {
+        hash_run(job);
+    }
+    lock.lock();
+    job.batch->pending--;
+    pool_cond.notify_all();
+}
+
+static void worker_loop() {
+    std::unique_lock<std::mutex> lock(pool_mutex);
+    for (;;) {
+        while (jobs.empty() && !pool_stop) {
+            pool_cond.wait(lock);
+        }
+        if (jobs.empty()) {
+            return;
+        }
+        job_take(lock);
+    }
+}
+
+static void job_queue(pool_job &job) {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    job.batch->pending++;
+    jobs.push_back(std::move(job));
+    pool_cond.notify_one();
+    job.segs.clear();
+}
+
+// hashes queued jobs, of any file, until those of batch are all done
+static void batch_wait(job_batch *batch) {
+    std::unique_lock<std::mutex> lock(pool_mutex);
+    while (batch->pending > 0) {
+        if (!jobs.empty()) {
+            job_take(lock);
+        } else {
+            pool_cond.wait(lock);
+        }
+    }
+}
+
+/*
+ * Starts threads - 1 workers, the caller of chunker_segment_fd being the
+ * last one. With threads <= 1 the pipeline stays off. With regions, the
+ * chunking of a file is split up among the threads as well.
+ * Returns 0 or -errno.
+ */
+int chunker_init(int threads, bool regions) {
+    pool_stop = false;
+    use_regions = regions;
+    for (int i = 1; i < threads; i++) {
+        try {
+            workers.push_back(std::thread(worker_loop));
+        } catch (const std::system_error &e) {
+            chunker_destroy();
+            return -e.code().value();
+        }
+    }
+    return 0;
+}
+
+/*
+ * Finishes the queued jobs and stops the workers.
+ */
+void chunker_destroy() {
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        pool_stop = true;
+        pool_cond.notify_all();
+    }
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+    workers.clear();
+}
+
+bool chunker_enabled() {
+    return !workers.empty();
+}
+
+static seg_info_p seg_new(off_t offset, long size) {
+    seg_info_p seg = (seg_info_p) malloc(sizeof(seg_info_t));
+    if (seg == NULL) {
+        return NULL;
+    }
+    seg->seg_offset = offset;
+    seg->seg_size = size;
+    memset(seg->md5, '\0', 2 * MD5_DIGEST_LENGTH + 1);
+    return seg;
+}
+
+/*
+ * Finds the segments of base[0, size) by chunking its regions in parallel
+ * and stitching their cuts. A region was chunked as if a segment started
+ * at its start; once chunking on from the last true cut before it meets
+ * one of its cuts, both are in the same state and the rest of its cuts
+ * are true as well. Only the first region is known to start on a cut, so
+ * the stitching rechunks a few segments of each of the others, or all of
+ * one where they never meet.
+ * Returns 0 or -errno.
+ */
+static int chunk_regions(const char *base, off_t size, rabinpoly_t *rp, std::vector<off_t> &cuts) {
+    off_t nregions = size / CHUNKER_REGION;
+    if (nregions > (off_t) (workers.size() + 1) * 4) {
+        nregions = (workers.size() + 1) * 4;
+    }
+    std::vector <chunk_region> regions(nregions);
+    job_batch batch;
+    batch.pending = 0;
+    for (off_t k = 0; k < nregions; k++) {
+        regions[k].start = size / nregions * k;
+        regions[k].end = k + 1 < nregions ? size / nregions * (k + 1) : size;
+        regions[k].error = 0;
+        pool_job job;
+        job.base = base;
+        job.region = &regions[k];
+        job.rp = rp;
+        job.batch = &batch;
+        job_queue(job);
+    }
+    batch_wait(&batch);
+
+    off_t last = 0;
+    for (off_t k = 0; k < nregions; k++) {
+        chunk_region &region = regions[k];
+        if (region.error < 0) {
+            return region.error;
+        }
+        if (last >= region.end) {
+            continue;
+        }
+        size_t j = 0;
+        bool met = last == region.start;
+        off_t off = last;
+        if (!met) {
+            chunk_resume(rp, base, last);
+        }
+        // chunk on from the last true cut until it meets one of the region
+        while (!met && off < region.end) {
+            bool cut;
+            off = chunk_next(rp, base, off, region.end, &cut);
+            if (off < 0) {
+                return off;
+            }
+            if (!cut) {
+                break;
+            }
+            cuts.push_back(off);
+            last = off;
+            while (j < region.cuts.size() && region.cuts[j] < last) {
+                j++;
+            }
+            met = j < region.cuts.size() && region.cuts[j] == last;
+        }
+        if (met) {
+            while (j < region.cuts.size() && region.cuts[j] <= last) {
+                j++;
+            }
+            cuts.insert(cuts.end(), region.cuts.begin() + j, region.cuts.end());
+            if (!cuts.empty()) {
+                last = cuts.back();
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Appends the segments of the size bytes of fd to segs, chunked with rp,
+ * which has to be fresh or reset. On an error, segs may be left with
+ * segments that have no key yet.
+ * Returns 0 or -errno.
+ */
+int chunker_segment_fd(int fd, off_t size, rabinpoly_t *rp, std::vector <seg_info_p> &segs) {
+    if (size == 0) {
+        return 0;
+    }
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        return -errno;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    const char *base = (const char *) map;
+    job_batch batch;
+    batch.pending = 0;
+    pool_job job;
+    job.base = base;
+    job.region = NULL;
+    job.rp = rp;
+    job.batch = &batch;
+    size_t job_bytes = 0;
+
+    // with regions, all cuts are known before any hashing starts
+    std::vector<off_t> cuts;
+    size_t next_cut = 0;
+    bool regions = use_regions && size >= 2 * CHUNKER_REGION;
+    int ret = regions ? chunk_regions(base, size, rp, cuts) : 0;
+
+    off_t off = 0, seg_start = 0;
+    while (ret == 0 && off < size) {
+        bool new_segment = false;
+        if (regions) {
+            off = next_cut < cuts.size() ? cuts[next_cut++] : size;
+            new_segment = true;
+        } else {
+            unsigned int bytes = size - off < CHUNKER_BATCH ? size - off : CHUNKER_BATCH;
+            int is_new_segment = 0;
+            int len = rabin_segment_next(rp, base + off, bytes, &is_new_segment);
+            if (len < 0) {
+                ret = -EINVAL;
+                break;
+            }
+            off += len;
+            new_segment = is_new_segment;
+        }
+        if (!new_segment && off < size) {
+            continue;
+        }
+        seg_info_p seg = seg_new(seg_start, off - seg_start);
+        if (seg == NULL) {
+            ret = -ENOMEM;
+            break;
+        }
+        segs.push_back(seg);
+        job.segs.push_back(seg);
+        job_bytes += seg->seg_size;
+        seg_start = off;
+        if (job_bytes >= CHUNKER_BATCH || off == size) {
+            job_queue(job);
+            job_bytes = 0;
+        }
+    }
+
+    batch_wait(&batch);
+    munmap(map, size);
+    return ret;
+}
@@ -0,0 +1,48 @@
+//
+// Created by Wilson_Xu on 2021/12/13.
+//
+
+#ifndef SRC_MYCHUNKER_H
+#define SRC_MYCHUNKER_H
+
+#include <sys/types.h>
+#include <openssl/md5.h>
+
+#include <vector>
+
+#include "dedup.h"
+#include "mydedup.h"
+
+/*
+ * Chunk-and-hash pipeline for migrating large files. The file is mapped
+ * and read ahead by the kernel; the calling thread finds the segment
+ * boundaries with the chunking engine and hands the segments, in batches
+ * of about CHUNKER_BATCH bytes, to a pool of workers that compute their
+ * MD5s. Once done chunking, the caller helps with the hashing. The
+ * segments come out in file order, with the same sizes and keys as from
+ * the serial loop of mydedup_segmentation.
+ *
+ * Files below CHUNKER_MIN_FILE are left to that loop, where starting the
+ * workers on a few segments costs more than it saves.
+ *
+ * Optionally the chunking is parallel too: the file is split into regions
+ * of at least CHUNKER_REGION bytes, which the workers chunk each as if a
+ * segment started there, and the caller stitches their boundaries into
+ * the ones chunking the file from the start would give.
+ *
+ * Thread safe; several files may go through the pool at once. The pool's
+ * lock is a leaf.
+ */
+#define CHUNKER_BATCH (1 << 20)
+#define CHUNKER_MIN_FILE (4 << 20)
+#define CHUNKER_REGION (4 << 20)
+
+int chunker_init(int threads, bool regions);
+
+void chunker_destroy();
+
+bool chunker_enabled();
+
+int chunker_segment_fd(int fd, off_t size, rabinpoly_t *rp, std::vector <seg_info_p> &segs);
+
+#endif //SRC_MYCHUNKER_H
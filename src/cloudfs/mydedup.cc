@@ -17,20 +17,32 @@
 #include <sys/types.h>
 #include <sys/xattr.h>
 #include <openssl/md5.h>
+#include <pthread.h>
 #include <time.h>
 #include <unistd.h>
 
 
+#include <algorithm>
 #include <vector>
 #include <fstream>
 #include <string>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <mutex>
+#include <condition_variable>
+#include <iterator>
 
 #include "cloudapi.h"
 #include "dedup.h"
 #include "cloudfs.h"
 #include "mydedup.h"
 #include "mycache.h"
+#include "mychunker.h"
+#include "myrecipe.h"
+#include "mymeta.h"
+#include "mysegidx.h"
+#include "mylock.h"
 
 #define BUF_SIZE (1024)
 
@@ -60,23 +72,55 @@
 #define N_DIRTY 0
 #define DIRTY 1
 #define MAX_SEG_AMOUNT 2048
+// buffered write bytes per open file before they are merged into the recipe
+#define WRITE_BUFFER_MAX (16 * 1024 * 1024)
+// back to back reads of a large file before they count as a scan
+#define SCAN_MIN_RUN (1024 * 1024)
 
 
 #define BUCKET ("test")
 #define TEMPDIR (".tempfiles")
 #define FILEPROXYDIR (".fileproxy")
-#define SEGPROXYDIR (".segproxy")
 #define TEMPSEGDIR (".tempsegs")
 #define SNAPSHOT (".snapshot")
 #define CACHEDIR (".cache")
 
-static rabinpoly_t *rp;
 struct dedup_config de_cfg_s;
 struct dedup_config *de_cfg;
 #define SEEFILE(x) debug_showfile((x), __func__, __LINE__)
 #define FFOPEN__(x, y) ffopen_(__func__, (x), (y))
 #define FFCLOSE__(x) ffclose_(__func__, (x))
 
+// Serializes read-modify-write of segment reference counts between FUSE
+// threads. Always taken before the cache lock, never after it, and not held
+// across cloud requests: a segment whose first reference is being uploaded
+// or whose last one is being deleted is in refs_busy meanwhile, and other
+// references to it wait for that to finish.
+static std::mutex ref_mutex;
+static std::condition_variable refs_cond;
+static std::unordered_set<std::string> refs_busy;
+
+// ref_mutex must be held
+static void refs_wait(std::unique_lock<std::mutex> &lock, const char *md5) {
+    while (refs_busy.count(md5) > 0) {
+        refs_cond.wait(lock);
+    }
+}
+
+static void refs_done(const char *md5) {
+    std::lock_guard<std::mutex> lock(ref_mutex);
+    refs_busy.erase(md5);
+    refs_cond.notify_all();
+}
+
+void mydedup_lock_refs() {
+    ref_mutex.lock();
+}
+
+void mydedup_unlock_refs() {
+    ref_mutex.unlock();
+}
+
 
 FILE *ffopen_(const char *func, const char *filename, const char *mode) {
     FILE *r = fopen(filename, mode);
@@ -117,6 +161,10 @@ void debug_pseg(const char *segname, std::vector <seg_info_p> segs) {
 void mydedup_init(int window_size, int avg_seg_size, int min_seg_size, int max_seg_size, FILE *logfile,
                   struct cloudfs_state *fstate) {
     de_cfg = &de_cfg_s;
+    de_cfg->engine = dedup_engine_find(fstate->chunker);
+    if (de_cfg->engine < 0) {
+        de_cfg->engine = DEDUP_ENGINE_RABIN;
+    }
     de_cfg->window_size = window_size;
     de_cfg->avg_seg_size = avg_seg_size;
     de_cfg->min_seg_size = min_seg_size;
@@ -125,12 +173,35 @@ void mydedup_init(int window_size, int avg_seg_size, int min_seg_size, int max_s
     de_cfg->fstate = fstate;
 
     PF("[%s]:\n", __func__);
+    // the index is built from the per-segment cache files of older
+    // versions, which the cache moves into its slab store
+    int ret = segidx_init(fstate->ssd_path);
+    if (ret < 0) {
+        PF("[%s]: open segment index failed with reason [%s] ERROR\n", __func__, strerror(-ret));
+    }
     mycache_init(logfile, fstate);
+    recipe_cache_init();
+    ret = recipe_recover(fstate->ssd_path);
+    if (ret < 0) {
+        PF("[%s]: recover recipes failed with reason [%s] ERROR\n", __func__, strerror(-ret));
+    }
+    ret = chunker_init(fstate->ingest_threads, fstate->ingest_regions);
+    if (ret < 0) {
+        PF("[%s]: start ingest threads failed with reason [%s] ERROR\n", __func__, strerror(-ret));
+    }
 
 }
 
 void mydedup_destroy() {
+    chunker_destroy();
+    recipe_cache_destroy();
+    segidx_destroy();
 
+    dedup_stats_t stats;
+    dedup_stats_get(&stats);
+    PF("[%s]: chunking calls %llu, bytes %llu, segments %llu\n", __func__, stats.calls, stats.bytes,
+       stats.segments);
+    dedup_stats_flush();
 
 }
 
@@ -144,7 +215,9 @@ void get_tempfile_path_dedup(char *tempfile_path, char *path_s, int bufsize) {
             path_t[i] = '+';
         }
     }
-    snprintf(tempfile_path, bufsize, "%s%s/%s.tempfile", de_cfg->fstate->ssd_path, TEMPDIR, path_t + 1);
+    // one temp file per thread, so concurrent readers of a file do not clobber each other
+    snprintf(tempfile_path, bufsize, "%s%s/%s.%lu.tempfile", de_cfg->fstate->ssd_path, TEMPDIR, path_t + 1,
+             (unsigned long) pthread_self());
     PF("[%s]\t fileproxy_path is %s\n", __func__, tempfile_path);
 }
 
@@ -163,11 +236,6 @@ void get_fileproxy_path(char *fileproxy_path, char *path_s, int bufsize) {
     PF("[%s]\t fileproxy_path is %s\n", __func__, fileproxy_path);
 }
 
-void get_seg_proxy_path(char *seg_proxy_path, const char *md5, int bufsize) {
-    snprintf(seg_proxy_path, bufsize, "%s%s/%s.segproxy", de_cfg->fstate->ssd_path, SEGPROXYDIR, md5);
-//    PF("[%s]: md5: %s\t tempseg_path:%s\n", __func__, md5, seg_proxy_path);
-}
-
 void get_tempseg_path(char *tempseg_path, const char *md5, int bufsize) {
 
     snprintf(tempseg_path, bufsize, "%s%s/%s.tempseg", de_cfg->fstate->ssd_path, TEMPSEGDIR, md5);
@@ -196,10 +264,24 @@ int mydedup_segmentation(char *fpath, std::vector <seg_info_p> &segs) {
         return ret;
     }
 
-    rp = rabin_init(de_cfg->window_size, de_cfg->avg_seg_size, de_cfg->min_seg_size, de_cfg->max_seg_size);
+    rabinpoly_t *rp = rabin_init_engine(de_cfg->engine, de_cfg->window_size, de_cfg->avg_seg_size,
+                                        de_cfg->min_seg_size, de_cfg->max_seg_size);
 
     if (!rp) {
         ret = cloudfs_error(__func__);
+        close(fd);
+        return ret;
+    }
+
+    struct stat st;
+    if (chunker_enabled() && fstat(fd, &st) == 0 && st.st_size >= CHUNKER_MIN_FILE) {
+        ret = chunker_segment_fd(fd, st.st_size, rp, segs);
+        if (ret < 0) {
+            PF("[%s]: segmenting %s failed with reason [%s] ERROR\n", __func__, fpath, strerror(-ret));
+        }
+        PF("[%s] number of seg is %zu\n", __func__, segs.size());
+        rabin_free(&rp);
+        close(fd);
         return ret;
     }
 
@@ -278,19 +360,20 @@ int mydedup_segmentation(char *fpath, std::vector <seg_info_p> &segs) {
 
     PF("[%s] number of seg is %zu\n", __func__, segs.size());
 //    debug_pseg(__func__, segs);
+    rabin_free(&rp);
     close(fd);
+    return ret;
 }
 
 
 int mydedup_down_segs(char *path_s, std::vector <seg_info_p> &segs) {
     PF("[%s]:path_s: %s\n", __func__, path_s);
     long ret = 0;
-    outfile = FFOPEN__(path_s, "wb");//closed
+    FILE *outfile = FFOPEN__(path_s, "wb");//closed
 
 
     if (outfile == NULL) {
         ret = cloudfs_error(__func__);
-        FFCLOSE__(outfile);
         return ret;
     }
     PF("[%s]: size is %zu\n", __func__, segs.size());
@@ -298,7 +381,7 @@ int mydedup_down_segs(char *path_s, std::vector <seg_info_p> &segs) {
         PF("[%s]: i: %d   cloud_get_cache(BUCKET, %s, get_buffer);\n", __func__, i, segs[i]->md5);
 //        cloud_get_object(BUCKET, segs[i]->md5, get_buffer);
 
-        cloud_get_cache(segs[i]->md5, segs[i]->seg_size);
+        cloud_get_cache(segs[i]->md5, segs[i]->seg_size, outfile);
         PF("[%s]: i: %d   cloud_get_cache(BUCKET, %s, get_buffer);\n", __func__, i, segs[i]->md5);
     }
     PF("[%s]: FFCLOSE__\n", __func__);
@@ -310,66 +393,70 @@ int mydedup_down_segs(char *path_s, std::vector <seg_info_p> &segs) {
 
 
 
+static void mydedup_upload_stream(FILE *infile, std::vector <seg_info_p> &segs);
+
 void mydedup_upload_segs(char *path_s, std::vector <seg_info_p> &segs) {
-    int ret = 0;
-    infile = FFOPEN__(path_s, "rb");
+    FILE *infile = FFOPEN__(path_s, "rb");
+    mydedup_upload_stream(infile, segs);
+    FFCLOSE__(infile);
+}
 
+// segs are laid out back to back in infile, starting at its current position
+static void mydedup_upload_stream(FILE *infile, std::vector <seg_info_p> &segs) {
+    // with the cache enabled a new segment is only written back on eviction
+    int loc = de_cfg->fstate->cache_size ? SEG_LOC_CACHE : SEG_LOC_CLOUD;
     for (int i = 0; i < segs.size(); i++) {
-        char seg_proxy_path[MAX_PATH_LEN];
-        get_seg_proxy_path(seg_proxy_path, segs[i]->md5, MAX_PATH_LEN);
         PF("[%s] seg[%d]->md5 = %s\n", __func__, i, segs[i]->md5);
 
-//        PF("[%s] %d:  \n", __func__, __LINE__);
-//        debug_pseg(__func__,segs);
-        if (!file_exist(seg_proxy_path)) {
-
-            FILE *fp = FFOPEN__(seg_proxy_path, "w");
-            FFCLOSE__(fp);
-            set_ref(seg_proxy_path, 1);//initial reference value
-
-//            cloud_put_object(BUCKET, segs[i]->md5, segs[i]->seg_size, put_buffer);
-            cloud_put_cache(segs[i]->md5, segs[i]->seg_size);
+        int refcnt;
+        {
+            std::unique_lock<std::mutex> lock(ref_mutex);
+            refs_wait(lock, segs[i]->md5);
+            refcnt = segidx_incref(segs[i]->md5, segs[i]->seg_size, loc);
+            if (refcnt <= 1) {
+                refs_busy.insert(segs[i]->md5);
+            }
+        }
+        if (refcnt < 0) {
+            PF("[%s]: index %s failed with reason [%s] ERROR\n", __func__, segs[i]->md5, strerror(-refcnt));
+        }
+        if (refcnt <= 1) {
+            cloud_put_cache(segs[i]->md5, segs[i]->seg_size, infile);
+            refs_done(segs[i]->md5);
             PF("[%s] cloud_put_cache with key %s\n", __func__, segs[i]->md5);
         } else {
             //already in cloud or cache
-//            cloud_access_cache(segs[i]->md5, segs[i]->seg_size);
-//            cache_get(segs[i]->md5);
-            // T    O DO
-            // IS THIS THE BEST WAY?
-            int refcnt = 0;
-            get_ref(seg_proxy_path, &refcnt);
-            set_ref(seg_proxy_path, refcnt + 1);//refcnt plus one
             fseek(infile, segs[i]->seg_size, SEEK_CUR);
         }
-
-
-//        PF("[%s] %d:  \n", __func__, __LINE__);
-//        debug_pseg(__func__,segs);
-
     }
-    FFCLOSE__(infile);
 
 }
 
 
-void mydedup_upload_file(char *path_s) {
+/*
+ * Moves the SSD file path_s to cloud: its data is chunked and uploaded, and
+ * the recipe then takes the place of the data, together with the proxy and
+ * the location. If that fails the plain file is left as it was.
+ * Returns 0 or -errno.
+ */
+int mydedup_upload_file(char *path_s) {
     std::vector <seg_info_p> segs;
-    mydedup_segmentation(path_s, segs);
-    mydedup_upload_segs(path_s, segs);
-
-    FILE *fp_fileproxy = FFOPEN__(path_s, "w");//closed
-
-
-    if (fp_fileproxy == NULL) {
-        PF("[%s]:open %s at line %d failed with reason [%s] ERROR\n", __func__, path_s, __LINE__, strerror(errno));
-        PF("[%s]:open %s %d ERROR\n", __func__, path_s, __LINE__);
+    int ret = mydedup_segmentation(path_s, segs);
+    if (ret < 0) {
+        recipe_free_segs(segs);
+        return ret;
     }
+    mydedup_upload_segs(path_s, segs);
 
-    for (int i = 0; i < segs.size(); i++) {
-        fprintf(fp_fileproxy, "%s %ld\n", segs[i]->md5, segs[i]->seg_size);
+    off_t size = recipe_write(path_s, segs);
+    recipe_invalidate(path_s);
+    if (size < 0) {
+        PF("[%s]:write recipe %s failed with reason [%s] ERROR\n", __func__, path_s, strerror(-size));
+        mydedup_remove_segs(segs);
+        ret = size;
     }
-
-    FFCLOSE__(fp_fileproxy);
+    recipe_free_segs(segs);
+    return ret;
 }
 
 int mydedup_getattr(const char *pathname, struct stat *statbuf) {
@@ -386,14 +473,9 @@ int mydedup_getattr(const char *pathname, struct stat *statbuf) {
         return -errno;
     } else {
         if (is_on_cloud(path_s)) {
-            size_t total = 0;
-//            size_t segsize = 0;
+            off_t total = 0;
             get_from_proxy(path_s, statbuf);
-            std::vector <seg_info_p> segs;
-            mydedup_get_seginfo(path_s, segs);
-            for (int j = 0; j < segs.size(); j++) {
-                total += segs[j]->seg_size;
-            }
+            recipe_size(path_s, &total);
             statbuf->st_size = total;
             PF("[%s]:\tfile %s have size: %zu\n", __func__, pathname, statbuf->st_size);
         }
@@ -406,171 +488,602 @@ int mydedup_getattr(const char *pathname, struct stat *statbuf) {
 
 void mydedup_get_seginfo(const char *path_s, std::vector <seg_info_p> &segs) {
     PF("[%s]: reading seglist from file\n", __func__);
-    FILE *fp_fileproxy = FFOPEN__(path_s, "r");
-//    SEEFILE(path_s);
-    int num_seg = -1;
-    while (!feof(fp_fileproxy)) {
-
-        char line[MAX_PATH_LEN] = "";
-        fgets(line, MAX_PATH_LEN, fp_fileproxy);
-        if (!line[0]) {
-            break;
-        }
+    if (recipe_read(path_s, segs) < 0) {
+        PF("[%s]: reading %s failed [%s]\n", __func__, path_s, strerror(errno));
+    }
+    PF("[%s]: read %zu segments from file\n", __func__, segs.size());
+}
 
-        num_seg += 1;
-//        PF("[%s]: [%s]\n", __func__, line);
-        seg_info_p new_seg = (seg_info_p) malloc(sizeof(seg_info_t));//freed
 
-        memset(new_seg->md5, '\0', 2 * MD5_DIGEST_LENGTH + 1);
-        memcpy(new_seg->md5, line, 2 * MD5_DIGEST_LENGTH);
-        char *num_line = line + (2 * MD5_DIGEST_LENGTH + 1);
+// Handles holding buffered writes, by inode, so that truncate, unlink and
+// snapshots can settle them first, and the number of open handles of each
+// inode. Only touched under the file's inode lock.
+static std::mutex wb_mutex;
+static std::unordered_multimap<ino_t, struct dedup_handle *> wb_handles;
+static std::unordered_map<ino_t, int> wb_opened;
 
+static void wb_register(struct dedup_handle *h) {
+    std::lock_guard<std::mutex> lock(wb_mutex);
+    wb_handles.insert(std::make_pair(h->ino, h));
+}
 
-        sscanf(num_line, "%ldn", &(new_seg->seg_size));
+static void wb_unregister(struct dedup_handle *h) {
+    std::lock_guard<std::mutex> lock(wb_mutex);
+    auto range = wb_handles.equal_range(h->ino);
+    for (auto it = range.first; it != range.second; ++it) {
+        if (it->second == h) {
+            wb_handles.erase(it);
+            return;
+        }
+    }
+}
 
-        segs.push_back(new_seg);
-//        PF("[%s]: md5: %s\t seg_size: %zu\n", __func__, new_seg->md5, new_seg->seg_size);
+static std::vector<struct dedup_handle *> wb_lookup(const char *path_s) {
+    std::vector<struct dedup_handle *> hs;
+    struct stat statbuf;
+    if (lstat(path_s, &statbuf) < 0) {
+        return hs;
     }
-    FFCLOSE__(fp_fileproxy);
-    PF("[%s]: read %d segments from file\n", __func__, num_seg + 1);
+    std::lock_guard<std::mutex> lock(wb_mutex);
+    auto range = wb_handles.equal_range(statbuf.st_ino);
+    for (auto it = range.first; it != range.second; ++it) {
+        hs.push_back(it->second);
+    }
+    return hs;
 }
 
+// keeps h listed in wb_handles exactly while it has writes pending
+static void wb_track(struct dedup_handle *h) {
+    int pending = !h->dirty.empty() || h->ingest != NULL;
+    if (pending && !h->tracked) {
+        wb_register(h);
+    } else if (!pending && h->tracked) {
+        wb_unregister(h);
+    }
+    h->tracked = pending;
+}
 
-int mydedup_write(const char *pathname UNUSED, const char *buf UNUSED, size_t size UNUSED, off_t offset UNUSED,
-                  struct fuse_file_info *fi) {
+static void wb_clear(struct dedup_handle *h) {
+    h->dirty.clear();
+    h->dirty_bytes = 0;
+    h->dirty_end = 0;
+    wb_track(h);
+}
 
-    PF("[%s]:\t pathname: %s\t offset: %zu\n", __func__, pathname, offset);
-    PF("[%s]:\t pathname: %s\t offset: %zu\n", __func__, pathname, offset);
-    int ret = 0;
-    char path_s[MAX_PATH_LEN];
-    get_path_s(path_s, pathname, MAX_PATH_LEN);
-    int loc = ON_SSD;
-    get_loc(path_s, &loc);
+static void wb_open(struct dedup_handle *h) {
+    std::lock_guard<std::mutex> lock(wb_mutex);
+    wb_opened[h->ino]++;
+}
 
-    if (loc == ON_SSD) {
-        PF("[%s]:\t pathname: %s is local\n", __func__, path_s, offset);
-//        ret = cloudfs_write_node(pathname, buf, size, offset, fi);
-        int fd = open(path_s, O_WRONLY);
-        ret = pwrite(fd, buf, size, offset);
-        close(fd);
+static void wb_close(struct dedup_handle *h) {
+    std::lock_guard<std::mutex> lock(wb_mutex);
+    auto it = wb_opened.find(h->ino);
+    if (it != wb_opened.end() && --it->second == 0) {
+        wb_opened.erase(it);
+    }
+}
 
-        //read stat
-        struct stat statbuf;
-        lstat(path_s, &statbuf);
-        //upload and save stat to proxy
-        if (offset + size > de_cfg->fstate->threshold) {
-            PF("[%s] uploading %s", __func__, path_s);
-            mydedup_upload_file(path_s);
-            clone_2_proxy(path_s, &statbuf);
+// whether h is the only handle open on its inode, under any name
+static bool wb_sole_open(struct dedup_handle *h) {
+    std::lock_guard<std::mutex> lock(wb_mutex);
+    auto it = wb_opened.find(h->ino);
+    return it != wb_opened.end() && it->second == 1;
+}
 
-            set_loc(path_s, ON_CLOUD);
+// once no handle holds writes to path_s, its size is the recipe's again
+static void wb_settled(const char *path_s, off_t size) {
+    if (size >= 0 && wb_lookup(path_s).empty()) {
+        mymeta_set_size(path_s, size, 0);
+    }
+}
+
+/*
+ * Adds a write to the buffer of h, merging it with every extent it overlaps
+ * or touches. Sequential writes just grow the same extent.
+ */
+static void wb_insert(struct dedup_handle *h, const char *buf, size_t size, off_t offset) {
+    auto it = h->dirty.upper_bound(offset);
+    if (it != h->dirty.begin()) {
+        auto prev = std::prev(it);
+        if (prev->first + (off_t) prev->second.size() >= offset) {
+            it = prev;
         }
-    } else {
+    }
+    if (it == h->dirty.end() || it->first > offset) {
+        it = h->dirty.insert(it, std::make_pair(offset, std::string()));
+    }
 
-        std::vector <seg_info_p> segs;
-        mydedup_get_seginfo(path_s, segs);
+    std::string &data = it->second;
+    size_t old_len = data.size();
+    size_t rel = offset - it->first;
+    if (rel + size > data.size()) {
+        data.resize(rel + size);
+    }
+    memcpy(&data[rel], buf, size);
+    h->dirty_bytes += data.size() - old_len;
+
+    off_t ext_end = it->first + data.size();
+    auto next = std::next(it);
+    while (next != h->dirty.end() && next->first <= ext_end) {
+        off_t next_end = next->first + next->second.size();
+        h->dirty_bytes -= next->second.size();
+        if (next_end > ext_end) {
+            size_t tail = next_end - ext_end;
+            data.append(next->second, next->second.size() - tail, tail);
+            h->dirty_bytes += tail;
+            ext_end = next_end;
+        }
+        next = h->dirty.erase(next);
+    }
+    if (ext_end > h->dirty_end) {
+        h->dirty_end = ext_end;
+    }
+    wb_track(h);
+}
 
-        PF("[%s]:\t pathname: %s is on cloud\n", __func__, path_s, offset);
-        size_t upperbound = 0;
-        size_t lowerbound = 0;
-        size_t offset_change = 0;
-        std::vector <seg_info_p> oldseg1, related_segs, oldseg2;
-        int after = 1;
-        int prev = 1;
-
-        for (int i = 0; i < segs.size(); i++) {
-            lowerbound = upperbound;
-            upperbound += segs[i]->seg_size;
-            if (upperbound < offset) {
-                oldseg1.push_back(segs[i]);
-                offset_change = upperbound;
-//                PF("[%s]:\t oldseg1.push_back(%s);\n", __func__, segs[i]->md5);
-            } else if (lowerbound >= offset + size) {
-                if (after > 0) {//N+2 SCHEME
-                    related_segs.push_back(segs[i]);
-
-//                    PF("[%s]:\t related_segs.push_back(%s);\n", __func__, segs[i]->md5);
-                    after--;
-                } else {
-                    oldseg2.push_back(segs[i]);
-//                    PF("[%s]:\t oldseg2.push_back(%s);\n", __func__, segs[i]->md5);
-                }
-            } else {
-                if (prev > 0) {
-                    if (offset_change > 0) {
-                        related_segs.push_back(oldseg1[oldseg1.size() - 1]);
-
-//                        PF("[%s]:\t related_segs.push_back(%s);\n", __func__, oldseg1[oldseg1.size() - 1]->md5);
-//                        PF("[%s]:\t oldseg1.pop_back(%s);\n", __func__, oldseg1[oldseg1.size() - 1]->md5);
-                        offset_change -= oldseg1[oldseg1.size() - 1]->seg_size;
-                        oldseg1.pop_back();
-                    }
-                    prev--;
-                }
-                related_segs.push_back(segs[i]);
-//                PF("[%s]:\t related_segs.push_back(%s);\n", __func__, segs[i]->md5);
-            }
+// copies the buffered bytes of h that fall in [offset, offset + size) over buf
+static void wb_overlay(struct dedup_handle *h, char *buf, size_t size, off_t offset) {
+    auto it = h->dirty.upper_bound(offset);
+    if (it != h->dirty.begin()) {
+        --it;
+    }
+    for (; it != h->dirty.end() && it->first < offset + (off_t) size; ++it) {
+        off_t from = std::max(it->first, offset);
+        off_t to = std::min(it->first + (off_t) it->second.size(), offset + (off_t) size);
+        if (from < to) {
+            memcpy(buf + (from - offset), it->second.data() + (from - it->first), to - from);
         }
+    }
+}
+
+/*
+ * Streaming ingest: appends at the end of a file are run through a per-open
+ * Rabin/MD5 state as they arrive. Every completed segment is uploaded right
+ * away from memory; only the segment still being formed is held back, and
+ * the recipe is written once when the stream is finished.
+ */
+struct ingest_state {
+    rabinpoly_t *rp;
+    MD5_CTX ctx;
+    std::string pending;            // bytes of the segment being formed
+    off_t end;                      // where the next append has to land
+    std::vector <seg_info_p> segs;  // the recipe so far, pending bytes excluded
+    size_t kept;                    // leading segs taken over from the recipe
+    seg_info_p reopened;            // old last segment fed again at start
+};
+
+static int ingest_init(struct ingest_state *in, off_t start) {
+    in->rp = rabin_init_engine(de_cfg->engine, de_cfg->window_size, de_cfg->avg_seg_size, de_cfg->min_seg_size,
+                               de_cfg->max_seg_size);
+    if (!in->rp) {
+        return -EINVAL;
+    }
+    MD5_Init(&in->ctx);
+    in->end = start;
+    in->kept = 0;
+    in->reopened = NULL;
+    return 0;
+}
 
+/*
+ * Hands the engine of in the last bytes of segs, the file up to in->end, so
+ * that it chunks on from that boundary as if it had chunked the whole file:
+ * a fresh state there would cut differently from a full pass until its
+ * window has filled. Returns 0 or -errno.
+ */
+static int ingest_resume(struct ingest_state *in, std::vector <seg_info_p> &segs) {
+    // the gear hash keeps no state across a boundary
+    if (de_cfg->engine == DEDUP_ENGINE_GEAR) {
+        return 0;
+    }
+    std::string history;
+    for (size_t i = segs.size(); i > 0 && history.size() < (size_t) de_cfg->window_size; i--) {
+        seg_info_p seg = segs[i - 1];
+        size_t len = std::min((size_t) seg->seg_size, de_cfg->window_size - history.size());
+        std::string data(len, '\0');
+        if (cloud_read_cache(seg->md5, seg->seg_size, seg->seg_size - len, &data[0], len) != (int) len) {
+            return -EIO;
+        }
+        history.insert(0, data);
+    }
+    rabin_resume(in->rp, history.data(), history.size());
+    return 0;
+}
 
-        char temp_file_path[MAX_PATH_LEN];
-        get_tempfile_path_dedup(temp_file_path, path_s, MAX_PATH_LEN);
+static void ingest_emit(struct ingest_state *in) {
+    unsigned char md5[MD5_DIGEST_LENGTH];
+    MD5_Final(md5, &in->ctx);
 
-        mydedup_down_segs(temp_file_path, related_segs);
+    seg_info_p new_seg = (seg_info_p) malloc(sizeof(seg_info_t));
+    md5_to_hex(md5, new_seg->md5);
+    new_seg->seg_size = in->pending.size();
+    new_seg->seg_offset = in->end - in->pending.size();
 
-        int fd = open(temp_file_path, O_WRONLY);
-        PF("[%s] offset is %zu, offset_change is %zu\n", __func__, offset, offset_change);
-        ret = pwrite(fd, buf, size, offset - offset_change);
+    std::vector <seg_info_p> one(1, new_seg);
+    FILE *infile = fmemopen(&in->pending[0], in->pending.size(), "rb");
+    mydedup_upload_stream(infile, one);
+    fclose(infile);
 
-        PF("[%s] pwrite(%s, buf, %zu, %zu) returned %d\n", __func__, temp_file_path, size, offset - offset_change, ret);
+    in->segs.push_back(new_seg);
+    in->pending.clear();
+    MD5_Init(&in->ctx);
+}
 
-        close(fd);
+static int ingest_feed(struct ingest_state *in, const char *buf, size_t size) {
+    while (size > 0) {
+        int new_segment = 0;
+        int len = rabin_segment_next(in->rp, buf, size, &new_segment);
+        if (len < 0) {
+            return -EIO;
+        }
+        MD5_Update(&in->ctx, buf, len);
+        in->pending.append(buf, len);
+        in->end += len;
+        if (new_segment) {
+            ingest_emit(in);
+        }
+        buf += len;
+        size -= len;
+    }
+    return 0;
+}
 
-        std::vector <seg_info_p> updated_segs;
+static int ingest_feed_zeros(struct ingest_state *in, off_t size) {
+    static const char zeros[BUF_SIZE * 64] = {0};
+    while (size > 0) {
+        size_t len = std::min(size, (off_t) sizeof zeros);
+        int ret = ingest_feed(in, zeros, len);
+        if (ret < 0) {
+            return ret;
+        }
+        size -= len;
+    }
+    return 0;
+}
 
-        mydedup_segmentation(temp_file_path, updated_segs);
+/*
+ * Abandons the stream of h: the recipe keeps what it had before the stream
+ * started, and the segments uploaded for the stream alone are dropped again.
+ */
+static void ingest_drop(struct dedup_handle *h) {
+    struct ingest_state *in = h->ingest;
+    std::vector <seg_info_p> streamed(in->segs.begin() + in->kept, in->segs.end());
+    mydedup_remove_segs(streamed);
+    recipe_free_segs(in->segs);
+    free(in->reopened);
+    rabin_free(&in->rp);
+    delete in;
+    h->ingest = NULL;
+    wb_track(h);
+}
 
-        mydedup_upload_segs(temp_file_path, updated_segs);
+/*
+ * Starts a stream for h on a file that is on cloud: the last segment of the
+ * recipe is reopened so appends continue where it ended.
+ *
+ * Until it is finished, the recipe on the SSD lacks what the stream holds,
+ * so a stream only runs while h is the only handle open on the inode:
+ * starting one fails with -EBUSY otherwise, and opening another handle
+ * finishes it.
+ */
+static int ingest_start(struct dedup_handle *h, const char *path_s) {
+    if (!wb_sole_open(h)) {
+        return -EBUSY;
+    }
+    struct ingest_state *in = new ingest_state;
+    if (ingest_init(in, 0) < 0) {
+        delete in;
+        return -EINVAL;
+    }
 
-        mydedup_remove_segs(related_segs);
+    int ret = 0;
+    mydedup_get_seginfo(path_s, in->segs);
+    if (!in->segs.empty()) {
+        in->reopened = in->segs.back();
+        in->segs.pop_back();
+        in->kept = in->segs.size();
+        in->end = in->reopened->seg_offset;
+        ret = ingest_resume(in, in->segs);
+        if (ret == 0) {
+            std::string data(in->reopened->seg_size, '\0');
+            int n = cloud_read_cache(in->reopened->md5, in->reopened->seg_size, 0, &data[0], data.size());
+            ret = n == (int) data.size() ? ingest_feed(in, data.data(), data.size()) : -EIO;
+        }
+    }
 
+    h->ingest = in;
+    if (ret < 0) {
+        ingest_drop(h);
+        return ret;
+    }
+    wb_track(h);
+    return 0;
+}
 
-        remove(temp_file_path);
-        struct stat statbuf;
-        get_from_proxy(path_s, &statbuf);
-        statbuf.st_size = 0;
-        FILE *fp_fileproxy = FFOPEN__(path_s, "w");//closed
+static int ingest_finish(struct dedup_handle *h) {
+    struct ingest_state *in = h->ingest;
+    const char *path_s = h->path_s.c_str();
+    if (!in->pending.empty()) {
+        ingest_emit(in);
+    }
 
+    off_t size = recipe_write(path_s, in->segs);
+    recipe_invalidate(path_s);
+    if (size < 0) {
+        // the old recipe stays, and the stream with everything it uploaded
+        // is kept for the next flush to retry
+        return size;
+    }
+    if (in->reopened != NULL) {
+        mydedup_remove_one_seg(in->reopened->md5);
+        free(in->reopened);
+    }
+    recipe_free_segs(in->segs);
+    rabin_free(&in->rp);
+    delete in;
+    h->ingest = NULL;
+    wb_track(h);
 
+    wb_settled(path_s, size);
+    return 0;
+}
+
+/*
+ * Merges the buffered writes of h into the recipe in one pass.
+ *
+ * Re-chunking starts at the boundary in front of each edit, with the engine
+ * primed on the bytes before it, and stops at the first emitted boundary
+ * that lies past the edits and coincides with an old one (a content-defined
+ * resync): from there on the old chunking is what the chunker would produce
+ * again, so the rest of the recipe is spliced back in without downloading it
+ * or touching its refcounts.
+ */
+static int mydedup_flush_handle(struct dedup_handle *h) {
+    if (h->ingest != NULL) {
+        return ingest_finish(h);
+    }
+    if (h->dirty.empty()) {
+        return 0;
+    }
+    char path_s[MAX_PATH_LEN];
+    snprintf(path_s, MAX_PATH_LEN, "%s", h->path_s.c_str());
+    PF("[%s]: %s, %zu bytes in %zu extents\n", __func__, path_s, h->dirty_bytes, h->dirty.size());
+
+    int ret = 0;
+    if (!is_on_cloud(path_s)) {
+        // brought back to the SSD since the writes were buffered
+        int fd = open(path_s, O_WRONLY);
+        if (fd < 0) {
+            ret = cloudfs_error(__func__);
+        } else {
+            for (auto it = h->dirty.begin(); it != h->dirty.end(); ++it) {
+                if (pwrite(fd, it->second.data(), it->second.size(), it->first) < 0) {
+                    ret = cloudfs_error(__func__);
+                }
+            }
+            close(fd);
+        }
+        if (ret == 0) {
+            wb_clear(h);
+        }
+        return ret;
+    }
 
-        for (int i = 0; i < oldseg1.size(); i++) {
-            fprintf(fp_fileproxy, "%s %ld\n", oldseg1[i]->md5, oldseg1[i]->seg_size);
-            statbuf.st_size += oldseg1[i]->seg_size;
+    std::vector <seg_info_p> segs, new_segs, created, replaced;
+    mydedup_get_seginfo(path_s, segs);
+    int n = segs.size();
+    off_t total = n ? segs[n - 1]->seg_offset + segs[n - 1]->seg_size : 0;
+
+    int next = 0;   // first old segment neither kept nor replaced yet
+    auto it = h->dirty.begin();
+    while (it != h->dirty.end() && ret == 0) {
+        int first = n ? std::max(recipe_find(segs, it->first), next) : 0;
+        new_segs.insert(new_segs.end(), segs.begin() + next, segs.begin() + first);
+
+        struct ingest_state in;
+        if (ingest_init(&in, first < n ? segs[first]->seg_offset : total) < 0) {
+            ret = -EINVAL;
+            next = first;
+            break;
+        }
+        // new_segs holds the file as it now is up to there
+        ret = ingest_resume(&in, new_segs);
+        if (ret < 0) {
+            rabin_free(&in.rp);
+            next = first;
+            break;
         }
 
+        off_t edit_end = 0;
+        int j = first;
+        bool synced = false;
+        while (j < n && ret == 0) {
+            off_t seg_start = segs[j]->seg_offset;
+            off_t seg_end = seg_start + segs[j]->seg_size;
+            std::string data(segs[j]->seg_size, '\0');
+            if (cloud_read_cache(segs[j]->md5, data.size(), 0, &data[0], data.size()) != (int) data.size()) {
+                ret = -EIO;
+                break;
+            }
+            while (it != h->dirty.end() && it->first < seg_end) {
+                off_t it_end = it->first + it->second.size();
+                off_t from = std::max(it->first, seg_start);
+                off_t to = std::min(it_end, seg_end);
+                memcpy(&data[from - seg_start], it->second.data() + (from - it->first), to - from);
+                edit_end = std::max(edit_end, to);
+                if (it_end > seg_end) {
+                    break;
+                }
+                ++it;
+            }
+            ret = ingest_feed(&in, data.data(), data.size());
+            replaced.push_back(segs[j]);
+            j++;
+            if (in.pending.empty() && seg_end >= edit_end &&
+                (it == h->dirty.end() || it->first >= seg_end)) {
+                synced = true;
+                break;
+            }
+        }
 
-        for (int i = 0; i < updated_segs.size(); i++) {
-            fprintf(fp_fileproxy, "%s %ld\n", updated_segs[i]->md5, updated_segs[i]->seg_size);
-            statbuf.st_size += updated_segs[i]->seg_size;
+        if (!synced && ret == 0) {
+            // what is left lies past the old end of file
+            off_t pos = total;
+            for (; it != h->dirty.end() && ret == 0; ++it) {
+                off_t it_end = it->first + it->second.size();
+                off_t from = std::max(it->first, pos);
+                if (from >= it_end) {
+                    continue;
+                }
+                ret = ingest_feed_zeros(&in, from - pos);
+                if (ret == 0) {
+                    ret = ingest_feed(&in, it->second.data() + (from - it->first), it_end - from);
+                }
+                pos = it_end;
+            }
+            if (!in.pending.empty()) {
+                ingest_emit(&in);
+            }
         }
+        rabin_free(&in.rp);
+
+        new_segs.insert(new_segs.end(), in.segs.begin(), in.segs.end());
+        created.insert(created.end(), in.segs.begin(), in.segs.end());
+        next = j;
+    }
+    off_t size = 0;
+    if (ret == 0) {
+        new_segs.insert(new_segs.end(), segs.begin() + next, segs.end());
+        size = recipe_write(path_s, new_segs);
+        recipe_invalidate(path_s);
+        ret = size < 0 ? size : 0;
+    }
+    if (ret < 0) {
+        // keep the old recipe; what was uploaded for it is dropped again,
+        // and the writes stay buffered for the next flush to retry
+        mydedup_remove_segs(created);
+        recipe_free_segs(created);
+        recipe_free_segs(segs);
+        return ret;
+    }
+    // only now that no recipe points at them any more
+    mydedup_remove_segs(replaced);
 
+    recipe_free_segs(segs);
+    recipe_free_segs(created);
+
+    wb_clear(h);
+    wb_settled(path_s, size);
+    return ret;
+}
 
-        for (int i = 0; i < oldseg2.size(); i++) {
-            fprintf(fp_fileproxy, "%s %ld\n", oldseg2[i]->md5, oldseg2[i]->seg_size);
-            statbuf.st_size += oldseg2[i]->seg_size;
+// settles the buffered writes of every handle open on path_s; the caller
+// holds the inode lock of path_s
+static int wb_settle_path(const char *path_s, bool discard) {
+    int ret = 0;
+    std::vector<struct dedup_handle *> hs = wb_lookup(path_s);
+    for (size_t i = 0; i < hs.size(); i++) {
+        if (discard) {
+            if (hs[i]->ingest != NULL) {
+                ingest_drop(hs[i]);
+            }
+            wb_clear(hs[i]);
+        } else {
+            int r = mydedup_flush_handle(hs[i]);
+            if (r < 0) {
+                ret = r;
+            }
         }
+    }
+    return ret;
+}
 
+/*
+ * Flushes the buffered writes of every open file, e.g. before a snapshot.
+ * The caller holds the filesystem lock exclusively (fs_guard), which stands
+ * in for the inode locks of all of them.
+ */
+void mydedup_flush_all() {
+    std::vector<std::string> paths;
+    {
+        std::lock_guard<std::mutex> lock(wb_mutex);
+        for (auto it = wb_handles.begin(); it != wb_handles.end(); ++it) {
+            paths.push_back(it->second->path_s);
+        }
+    }
+    for (size_t i = 0; i < paths.size(); i++) {
+        wb_settle_path(paths[i].c_str(), false);
+    }
+}
 
+int mydedup_write(const char *pathname UNUSED, const char *buf UNUSED, size_t size UNUSED, off_t offset UNUSED,
+                  struct fuse_file_info *fi) {
 
+    PF("[%s]:\t pathname: %s\t offset: %zu\n", __func__, pathname, offset);
+    PF("[%s]:\t pathname: %s\t offset: %zu\n", __func__, pathname, offset);
+    int ret = 0;
+    char path_s[MAX_PATH_LEN];
+    get_path_s(path_s, pathname, MAX_PATH_LEN);
+    int loc = ON_SSD;
+    get_loc(path_s, &loc);
 
-        FFCLOSE__(fp_fileproxy);
+    if (loc == ON_SSD) {
+        PF("[%s]:\t pathname: %s is local\n", __func__, path_s, offset);
+//        ret = cloudfs_write_node(pathname, buf, size, offset, fi);
+        int fd = open(path_s, O_WRONLY);
+        ret = pwrite(fd, buf, size, offset);
+        close(fd);
 
-//        SEEFILE(path_s);
+        //upload and save stat to proxy
+        if (ret >= 0 && offset + size > de_cfg->fstate->threshold) {
+            PF("[%s] uploading %s", __func__, path_s);
+            // the write itself went through; if the move fails, the file
+            // just stays on the SSD until the next write retries it
+            if (mydedup_upload_file(path_s) == 0) {
+                // appends that follow continue from the last segment
+                ingest_start((struct dedup_handle *) fi->fh, path_s);
+            }
+        }
+    } else {
+        struct dedup_handle *h = (struct dedup_handle *) fi->fh;
+        off_t cur_size = 0;
+        if (mymeta_get_size(path_s, &cur_size) < 0) {
+            recipe_size(path_s, &cur_size);
+        }
+
+        if (h->ingest != NULL && offset != h->ingest->end) {
+            int r = ingest_finish(h);
+            if (r < 0) {
+                return r;
+            }
+        }
+        if (h->ingest == NULL && h->dirty.empty() && offset == cur_size && size > 0) {
+            ingest_start(h, path_s);
+        }
 
+        if (h->ingest != NULL) {
+            int r = ingest_feed(h->ingest, buf, size);
+            if (r < 0) {
+                return r;
+            }
+            mymeta_set_size(path_s, h->ingest->end, 1);
+            return size;
+        }
 
-        clone_2_proxy(path_s, &statbuf);
+        // buffered until flush, release or WRITE_BUFFER_MAX
+        wb_insert(h, buf, size, offset);
+        ret = size;
 
-        set_loc(path_s, ON_CLOUD);
+        if (h->dirty_end > cur_size) {
+            mymeta_set_size(path_s, h->dirty_end, 1);
+        }
+
+        if (h->dirty_bytes >= WRITE_BUFFER_MAX) {
+            int r = mydedup_flush_handle(h);
+            if (r < 0) {
+                return r;
+            }
+        }
     }
     if (ret < 0) {
         return cloudfs_error(__func__);
@@ -579,8 +1092,79 @@ int mydedup_write(const char *pathname UNUSED, const char *buf UNUSED, size_t si
 }
 
 
+int mydedup_open(const char *pathname, struct fuse_file_info *fi) {
+    PF("[%s]:\t pathname: %s\n", __func__, pathname);
+    char path_s[MAX_PATH_LEN];
+    get_path_s(path_s, pathname, MAX_PATH_LEN);
+
+    int fd = -1;
+    if (!is_on_cloud(path_s)) {
+        fd = open(path_s, fi->flags);
+        if (fd < 0) {
+            return cloudfs_error(__func__);
+        }
+    }
+
+    struct stat statbuf;
+    if (lstat(path_s, &statbuf) < 0) {
+        int ret = cloudfs_error(__func__);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return ret;
+    }
+
+    // a stream on the inode has to show in the recipe this handle reads
+    std::vector<struct dedup_handle *> hs = wb_lookup(path_s);
+    for (size_t i = 0; i < hs.size(); i++) {
+        int ret = hs[i]->ingest != NULL ? ingest_finish(hs[i]) : 0;
+        if (ret < 0) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            return ret;
+        }
+    }
+
+    struct dedup_handle *h = new dedup_handle;
+    h->fd = fd;
+    h->recipe = NULL;
+    h->path_s = path_s;
+    h->ino = statbuf.st_ino;
+    h->dirty_bytes = 0;
+    h->dirty_end = 0;
+    h->ingest = NULL;
+    h->tracked = 0;
+    h->seq_next = 0;
+    h->seq_run = 0;
+
+    wb_open(h);
+    fi->fh = (intptr_t) h;
+    return 0;
+}
+
+
+/*
+ * Whether a read of size bytes at offset through h is part of a sequential
+ * scan: the file is at least scan_threshold bytes and the reads through h
+ * have run back to back for SCAN_MIN_RUN bytes (or the threshold, if
+ * smaller). Such reads leave the segment cache alone as far as they can.
+ */
+static bool read_is_scan(struct dedup_handle *h, off_t offset, size_t size, off_t file_size) {
+    off_t run = offset == h->seq_next ? h->seq_run + (off_t) size : (off_t) size;
+    h->seq_run = run;
+    h->seq_next = offset + size;
+
+    off_t threshold = de_cfg->fstate->scan_threshold;
+    if (threshold <= 0 || file_size < threshold) {
+        return false;
+    }
+    return run >= std::min(threshold, (off_t) SCAN_MIN_RUN);
+}
+
 int mydedup_read(const char *pathname, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
     int ret = 0;
+    struct dedup_handle *h = (struct dedup_handle *) fi->fh;
     PF("[%s]:reading %s at offset %zu, size %zu\n", __func__, pathname, offset, size);
     int loc = ON_SSD;
     char path_s[MAX_PATH_LEN];
@@ -589,59 +1173,104 @@ int mydedup_read(const char *pathname, char *buf, size_t size, off_t offset, str
     PF("[%s]:\t getting loc\n", __func__);
     get_loc(path_s, &loc);
     if (loc == ON_SSD) {
-        PF("[%s]:\t return cloudfs_read_node(pathname, buf, size, offset, fi);\n", __func__);
-        return cloudfs_read_node(pathname, buf, size, offset, fi);
+        // the file may have been brought back from cloud after it was opened
+        int fd = h->fd >= 0 ? h->fd : open(path_s, O_RDONLY);
+        ret = pread(fd, buf, size, offset);
+        if (ret < 0) {
+            ret = cloudfs_error(__func__);
+        }
+        if (fd != h->fd) {
+            close(fd);
+        }
+        return ret;
     } else {
 
         PF("[%s]:\t loc == ON_CLOUD\n", __func__);
 
 
-        std::vector <seg_info_p> segs;
-
-        mydedup_get_seginfo(path_s, segs);
-
-
-        size_t upperbound = 0;
-        size_t lowerbound = 0;
-        size_t offset_change = 0;
+        // writes still buffered in any handle on the file are part of it
+        // already; they are laid over the recipe in the order a flush of
+        // all of them would apply them
+        std::vector<struct dedup_handle *> hs = wb_lookup(path_s);
+
+        // a handle streaming appends reads its own, newer segment list
+        struct recipe *r = NULL;
+        std::vector <seg_info_p> *segs_p;
+        off_t stored;
+        off_t file_size;
+        if (h->ingest != NULL) {
+            segs_p = &h->ingest->segs;
+            stored = h->ingest->end - h->ingest->pending.size();
+            file_size = h->ingest->end;
+        } else {
+            r = recipe_acquire(&h->recipe, path_s);
+            if (r == NULL) {
+                return cloudfs_error(__func__);
+            }
+            segs_p = &r->segs;
+            stored = r->size;
+            file_size = stored;
+            for (size_t i = 0; i < hs.size(); i++) {
+                file_size = std::max(file_size, hs[i]->dirty_end);
+            }
+        }
+        std::vector <seg_info_p> &segs = *segs_p;
 
-        std::vector <seg_info_p> related_segs;
+        if (size == 0 || offset >= file_size) {
+            recipe_release(r);
+            return 0;
+        }
 
-        for (int i = 0; i < segs.size(); i++) {
-            lowerbound = upperbound;
-            upperbound += segs[i]->seg_size;
-            if (upperbound < offset) {
-                offset_change += segs[i]->seg_size;
-            } else if (lowerbound >= offset + size) {
+        if (offset + (off_t) size > file_size) {
+            size = file_size - offset;
+        }
+        bool scan = read_is_scan(h, offset, size, file_size);
+        size_t seg_len = offset < stored ? std::min((off_t) size, stored - offset) : 0;
+        int first = recipe_find(segs, offset);
+        int last = recipe_find(segs, offset + seg_len - 1);
+
+        // copy each segment's share of the range directly into buf
+        size_t done = 0;
+        for (int i = first; i <= last && done < seg_len; i++) {
+            size_t seg_off = offset + done - segs[i]->seg_offset;
+            size_t len = segs[i]->seg_size - seg_off;
+            if (len > seg_len - done) {
+                len = seg_len - done;
+            }
+            int n = cloud_read_cache(segs[i]->md5, segs[i]->seg_size, seg_off, buf + done, len, scan);
+            PF("[%s] cloud_read_cache(%s, %zu, %zu) RETURNED %d\n", __func__, segs[i]->md5, seg_off, len, n);
+            if (n < 0) {
+                ret = n;
+                break;
+            }
+            done += n;
+            if ((size_t) n < len) {
                 break;
-            } else {
-                related_segs.push_back(segs[i]);
             }
         }
+        recipe_release(r);
 
-//        debug_pseg("segs", segs);
-//        debug_pseg("related_segs", related_segs);
-        char temp_file_path[MAX_PATH_LEN];
-        get_tempfile_path_dedup(temp_file_path, path_s, MAX_PATH_LEN);
-        mydedup_down_segs(temp_file_path, related_segs);
-
-        int fd = open(temp_file_path, O_RDONLY);
-        PF("[%s] offset is %zu, offset_change is %zu\n", __func__, offset, offset_change);
-        ret = pread(fd, buf, size, offset - offset_change);
-
-        close(fd);
-
-        remove(temp_file_path);
-        PF("[%s] pread(%zu, %zu) RETURNED %d\n", __func__, size, offset - offset_change, ret);
-
-        if (ret < 0) {
-
-            return cloudfs_error(__func__);
+        if (ret < 0 && done == 0) {
+            return ret;
         }
-        return ret;
+        if (done == seg_len) {
+            // past the stored end only buffered writes (or holes) remain
+            memset(buf + done, 0, size - done);
+            done = size;
+        }
+        if (h->ingest != NULL && done > 0) {
+            off_t from = std::max(offset, stored);
+            off_t to = std::min(offset + (off_t) done, h->ingest->end);
+            if (from < to) {
+                memcpy(buf + (from - offset), h->ingest->pending.data() + (from - stored), to - from);
+            }
+        }
+        for (size_t i = 0; i < hs.size(); i++) {
+            wb_overlay(hs[i], buf, done, offset);
+        }
+        return done;
     }
 
-
 }
 
 void mydedup_remove_segs(std::vector <seg_info_p> &segs) {
@@ -651,86 +1280,76 @@ void mydedup_remove_segs(std::vector <seg_info_p> &segs) {
     }
 }
 
-void mydedup_remove_one_seg(char *md5) {
+void mydedup_remove_one_seg(const char *md5) {
     int ref;
-    char seg_proxy_path[MAX_PATH_LEN];
-
-    get_seg_proxy_path(seg_proxy_path, md5, MAX_PATH_LEN);
-    if (!file_exist(seg_proxy_path)) {
-        PF("[%s]: ERROR %s does not exist!!!\n", __func__, seg_proxy_path);
-        return;
+    {
+        std::unique_lock<std::mutex> lock(ref_mutex);
+        refs_wait(lock, md5);
+        ref = segidx_decref(md5);
+        if (ref == 0) {
+            refs_busy.insert(md5);
+        }
     }
-    get_ref(seg_proxy_path, &ref);
-
-    if (ref > 1) {
-        set_ref(seg_proxy_path, ref - 1);
-//        PF("[%s]: set ref of %s as ref-1 = %d\n", __func__, seg_proxy_path, ref - 1);
-    } else if (ref == 1) {
+    if (ref == 0) {
         cloud_delete_cache(md5);
+        refs_done(md5);
 //        cloud_delete_object(BUCKET, md5);
-        remove(seg_proxy_path);
-        PF("[%s]: removed key %s from cloud, removed %s\n", __func__, md5, seg_proxy_path);
-    } else if (ref < 1) {
-
-        PF("[%s]: ERROR %s with 0 refcnt is not deleted!!!\n", __func__, seg_proxy_path);
-        return;
+        PF("[%s]: removed key %s from cloud\n", __func__, md5);
+    } else if (ref < 0) {
+        PF("[%s]: ERROR %s is not indexed!!!\n", __func__, md5);
     }
 }
 
 int mydedup_release(const char *pathname UNUSED, struct fuse_file_info *fi UNUSED) {
     PF("[%s]:\t pathname: %s\n", __func__, pathname);
-    char path_s[MAX_PATH_LEN];
-    get_path_s(path_s, pathname, MAX_PATH_LEN);
-    PF("[%s]:\t pathname = %s \t path_s = %s \n", __func__, pathname, path_s);
+    struct dedup_handle *h = (struct dedup_handle *) fi->fh;
 
-    int ret = close(fi->fh);
-    return ret;
-
-}
-
-int set_ref(const char *pathname, int value) {
-
-    FILE *fp;
-//    fp = FFOPEN__(pathname, "r");
-    if (!file_exist(pathname)) {// file not exist
-        //
-        PF("[%s]:ERROR!! \tFile %s does not exist!\n", __func__, pathname);
-        return cloudfs_error(__func__);
+    int ret = mydedup_flush_handle(h);
+    if (ret < 0) {
+        // last chance for the writes still buffered after a failed flush
+        ret = mydedup_flush_handle(h);
     }
-    int ref_count = value;
-    int ret;
-//    PF("[%s]: \tset refcount of %s as %d\n", __func__, pathname, value);
-    FILE *fp2 = fopen(pathname, "w");
-    fprintf(fp2, "%d\n", value);
-
-    fclose(fp2);
-//    ret = lsetxattr(pathname, "user.ref_cnt", &ref_count, sizeof(int), 0);
+    if (ret < 0) {
+        PF("[%s]: dropping %zu buffered bytes of %s [%s] ERROR\n", __func__, h->dirty_bytes, h->path_s.c_str(),
+           strerror(-ret));
+        if (h->ingest != NULL) {
+            ingest_drop(h);
+        }
+        wb_clear(h);
+        off_t size;
+        if (recipe_size(h->path_s.c_str(), &size) == 0) {
+            wb_settled(h->path_s.c_str(), size);
+        }
+    }
+    if (h->fd >= 0 && close(h->fd) < 0) {
+        ret = -errno;
+    }
+    recipe_release(h->recipe);
+    wb_close(h);
+    delete h;
     return ret;
 }
 
-int get_ref(const char *pathname, int *value_p) {
-    int ret;
-    FILE *fp = fopen(pathname, "r");
-    fscanf(fp, "%d", value_p);
-    fclose(fp);
-//    ret = lgetxattr(pathname, "user.ref_cnt", value_p, sizeof(int));
-//    PF("[%s]: \t%s ref_count is %d\n", __func__, pathname, *value_p);
-    return ret;
-
+int mydedup_flush(const char *pathname UNUSED, struct fuse_file_info *fi) {
+    PF("[%s]:\t pathname: %s\n", __func__, pathname);
+    return mydedup_flush_handle((struct dedup_handle *) fi->fh);
 }
 
-
 int mydedup_unlink(const char *pathname) {
     int ret = 0;
     PF("[%s]:\t pathname: %s\n", __func__, pathname);
     char path_s[MAX_PATH_LEN];
     get_path_s(path_s, pathname, MAX_PATH_LEN);
     std::vector <seg_info_p> segs;
+    wb_settle_path(path_s, true);
     if (is_on_cloud(path_s)) {
 
         mydedup_get_seginfo(path_s, segs);
         mydedup_remove_segs(segs);
+        recipe_free_segs(segs);
     }
+    recipe_invalidate(path_s);
+    recipe_discard(path_s);
     ret = unlink(path_s);
     if (ret < 0) {
         return -errno;
@@ -745,6 +1364,7 @@ int mydedup_truncate(const char *pathname UNUSED, off_t newsize UNUSED) {
     PF("[%s]:\t pathname: %s\n", __func__, pathname);
     char path_s[MAX_PATH_LEN];
     get_path_s(path_s, pathname, MAX_PATH_LEN);
+    wb_settle_path(path_s, false);
     if (!is_on_cloud(path_s)) {
         PF("[%s]:\t pathname: %s is on SSD\n", __func__, pathname);
         ret = truncate(path_s, newsize);
@@ -761,92 +1381,79 @@ int mydedup_truncate(const char *pathname UNUSED, off_t newsize UNUSED) {
         if (newsize <= de_cfg->fstate->threshold) {
             std::vector <seg_info_p> segs;
             mydedup_get_seginfo(path_s, segs);
-            size_t lowerbound = 0;
             std::vector <seg_info_p> related_segs;
 
-            for (int i = 0; i < segs.size(); i++) {
-                if (lowerbound < newsize) {
-                    related_segs.push_back(segs[i]);
-                } else {
-                    break;
-                }
-                lowerbound += segs[i]->seg_size;
+            if (newsize > 0 && !segs.empty()) {
+                int last = recipe_find(segs, newsize - 1);
+                related_segs.assign(segs.begin(), segs.begin() + last + 1);
             }
+            // the plain data goes over the recipe, which nothing may redo
+            recipe_discard(path_s);
             mydedup_down_segs(path_s, related_segs);
             ret = truncate(path_s, newsize);
             mydedup_remove_segs(segs);
+            recipe_free_segs(segs);
+            recipe_invalidate(path_s);
             set_loc(path_s, ON_SSD);
         } else {
-            std::vector <seg_info_p> segs;
+            std::vector <seg_info_p> segs, new_segs, replaced;
             mydedup_get_seginfo(path_s, segs);
-            size_t lowerbound = 0;
-            size_t upperbound = 0;
-
-            size_t offset_change = 0;
-            std::vector <seg_info_p> oldseg1, related_segs, oldseg2;
-            int after = 1;
-
-            for (int i = 0; i < segs.size(); i++) {
-                lowerbound = upperbound;
-                upperbound += segs[i]->seg_size;
-                if (upperbound < newsize) {
-                    oldseg1.push_back(segs[i]);
-                    offset_change = upperbound;
-                } else if (lowerbound >= newsize) {
-                    if (after == 0) {
-                        oldseg2.push_back(segs[i]);
+            int n = segs.size();
+            off_t total = n ? segs[n - 1]->seg_offset + segs[n - 1]->seg_size : 0;
+
+            // only the segment that ends up holding the last byte is
+            // re-chunked: everything in front of it is kept, the rest dropped
+            off_t keep_end = std::min((off_t) newsize, total);
+            int first = n ? recipe_find(segs, keep_end - 1) : 0;
+            off_t seg_start = first < n ? segs[first]->seg_offset : 0;
+            new_segs.assign(segs.begin(), segs.begin() + first);
+
+            struct ingest_state in;
+            in.rp = NULL;
+            if (first < n && newsize <= total && keep_end - seg_start == segs[first]->seg_size) {
+                // cut right at a boundary
+                new_segs.push_back(segs[first]);
+                replaced.assign(segs.begin() + first + 1, segs.end());
+            } else if (ingest_init(&in, seg_start) < 0) {
+                ret = -EINVAL;
+            } else {
+                ret = ingest_resume(&in, new_segs);
+                if (ret == 0 && first < n) {
+                    std::string data(keep_end - seg_start, '\0');
+                    if (cloud_read_cache(segs[first]->md5, segs[first]->seg_size, 0, &data[0], data.size()) !=
+                        (int) data.size()) {
+                        ret = -EIO;
                     } else {
-                        related_segs.push_back(segs[i]);
-                        after--;
+                        ret = ingest_feed(&in, data.data(), data.size());
                     }
-                } else {
-                    related_segs.push_back(segs[i]);
-//                    PF("[%s]:\t related_segs.push_back(%s);\n", __func__, segs[i]->md5);
                 }
+                if (ret == 0 && newsize > total) {
+                    ret = ingest_feed_zeros(&in, newsize - total);
+                }
+                if (ret == 0 && !in.pending.empty()) {
+                    ingest_emit(&in);
+                }
+                rabin_free(&in.rp);
+                new_segs.insert(new_segs.end(), in.segs.begin(), in.segs.end());
+                replaced.assign(segs.begin() + first, segs.end());
             }
 
-            char temp_file_path[MAX_PATH_LEN];
-            get_tempfile_path_dedup(temp_file_path, path_s, MAX_PATH_LEN);
-            mydedup_down_segs(temp_file_path, related_segs);
-
-            PF("[%s] original size is %zu, offset_change is %zu\n", __func__, newsize, offset_change);
-            ret = truncate(temp_file_path, newsize - offset_change);
-
-            std::vector <seg_info_p> updated_segs;
-            mydedup_segmentation(temp_file_path, updated_segs);
-            mydedup_upload_segs(temp_file_path, updated_segs);
-
-            mydedup_remove_segs(related_segs);
-            mydedup_remove_segs(oldseg2);
-
-
-            remove(temp_file_path);
-            struct stat statbuf;
-            get_from_proxy(path_s, &statbuf);
-            statbuf.st_size = 0;
-            FILE *fp_fileproxy = FFOPEN__(path_s, "w");//closed
-
-
-
-            for (int i = 0; i < oldseg1.size(); i++) {
-                fprintf(fp_fileproxy, "%s %ld\n", oldseg1[i]->md5, oldseg1[i]->seg_size);
-                statbuf.st_size += oldseg1[i]->seg_size;
+            if (ret == 0) {
+                off_t size = recipe_write(path_s, new_segs);
+                recipe_invalidate(path_s);
+                ret = size < 0 ? size : 0;
             }
-
-
-            for (int i = 0; i < updated_segs.size(); i++) {
-                fprintf(fp_fileproxy, "%s %ld\n", updated_segs[i]->md5, updated_segs[i]->seg_size);
-
-                statbuf.st_size += updated_segs[i]->seg_size;
+            if (ret < 0) {
+                mydedup_remove_segs(in.segs);
+                recipe_free_segs(in.segs);
+                recipe_free_segs(segs);
+                return ret;
             }
+            // the new recipe is in place, so nothing refers to these now
+            mydedup_remove_segs(replaced);
 
-
-            FFCLOSE__(fp_fileproxy);
-
-
-            clone_2_proxy(path_s, &statbuf);
-
-            set_loc(path_s, ON_CLOUD);
+            recipe_free_segs(segs);
+            recipe_free_segs(in.segs);
         }
     }
     return ret;
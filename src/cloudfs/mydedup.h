@@ -5,8 +5,14 @@
 #ifndef SRC_MYDEDUP_H
 #define SRC_MYDEDUP_H
 
+#include <atomic>
+#include <map>
+#include <string>
+#include <vector>
+
 struct dedup_config {
 
+    int engine;
     int window_size;
     int avg_seg_size;
     int min_seg_size;
@@ -19,9 +25,29 @@ struct dedup_config {
 
 typedef struct seg_info {
     long seg_size;
+    long seg_offset;
     char md5[MD5_DIGEST_LENGTH * 2 + 1];
 } seg_info_t, *seg_info_p;
 
+struct recipe;
+struct ingest_state;
+
+// what fi->fh points to for files opened in dedup mode
+struct dedup_handle {
+    int fd;                 // the SSD file, -1 when the file was on cloud at open
+    struct recipe *recipe;  // parsed recipe, loaded on first cloud read
+    std::string path_s;
+    ino_t ino;              // the SSD inode, which the tables of open handles go by
+    std::map<off_t, std::string> dirty;  // buffered writes by offset, never overlapping
+    size_t dirty_bytes;
+    off_t dirty_end;        // end of the furthest buffered write
+    struct ingest_state *ingest;  // set while appends are chunked as they arrive
+    int tracked;            // listed in the table of handles with pending writes
+    // sequential read detection; concurrent reads may race, only a hint
+    std::atomic<off_t> seq_next;  // where the last read ended
+    std::atomic<off_t> seq_run;   // bytes read back to back up to there
+};
+
 
 
 void debug_showfile(const char *file, const char *functionname, int line);
@@ -41,8 +67,6 @@ void get_tempfile_path_dedup(char *tempfile_path, char *path_s, int bufsize);
 
 void get_fileproxy_path(char *fileproxy_path, char *path_s, int bufsize);
 
-void get_seg_proxy_path(char *seg_proxy_path, const char *md5, int bufsize);
-
 void get_tempseg_path(char *tempseg_path, const char *md5, int bufsize);
 
 void debug_showsegs(std::vector <seg_info_p> segs);
@@ -57,7 +81,7 @@ int mydedup_down_segs(char *path_s, std::vector <seg_info_p> &segs);
 
 void mydedup_upload_segs(char *path_s, std::vector <seg_info_p> &segs);
 
-void mydedup_upload_file(char *path_s);
+int mydedup_upload_file(char *path_s);
 
 int mydedup_getattr(const char *pathname, struct stat *statbuf);
 
@@ -68,17 +92,23 @@ int mydedup_write(const char *pathname, const char *buf, size_t size, off_t offs
                   struct fuse_file_info *fi);
 
 
+int mydedup_open(const char *pathname, struct fuse_file_info *fi);
+
 int mydedup_read(const char *pathname, char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
 
 void mydedup_remove_segs(std::vector <seg_info_p> &segs);
 
-void mydedup_remove_one_seg(char *md5);
+void mydedup_remove_one_seg(const char *md5);
+
+int mydedup_flush(const char *pathname, struct fuse_file_info *fi);
+
+void mydedup_flush_all();
 
 int mydedup_release(const char *pathname, struct fuse_file_info *fi);
 
-int set_ref(const char *pathname, int value);
+void mydedup_lock_refs();
 
-int get_ref(const char *pathname, int *value_p);
+void mydedup_unlock_refs();
 
 void seg_upload(char *pathname, char *key, long size);
 
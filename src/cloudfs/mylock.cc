@@ -0,0 +1,125 @@
+//
+// Created by Wilson_Xu on 2021/12/02.
+//
+
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <unordered_map>
+
+#include "mylock.h"
+
+static int lock_enabled;
+static pthread_rwlock_t fs_rwlock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t table_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::unordered_map<ino_t, inode_lock *> lock_table;
+
+void mylock_init(int enabled) {
+    lock_enabled = enabled;
+}
+
+void mylock_destroy() {
+    pthread_mutex_lock(&table_mutex);
+    for (auto &it : lock_table) {
+        pthread_rwlock_destroy(&it.second->rwlock);
+        delete it.second;
+    }
+    lock_table.clear();
+    pthread_mutex_unlock(&table_mutex);
+}
+
+void mylock_fs_acquire(int mode) {
+    if (!lock_enabled) {
+        return;
+    }
+    if (mode == INODE_LOCK_WRITE) {
+        pthread_rwlock_wrlock(&fs_rwlock);
+    } else {
+        pthread_rwlock_rdlock(&fs_rwlock);
+    }
+}
+
+void mylock_fs_release() {
+    if (lock_enabled) {
+        pthread_rwlock_unlock(&fs_rwlock);
+    }
+}
+
+static inode_lock *mylock_acquire_ino(ino_t ino, int mode) {
+    pthread_mutex_lock(&table_mutex);
+    inode_lock *l;
+    auto it = lock_table.find(ino);
+    if (it == lock_table.end()) {
+        l = new inode_lock;
+        l->ino = ino;
+        l->users = 0;
+        pthread_rwlock_init(&l->rwlock, NULL);
+        lock_table[l->ino] = l;
+    } else {
+        l = it->second;
+    }
+    l->users++;
+    pthread_mutex_unlock(&table_mutex);
+
+    if (mode == INODE_LOCK_WRITE) {
+        pthread_rwlock_wrlock(&l->rwlock);
+    } else {
+        pthread_rwlock_rdlock(&l->rwlock);
+    }
+    return l;
+}
+
+// path_s may name another inode by the time the lock is held; then the
+// lock of that one is taken instead
+inode_lock *mylock_acquire(const char *path_s, int mode) {
+    if (!lock_enabled) {
+        return nullptr;
+    }
+    for (;;) {
+        struct stat statbuf;
+        if (lstat(path_s, &statbuf) < 0) {
+            return nullptr;
+        }
+        inode_lock *l = mylock_acquire_ino(statbuf.st_ino, mode);
+        if (lstat(path_s, &statbuf) < 0 || statbuf.st_ino == l->ino) {
+            // a file removed meanwhile is the caller's to find out about
+            return l;
+        }
+        mylock_release(l);
+    }
+}
+
+void mylock_release(inode_lock *l) {
+    if (l == nullptr) {
+        return;
+    }
+    pthread_rwlock_unlock(&l->rwlock);
+
+    pthread_mutex_lock(&table_mutex);
+    if (--l->users == 0) {
+        lock_table.erase(l->ino);
+        pthread_rwlock_destroy(&l->rwlock);
+        delete l;
+    }
+    pthread_mutex_unlock(&table_mutex);
+}
+
+inode_guard::inode_guard(const char *path_s, int mode) {
+    mylock_fs_acquire(INODE_LOCK_READ);
+    l = mylock_acquire(path_s, mode);
+}
+
+inode_guard::~inode_guard() {
+    mylock_release(l);
+    mylock_fs_release();
+}
+
+fs_guard::fs_guard() {
+    mylock_fs_acquire(INODE_LOCK_WRITE);
+}
+
+fs_guard::~fs_guard() {
+    mylock_fs_release();
+}
@@ -0,0 +1,61 @@
+//
+// Created by Wilson_Xu on 2021/12/02.
+//
+
+#ifndef SRC_MYLOCK_H
+#define SRC_MYLOCK_H
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#define INODE_LOCK_READ 0
+#define INODE_LOCK_WRITE 1
+
+/*
+ * One reader/writer lock per SSD inode. Entries are created on first use and
+ * dropped when the last holder releases them, so the table only ever holds
+ * inodes that some FUSE thread is currently working on.
+ */
+struct inode_lock {
+    ino_t ino;
+    int users;
+    pthread_rwlock_t rwlock;
+};
+
+/*
+ * Scoped lock on the inode behind path_s. It also holds the filesystem lock
+ * shared, even when the file does not exist yet. Does nothing when cloudfs
+ * runs single threaded.
+ */
+struct inode_guard {
+    inode_lock *l;
+
+    inode_guard(const char *path_s, int mode);
+
+    ~inode_guard();
+};
+
+/*
+ * Scoped exclusive hold of the filesystem lock, for snapshot commands that
+ * replace files wholesale: no inode_guard is held meanwhile, and none may be
+ * taken under it.
+ */
+struct fs_guard {
+    fs_guard();
+
+    ~fs_guard();
+};
+
+void mylock_init(int enabled);
+
+void mylock_destroy();
+
+void mylock_fs_acquire(int mode);
+
+void mylock_fs_release();
+
+inode_lock *mylock_acquire(const char *path_s, int mode);
+
+void mylock_release(inode_lock *l);
+
+#endif //SRC_MYLOCK_H
@@ -0,0 +1,399 @@
+//
+// Created by Wilson_Xu on 2021/12/10.
+//
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "mymemcache.h"
+
+struct mem_entry {
+    std::string key;
+    size_t size;
+    char *data;
+    int cls;
+    bool pending;            // no SSD copy yet
+    int pins;                // demotions in progress
+    mem_entry *prev;
+    mem_entry *next;
+};
+
+struct mem_class {
+    size_t chunk;
+    std::vector<char *> free_chunks;
+    mem_entry head; // most recent first
+    mem_entry tail;
+};
+
+static bool enabled = false;
+static std::mutex mem_mutex;
+// signalled when a demotion is queued or finished
+static std::condition_variable mem_cond;
+
+static mem_class *classes;
+static int nclasses;
+static std::vector<char *> slabs;
+static size_t slab_bytes, capacity_bytes;
+static std::unordered_map<std::string, mem_entry *> entries;
+
+static memcache_demote_fn demote_fn;
+static std::deque<std::string> demote_queue;
+static std::thread demoter;
+static bool demoter_stop;
+
+static void lru_unlink(mem_entry *e) {
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+}
+
+static void lru_push(mem_entry *e) {
+    mem_class *c = &classes[e->cls];
+    e->next = c->head.next;
+    e->prev = &c->head;
+    c->head.next->prev = e;
+    c->head.next = e;
+}
+
+static void lru_touch(mem_entry *e) {
+    lru_unlink(e);
+    lru_push(e);
+}
+
+static int class_of(size_t size) {
+    for (int i = 0; i < nclasses; i++) {
+        if (classes[i].chunk >= size) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void entry_free(mem_entry *e) {
+    lru_unlink(e);
+    classes[e->cls].free_chunks.push_back(e->data);
+    entries.erase(e->key);
+    delete e;
+}
+
+static mem_entry *entry_find(const std::string &key) {
+    auto it = entries.find(key);
+    return it == entries.end() ? nullptr : it->second;
+}
+
+/*
+ * A free chunk of class cls: from its free list, a new slab while the
+ * capacity allows, or else by evicting the least recent entry of the
+ * class that is already on the SSD tier.
+ */
+static char *chunk_alloc(int cls) {
+    mem_class *c = &classes[cls];
+    if (c->free_chunks.empty()) {
+        size_t slab = c->chunk > MEMCACHE_SLAB_SIZE ? c->chunk : MEMCACHE_SLAB_SIZE;
+        char *s;
+        if (slab_bytes + slab <= capacity_bytes && (s = (char *) malloc(slab)) != NULL) {
+            slabs.push_back(s);
+            slab_bytes += slab;
+            for (size_t off = 0; off + c->chunk <= slab; off += c->chunk) {
+                c->free_chunks.push_back(s + off);
+            }
+        }
+    }
+    if (c->free_chunks.empty()) {
+        for (mem_entry *e = c->tail.prev; e != &c->head; e = e->prev) {
+            if (e->pins == 0 && !e->pending) {
+                entry_free(e);
+                break;
+            }
+        }
+    }
+    if (c->free_chunks.empty()) {
+        return nullptr;
+    }
+    char *chunk = c->free_chunks.back();
+    c->free_chunks.pop_back();
+    return chunk;
+}
+
+static mem_entry *entry_add(const std::string &key, char *data, size_t size, int cls) {
+    mem_entry *e = new mem_entry();
+    e->key = key;
+    e->size = size;
+    e->data = data;
+    e->cls = cls;
+    e->pending = false;
+    e->pins = 0;
+    entries[key] = e;
+    lru_push(e);
+    return e;
+}
+
+static void demote_queue_add(mem_entry *e) {
+    e->pending = true;
+    demote_queue.push_back(e->key);
+    mem_cond.notify_all();
+}
+
+/*
+ * Writes queued SSD copies outside the lock, pinning the entry meanwhile.
+ * A failed write leaves the entry pending for memcache_settle to retry.
+ * Stops once asked to and the queue is empty.
+ */
+static void demote_loop() {
+    std::unique_lock<std::mutex> lock(mem_mutex);
+    for (;;) {
+        while (demote_queue.empty() && !demoter_stop) {
+            mem_cond.wait(lock);
+        }
+        if (demote_queue.empty()) {
+            return;
+        }
+        mem_entry *e = entry_find(demote_queue.front());
+        demote_queue.pop_front();
+        if (e == nullptr || e->pins > 0 || !e->pending) {
+            continue;
+        }
+        e->pins++;
+        lock.unlock();
+        int ret = demote_fn(e->key, e->data, e->size);
+        lock.lock();
+        e->pins--;
+        if (ret == 0) {
+            e->pending = false;
+        }
+        mem_cond.notify_all();
+    }
+}
+
+/*
+ * Sets the tier up for capacity bytes of slabs, with size classes from
+ * MEMCACHE_MIN_CHUNK growing by MEMCACHE_GROWTH up to max_size, and
+ * starts the demotion thread, which stores SSD copies through demote.
+ * Returns 0 or -errno.
+ */
+int memcache_init(size_t capacity, size_t max_size, memcache_demote_fn demote) {
+    std::vector <size_t> sizes;
+    size_t chunk = MEMCACHE_MIN_CHUNK;
+    while (chunk < max_size) {
+        sizes.push_back(chunk);
+        // keep chunks 64-byte aligned
+        chunk = ((size_t) (chunk * MEMCACHE_GROWTH) + 63) & ~(size_t) 63;
+    }
+    sizes.push_back((max_size + 63) & ~(size_t) 63);
+
+    nclasses = sizes.size();
+    classes = new mem_class[nclasses];
+    for (int i = 0; i < nclasses; i++) {
+        classes[i].chunk = sizes[i];
+        classes[i].head.prev = nullptr;
+        classes[i].head.next = &classes[i].tail;
+        classes[i].tail.prev = &classes[i].head;
+        classes[i].tail.next = nullptr;
+    }
+    capacity_bytes = capacity;
+    slab_bytes = 0;
+    demote_fn = demote;
+    demoter_stop = false;
+    try {
+        demoter = std::thread(demote_loop);
+    } catch (const std::system_error &e) {
+        delete[] classes;
+        classes = nullptr;
+        return -e.code().value();
+    }
+    enabled = true;
+    return 0;
+}
+
+/*
+ * Finishes the queued demotions and frees the tier.
+ */
+void memcache_destroy() {
+    if (!enabled) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mem_mutex);
+        demoter_stop = true;
+        mem_cond.notify_all();
+    }
+    demoter.join();
+
+    std::lock_guard<std::mutex> lock(mem_mutex);
+    for (auto it = entries.begin(); it != entries.end(); ++it) {
+        delete it->second;
+    }
+    entries.clear();
+    for (size_t i = 0; i < slabs.size(); i++) {
+        free(slabs[i]);
+    }
+    slabs.clear();
+    delete[] classes;
+    classes = nullptr;
+    enabled = false;
+}
+
+/*
+ * Copies up to len bytes at offset off of segment key into buf.
+ * Returns the number of bytes copied, or -ENOENT if key is not held.
+ */
+ssize_t memcache_read(const std::string &key, size_t off, char *buf, size_t len) {
+    if (!enabled) {
+        return -ENOENT;
+    }
+    std::lock_guard<std::mutex> lock(mem_mutex);
+    mem_entry *e = entry_find(key);
+    if (e == nullptr) {
+        return -ENOENT;
+    }
+    lru_touch(e);
+    if (off >= e->size) {
+        return 0;
+    }
+    if (len > e->size - off) {
+        len = e->size - off;
+    }
+    memcpy(buf, e->data + off, len);
+    return len;
+}
+
+/*
+ * Writes all of segment key to out.
+ * Returns 0, -ENOENT if key is not held, or -EIO.
+ */
+int memcache_write(const std::string &key, FILE *out) {
+    if (!enabled) {
+        return -ENOENT;
+    }
+    std::lock_guard<std::mutex> lock(mem_mutex);
+    mem_entry *e = entry_find(key);
+    if (e == nullptr) {
+        return -ENOENT;
+    }
+    lru_touch(e);
+    if (fwrite(e->data, 1, e->size, out) != e->size) {
+        return -EIO;
+    }
+    return 0;
+}
+
+/*
+ * Copies segment key into the tier. With demote, the segment has no SSD
+ * copy yet and one is stored in the background.
+ * Returns 0, or -errno if the tier cannot take the segment, in which case
+ * storing the SSD copy is up to the caller.
+ */
+int memcache_put(const std::string &key, const char *data, size_t size, bool demote) {
+    if (!enabled) {
+        return -ENODEV;
+    }
+    std::lock_guard<std::mutex> lock(mem_mutex);
+    mem_entry *e = entry_find(key);
+    if (e == nullptr) {
+        int cls = class_of(size);
+        if (cls < 0) {
+            return -EFBIG;
+        }
+        char *chunk = chunk_alloc(cls);
+        if (chunk == nullptr) {
+            return -ENOSPC;
+        }
+        memcpy(chunk, data, size);
+        e = entry_add(key, chunk, size, cls);
+    } else {
+        lru_touch(e);
+    }
+    if (demote) {
+        demote_queue_add(e);
+    }
+    return 0;
+}
+
+/*
+ * Reads the size bytes of segment key into the tier with reader, from its
+ * SSD copy, unless it is there already. The read is done outside the lock.
+ * Returns 0 or -errno.
+ */
+int memcache_load(const std::string &key, size_t size, memcache_read_fn reader) {
+    if (!enabled) {
+        return -ENODEV;
+    }
+    int cls;
+    char *chunk;
+    {
+        std::lock_guard<std::mutex> lock(mem_mutex);
+        if (entry_find(key) != nullptr) {
+            return 0;
+        }
+        cls = class_of(size);
+        if (cls < 0) {
+            return -EFBIG;
+        }
+        chunk = chunk_alloc(cls);
+        if (chunk == nullptr) {
+            return -ENOSPC;
+        }
+    }
+    ssize_t n = reader(key, 0, chunk, size);
+    int ret = n < 0 ? n : n != (ssize_t) size ? -EIO : 0;
+
+    std::lock_guard<std::mutex> lock(mem_mutex);
+    if (ret < 0 || entry_find(key) != nullptr) {
+        classes[cls].free_chunks.push_back(chunk);
+        return ret;
+    }
+    entry_add(key, chunk, size, cls);
+    return 0;
+}
+
+/*
+ * Makes sure the SSD copy of segment key exists, waiting for its
+ * demotion or storing it now.
+ * Returns 0 or -errno.
+ */
+int memcache_settle(const std::string &key) {
+    if (!enabled) {
+        return 0;
+    }
+    std::unique_lock<std::mutex> lock(mem_mutex);
+    mem_entry *e;
+    while ((e = entry_find(key)) != nullptr && e->pins > 0) {
+        mem_cond.wait(lock);
+    }
+    if (e == nullptr || !e->pending) {
+        return 0;
+    }
+    int ret = demote_fn(e->key, e->data, e->size);
+    if (ret == 0) {
+        e->pending = false;
+    }
+    return ret;
+}
+
+/*
+ * Forgets segment key, dropping a demotion that has not happened yet.
+ */
+void memcache_drop(const std::string &key) {
+    if (!enabled) {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(mem_mutex);
+    mem_entry *e;
+    while ((e = entry_find(key)) != nullptr && e->pins > 0) {
+        mem_cond.wait(lock);
+    }
+    if (e != nullptr) {
+        entry_free(e);
+    }
+}
@@ -0,0 +1,54 @@
+//
+// Created by Wilson_Xu on 2021/12/10.
+//
+
+#ifndef SRC_MYMEMCACHE_H
+#define SRC_MYMEMCACHE_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include <string>
+
+/*
+ * RAM tier above the SSD segment cache. Segments live in chunks carved
+ * out of MEMCACHE_SLAB_SIZE slabs, one size class per slab, so holding a
+ * segment costs no malloc and serving it a single memcpy. Each class has
+ * its own LRU list and evicts from it once the tier has used up its
+ * capacity in slabs. Segment keys are content hashes, so a copy never goes
+ * stale and may outlive the segment's place in the SSD tier.
+ *
+ * A segment written through FUSE enters the tier before it has an SSD
+ * copy. That copy is stored by a background thread (demotion) through the
+ * function given to memcache_init, and the entry is not evicted before
+ * it is; memcache_settle waits for or does the store, for callers that
+ * need the SSD copy.
+ *
+ * Thread safe. The tier takes only its own mutex, so it may be called
+ * with cache_mutex held.
+ */
+#define MEMCACHE_SLAB_SIZE (1 << 20)
+#define MEMCACHE_MIN_CHUNK 1024
+#define MEMCACHE_GROWTH 1.25
+
+typedef int (*memcache_demote_fn)(const std::string &key, const char *data, size_t size);
+
+typedef ssize_t (*memcache_read_fn)(const std::string &key, size_t off, char *buf, size_t len);
+
+int memcache_init(size_t capacity, size_t max_size, memcache_demote_fn demote);
+
+void memcache_destroy();
+
+ssize_t memcache_read(const std::string &key, size_t off, char *buf, size_t len);
+
+int memcache_write(const std::string &key, FILE *out);
+
+int memcache_put(const std::string &key, const char *data, size_t size, bool demote);
+
+int memcache_load(const std::string &key, size_t size, memcache_read_fn reader);
+
+int memcache_settle(const std::string &key);
+
+void memcache_drop(const std::string &key);
+
+#endif //SRC_MYMEMCACHE_H
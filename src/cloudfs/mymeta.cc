@@ -0,0 +1,280 @@
+//
+// Created by Wilson_Xu on 2021/12/03.
+//
+
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+
+#include <mutex>
+#include <unordered_map>
+
+#include "mymeta.h"
+
+struct proxy_field {
+    const char *name;
+    size_t offset;
+    size_t size;
+};
+
+#define PROXY_FIELD(f) { "user." #f, offsetof(struct stat, f), sizeof(((struct stat *) 0)->f) }
+
+// st_mode is deliberately not proxied, chmod works on the SSD inode directly
+static const proxy_field proxy_fields[] = {
+        PROXY_FIELD(st_dev),
+        PROXY_FIELD(st_ino),
+        PROXY_FIELD(st_nlink),
+        PROXY_FIELD(st_uid),
+        PROXY_FIELD(st_gid),
+        PROXY_FIELD(st_rdev),
+        PROXY_FIELD(st_size),
+        PROXY_FIELD(st_blksize),
+        PROXY_FIELD(st_blocks),
+};
+
+#define NUM_PROXY_FIELDS (sizeof(proxy_fields) / sizeof(proxy_fields[0]))
+
+static std::mutex meta_mutex;
+static std::unordered_map<ino_t, file_meta> meta_table;
+
+void mymeta_init() {
+    mymeta_clear();
+}
+
+void mymeta_destroy() {
+    mymeta_clear();
+}
+
+/*
+ * The entry of the inode behind path_s, created empty if there is none, or
+ * NULL with errno set when the file cannot be found. meta_mutex must be held.
+ */
+static file_meta *meta_entry(const char *path_s) {
+    struct stat statbuf;
+    if (lstat(path_s, &statbuf) < 0) {
+        return NULL;
+    }
+    auto it = meta_table.find(statbuf.st_ino);
+    if (it != meta_table.end()) {
+        return &it->second;
+    }
+    // make room by dropping entries that can be loaded again
+    for (auto v = meta_table.begin(); meta_table.size() >= MYMETA_MAX_ENTRIES && v != meta_table.end();) {
+        if (v->second.size_pinned) {
+            ++v;
+        } else {
+            v = meta_table.erase(v);
+        }
+    }
+    return &meta_table[statbuf.st_ino];
+}
+
+static void load_loc(const char *path_s, file_meta &m) {
+    if (m.loc_loaded) {
+        return;
+    }
+    m.loc_ret = lgetxattr(path_s, "user.location", &m.loc, sizeof(int));
+    m.loc_errno = errno;
+    m.loc_loaded = 1;
+}
+
+static void load_dirty(const char *path_s, file_meta &m) {
+    if (m.dirty_loaded) {
+        return;
+    }
+    m.dirty_ret = lgetxattr(path_s, "user.isdirty", &m.dirty, sizeof(int));
+    m.dirty_errno = errno;
+    m.dirty_loaded = 1;
+}
+
+static void load_proxy(const char *path_s, file_meta &m) {
+    if (m.proxy_loaded) {
+        return;
+    }
+    m.proxy_ret = 0;
+    m.proxy_mask = 0;
+    for (unsigned i = 0; i < NUM_PROXY_FIELDS; i++) {
+        const proxy_field &f = proxy_fields[i];
+        if (lgetxattr(path_s, f.name, (char *) &m.proxy + f.offset, f.size) < 0) {
+            m.proxy_ret = -errno;
+        } else {
+            m.proxy_mask |= 1u << i;
+        }
+    }
+    m.proxy_loaded = 1;
+}
+
+int mymeta_get_loc(const char *path_s, int *value) {
+    std::lock_guard<std::mutex> lock(meta_mutex);
+    file_meta *e = meta_entry(path_s);
+    if (e == NULL) {
+        return -1;
+    }
+    file_meta &m = *e;
+    load_loc(path_s, m);
+    if (m.loc_ret < 0) {
+        errno = m.loc_errno;
+    } else {
+        *value = m.loc;
+    }
+    return m.loc_ret;
+}
+
+int mymeta_set_loc(const char *path_s, int value) {
+    std::lock_guard<std::mutex> lock(meta_mutex);
+    int ret = lsetxattr(path_s, "user.location", &value, sizeof(int), 0);
+    file_meta *e = meta_entry(path_s);
+    if (e == NULL) {
+        return ret < 0 ? ret : 0;
+    }
+    file_meta &m = *e;
+    if (ret < 0) {
+        m.loc_loaded = 0;
+        return ret;
+    }
+    m.loc_loaded = 1;
+    m.loc_ret = sizeof(int);
+    m.loc = value;
+    return ret;
+}
+
+int mymeta_get_dirty(const char *path_s, int *value) {
+    std::lock_guard<std::mutex> lock(meta_mutex);
+    file_meta *e = meta_entry(path_s);
+    if (e == NULL) {
+        return -1;
+    }
+    file_meta &m = *e;
+    load_dirty(path_s, m);
+    if (m.dirty_ret < 0) {
+        errno = m.dirty_errno;
+    } else {
+        *value = m.dirty;
+    }
+    return m.dirty_ret;
+}
+
+int mymeta_set_dirty(const char *path_s, int value) {
+    std::lock_guard<std::mutex> lock(meta_mutex);
+    int ret = lsetxattr(path_s, "user.isdirty", &value, sizeof(int), 0);
+    file_meta *e = meta_entry(path_s);
+    if (e == NULL) {
+        return ret < 0 ? ret : 0;
+    }
+    file_meta &m = *e;
+    if (ret < 0) {
+        m.dirty_loaded = 0;
+        return ret;
+    }
+    m.dirty_loaded = 1;
+    m.dirty_ret = sizeof(int);
+    m.dirty = value;
+    return ret;
+}
+
+/*
+ * Overlays the proxied fields onto statbuf_p, leaving the fields that have
+ * no saved copy as they are.
+ */
+int mymeta_get_proxy(const char *path_s, struct stat *statbuf_p) {
+    std::lock_guard<std::mutex> lock(meta_mutex);
+    file_meta *e = meta_entry(path_s);
+    if (e == NULL) {
+        return -errno;
+    }
+    file_meta &m = *e;
+    load_proxy(path_s, m);
+    for (unsigned i = 0; i < NUM_PROXY_FIELDS; i++) {
+        if (m.proxy_mask & (1u << i)) {
+            const proxy_field &f = proxy_fields[i];
+            memcpy((char *) statbuf_p + f.offset, (char *) &m.proxy + f.offset, f.size);
+        }
+    }
+    return m.proxy_ret;
+}
+
+int mymeta_set_proxy(const char *path_s, const struct stat *statbuf_p) {
+    std::lock_guard<std::mutex> lock(meta_mutex);
+    int ret = 0;
+    unsigned mask = 0;
+    for (unsigned i = 0; i < NUM_PROXY_FIELDS; i++) {
+        const proxy_field &f = proxy_fields[i];
+        if (lsetxattr(path_s, f.name, (const char *) statbuf_p + f.offset, f.size, 0) < 0) {
+            ret = -errno;
+        } else {
+            mask |= 1u << i;
+        }
+    }
+    file_meta *e = meta_entry(path_s);
+    if (e == NULL) {
+        return ret < 0 ? ret : -errno;
+    }
+    file_meta &m = *e;
+    m.proxy_mask = mask;
+    m.proxy = *statbuf_p;
+    m.proxy_ret = ret;
+    m.proxy_loaded = 1;
+    if (!m.size_pinned) {
+        m.size_valid = 1;
+        m.size = statbuf_p->st_size;
+    }
+    return ret;
+}
+
+/*
+ * Returns 0 and fills size when the logical size of the file is known,
+ * -1 when the caller has to compute it (and should then mymeta_set_size).
+ */
+int mymeta_get_size(const char *path_s, off_t *size) {
+    std::lock_guard<std::mutex> lock(meta_mutex);
+    struct stat statbuf;
+    if (lstat(path_s, &statbuf) < 0) {
+        return -1;
+    }
+    auto it = meta_table.find(statbuf.st_ino);
+    if (it == meta_table.end() || !it->second.size_valid) {
+        return -1;
+    }
+    *size = it->second.size;
+    return 0;
+}
+
+/*
+ * Sets the logical size of a cloud file. A pinned size comes from writes
+ * not in the recipe yet and is kept until set again unpinned, once the
+ * recipe has caught up with them.
+ */
+void mymeta_set_size(const char *path_s, off_t size, int pinned) {
+    std::lock_guard<std::mutex> lock(meta_mutex);
+    file_meta *e = meta_entry(path_s);
+    if (e == NULL) {
+        return;
+    }
+    e->size_valid = 1;
+    e->size_pinned = pinned;
+    e->size = size;
+}
+
+void mymeta_forget(const char *path_s) {
+    struct stat statbuf;
+    if (lstat(path_s, &statbuf) == 0) {
+        mymeta_forget_ino(statbuf.st_ino);
+    }
+}
+
+/*
+ * Drops the entry of an inode, e.g. once its last name is gone and the
+ * inode number may be handed out again.
+ */
+void mymeta_forget_ino(ino_t ino) {
+    std::lock_guard<std::mutex> lock(meta_mutex);
+    meta_table.erase(ino);
+}
+
+void mymeta_clear() {
+    std::lock_guard<std::mutex> lock(meta_mutex);
+    meta_table.clear();
+}
@@ -0,0 +1,76 @@
+//
+// Created by Wilson_Xu on 2021/12/03.
+//
+
+#ifndef SRC_MYMETA_H
+#define SRC_MYMETA_H
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/*
+ * In-memory copy of the per-file metadata CloudFS keeps in xattrs:
+ * user.location, user.isdirty and the proxied st_* fields saved by
+ * clone_2_proxy. Entries are keyed by SSD inode, so every hard link of a
+ * file shares one, and loaded lazily on first use; every update is written
+ * through to the xattrs before it is applied here, so the on-disk state
+ * stays authoritative across remounts.
+ *
+ * The table holds up to MYMETA_MAX_ENTRIES; past that, entries are dropped
+ * and loaded again when next used. A size pinned by a write that is not in
+ * the recipe yet has nothing to be loaded from and stays until unpinned.
+ */
+struct file_meta {
+    int loc_loaded;
+    int loc_ret;        // lgetxattr result for user.location
+    int loc_errno;
+    int loc;
+
+    int dirty_loaded;
+    int dirty_ret;      // lgetxattr result for user.isdirty
+    int dirty_errno;
+    int dirty;
+
+    int proxy_loaded;
+    int proxy_ret;      // result of loading the proxied st_* fields
+    unsigned proxy_mask;// which proxied fields exist
+    struct stat proxy;
+
+    int size_valid;     // logical size of a cloud file
+    int size_pinned;    // size is ahead of the recipe, see mymeta_set_size
+    off_t size;
+
+    file_meta() : loc_loaded(0), loc_ret(0), loc_errno(0), loc(0), dirty_loaded(0), dirty_ret(0),
+                  dirty_errno(0), dirty(0), proxy_loaded(0), proxy_ret(0), proxy_mask(0), proxy(),
+                  size_valid(0), size_pinned(0), size(0) {}
+};
+
+#define MYMETA_MAX_ENTRIES (1 << 16)
+
+void mymeta_init();
+
+void mymeta_destroy();
+
+int mymeta_get_loc(const char *path_s, int *value);
+
+int mymeta_set_loc(const char *path_s, int value);
+
+int mymeta_get_dirty(const char *path_s, int *value);
+
+int mymeta_set_dirty(const char *path_s, int value);
+
+int mymeta_get_proxy(const char *path_s, struct stat *statbuf_p);
+
+int mymeta_set_proxy(const char *path_s, const struct stat *statbuf_p);
+
+int mymeta_get_size(const char *path_s, off_t *size);
+
+void mymeta_set_size(const char *path_s, off_t size, int pinned);
+
+void mymeta_forget(const char *path_s);
+
+void mymeta_forget_ino(ino_t ino);
+
+void mymeta_clear();
+
+#endif //SRC_MYMETA_H
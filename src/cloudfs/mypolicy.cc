@@ -0,0 +1,501 @@
+//
+// Created by Wilson_Xu on 2021/12/08.
+//
+
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include "mycache.h"
+#include "mypolicy.h"
+
+#define UNUSED __attribute__((unused))
+
+/*
+ * Intrusive list of cache nodes between two sentinels, most recent at the
+ * head, with the bytes it holds.
+ */
+struct cache_list {
+    DLinkedNode head;
+    DLinkedNode tail;
+    size_t bytes;
+};
+
+static void list_init(cache_list *l) {
+    l->head.prev = nullptr;
+    l->head.next = &l->tail;
+    l->tail.prev = &l->head;
+    l->tail.next = nullptr;
+    l->bytes = 0;
+}
+
+static bool list_empty(cache_list *l) {
+    return l->head.next == &l->tail;
+}
+
+static void list_push(cache_list *l, DLinkedNode *node) {
+    node->next = l->head.next;
+    node->prev = &l->head;
+    l->head.next->prev = node;
+    l->head.next = node;
+    l->bytes += node->size;
+}
+
+static void list_cut(cache_list *l, DLinkedNode *node) {
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = nullptr;
+    node->next = nullptr;
+    l->bytes -= node->size;
+}
+
+static void list_push_tail(cache_list *l, DLinkedNode *node) {
+    node->prev = l->tail.prev;
+    node->next = &l->tail;
+    l->tail.prev->next = node;
+    l->tail.prev = node;
+    l->bytes += node->size;
+}
+
+static void list_to_tail(cache_list *l, DLinkedNode *node) {
+    list_cut(l, node);
+    list_push_tail(l, node);
+}
+
+static DLinkedNode *list_last(cache_list *l) {
+    return list_empty(l) ? nullptr : l->tail.prev;
+}
+
+static DLinkedNode *list_pop(cache_list *l) {
+    if (list_empty(l)) {
+        return nullptr;
+    }
+    DLinkedNode *node = l->tail.prev;
+    list_cut(l, node);
+    return node;
+}
+
+static void list_walk(cache_list *l, void (*fn)(DLinkedNode *node, void *arg), void *arg) {
+    for (DLinkedNode *n = l->tail.prev; n != &l->head; n = n->prev) {
+        fn(n, arg);
+    }
+}
+
+/*
+ * Keys of recently evicted nodes, for the policies that remember them.
+ * Ghost nodes live only here, never in the cache index.
+ */
+struct ghost_list {
+    cache_list list;
+    std::unordered_map<std::string, DLinkedNode *> map;
+};
+
+static void ghost_clear(ghost_list *g) {
+    if (g->list.head.next == nullptr) {
+        list_init(&g->list);
+        return;
+    }
+    DLinkedNode *n;
+    while ((n = list_pop(&g->list)) != nullptr) {
+        delete n;
+    }
+    g->map.clear();
+}
+
+static DLinkedNode *ghost_find(ghost_list *g, const std::string &key) {
+    auto it = g->map.find(key);
+    return it == g->map.end() ? nullptr : it->second;
+}
+
+static void ghost_drop(ghost_list *g, DLinkedNode *ghost) {
+    list_cut(&g->list, ghost);
+    g->map.erase(ghost->key);
+    delete ghost;
+}
+
+// a key is remembered once at most, or map and list.bytes disagree
+static void ghost_add(ghost_list *g, DLinkedNode *node, int queue) {
+    DLinkedNode *old = ghost_find(g, node->key);
+    if (old != nullptr) {
+        ghost_drop(g, old);
+    }
+    DLinkedNode *ghost = new DLinkedNode(node->key, node->size, 0);
+    ghost->queue = queue;
+    list_push(&g->list, ghost);
+    g->map[ghost->key] = ghost;
+}
+
+static void ghost_trim(ghost_list *g, size_t limit) {
+    while (g->list.bytes > limit && !list_empty(&g->list)) {
+        ghost_drop(g, g->list.tail.prev);
+    }
+}
+
+// forgets key, for a victim the cache ended up keeping after all
+static void ghost_forget(ghost_list *g, const std::string &key) {
+    DLinkedNode *ghost = ghost_find(g, key);
+    if (ghost != nullptr) {
+        ghost_drop(g, ghost);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// LRU: one list, hits move to the head, victims come from the tail.
+
+static cache_list lru;
+
+static void lru_insert(DLinkedNode *node, size_t capacity UNUSED) {
+    node->queue = 0;
+    list_push(&lru, node);
+}
+
+static void lru_cold(DLinkedNode *node) {
+    list_to_tail(&lru, node);
+}
+
+static void lru_hit(DLinkedNode *node) {
+    list_cut(&lru, node);
+    list_push(&lru, node);
+}
+
+static DLinkedNode *lru_victim(size_t capacity UNUSED) {
+    return list_pop(&lru);
+}
+
+static DLinkedNode *lru_peek(size_t capacity UNUSED) {
+    return list_last(&lru);
+}
+
+static void lru_remove(DLinkedNode *node) {
+    list_cut(&lru, node);
+}
+
+static void lru_restore(DLinkedNode *node, int queue UNUSED) {
+    lru_insert(node, 0);
+}
+
+static void lru_walk(void (*fn)(DLinkedNode *node, void *arg), void *arg) {
+    list_walk(&lru, fn, arg);
+}
+
+static void lru_reset() {
+    list_init(&lru);
+}
+
+// ---------------------------------------------------------------------------
+// ARC (Megiddo and Modha, FAST '03), weighted by segment size. T1 holds
+// nodes seen once recently, T2 nodes seen at least twice; B1 and B2
+// remember what was evicted from each. A miss that hits a ghost shifts the
+// target size p of T1 towards the list that would have kept it, so a
+// single scan only churns T1 while T2 keeps the shared hot set.
+
+#define ARC_T1 0
+#define ARC_T2 1
+
+static cache_list arc_t1, arc_t2;
+static ghost_list arc_b1, arc_b2;
+static size_t arc_p;
+
+static void arc_trim(size_t capacity) {
+    size_t t1 = arc_t1.bytes, t2 = arc_t2.bytes;
+    ghost_trim(&arc_b1, capacity > t1 ? capacity - t1 : 0);
+    size_t rest = t1 + t2 + arc_b1.list.bytes;
+    ghost_trim(&arc_b2, 2 * capacity > rest ? 2 * capacity - rest : 0);
+}
+
+static void arc_insert(DLinkedNode *node, size_t capacity) {
+    DLinkedNode *g;
+    if ((g = ghost_find(&arc_b1, node->key)) != nullptr) {
+        size_t b1 = arc_b1.list.bytes, b2 = arc_b2.list.bytes;
+        size_t delta = node->size * (b2 > b1 ? b2 / b1 : 1);
+        arc_p = arc_p + delta < capacity ? arc_p + delta : capacity;
+        ghost_drop(&arc_b1, g);
+        node->queue = ARC_T2;
+        list_push(&arc_t2, node);
+    } else if ((g = ghost_find(&arc_b2, node->key)) != nullptr) {
+        size_t b1 = arc_b1.list.bytes, b2 = arc_b2.list.bytes;
+        size_t delta = node->size * (b1 > b2 ? b1 / b2 : 1);
+        arc_p = arc_p > delta ? arc_p - delta : 0;
+        ghost_drop(&arc_b2, g);
+        node->queue = ARC_T2;
+        list_push(&arc_t2, node);
+    } else {
+        node->queue = ARC_T1;
+        list_push(&arc_t1, node);
+    }
+    arc_trim(capacity);
+}
+
+// the tail of whichever list insert put it in, ghost hits included
+static void arc_cold(DLinkedNode *node) {
+    list_to_tail(node->queue == ARC_T1 ? &arc_t1 : &arc_t2, node);
+}
+
+static void arc_hit(DLinkedNode *node) {
+    list_cut(node->queue == ARC_T1 ? &arc_t1 : &arc_t2, node);
+    node->queue = ARC_T2;
+    list_push(&arc_t2, node);
+}
+
+static bool arc_from_t1() {
+    return !list_empty(&arc_t1) && (arc_t1.bytes > arc_p || list_empty(&arc_t2));
+}
+
+static DLinkedNode *arc_victim(size_t capacity) {
+    DLinkedNode *node;
+    if (arc_from_t1()) {
+        node = list_pop(&arc_t1);
+        ghost_add(&arc_b1, node, ARC_T1);
+    } else {
+        node = list_pop(&arc_t2);
+        if (node == nullptr) {
+            return nullptr;
+        }
+        ghost_add(&arc_b2, node, ARC_T2);
+    }
+    arc_trim(capacity);
+    return node;
+}
+
+static DLinkedNode *arc_peek(size_t capacity UNUSED) {
+    return list_last(arc_from_t1() ? &arc_t1 : &arc_t2);
+}
+
+static void arc_remove(DLinkedNode *node) {
+    list_cut(node->queue == ARC_T1 ? &arc_t1 : &arc_t2, node);
+}
+
+// victim already made node a ghost; it was not evicted, so it is none
+static void arc_restore(DLinkedNode *node, int queue) {
+    ghost_forget(&arc_b1, node->key);
+    ghost_forget(&arc_b2, node->key);
+    node->queue = queue == ARC_T2 ? ARC_T2 : ARC_T1;
+    list_push(node->queue == ARC_T1 ? &arc_t1 : &arc_t2, node);
+}
+
+static void arc_walk(void (*fn)(DLinkedNode *node, void *arg), void *arg) {
+    list_walk(&arc_t1, fn, arg);
+    list_walk(&arc_t2, fn, arg);
+}
+
+static void arc_reset() {
+    list_init(&arc_t1);
+    list_init(&arc_t2);
+    ghost_clear(&arc_b1);
+    ghost_clear(&arc_b2);
+    arc_p = 0;
+}
+
+// ---------------------------------------------------------------------------
+// S3-FIFO (Yang et al., SOSP '23), weighted by segment size. New nodes
+// enter a small FIFO S holding a tenth of the cache; only those hit again
+// before they reach its tail move on to the main FIFO M, the rest leave
+// and are remembered in the ghost FIFO G. A miss found in G goes straight
+// to M. Hits only bump a 2-bit counter, which M spends by reinserting.
+
+#define S3_S 0
+#define S3_M 1
+#define S3_FREQ_MAX 3
+
+static cache_list s3_s, s3_m;
+static ghost_list s3_g;
+
+static void s3_insert(DLinkedNode *node, size_t capacity UNUSED) {
+    DLinkedNode *g = ghost_find(&s3_g, node->key);
+    node->freq = 0;
+    if (g != nullptr) {
+        ghost_drop(&s3_g, g);
+        node->queue = S3_M;
+        list_push(&s3_m, node);
+    } else {
+        node->queue = S3_S;
+        list_push(&s3_s, node);
+    }
+}
+
+static void s3_cold(DLinkedNode *node) {
+    list_to_tail(node->queue == S3_S ? &s3_s : &s3_m, node);
+}
+
+static void s3_hit(DLinkedNode *node) {
+    if (node->freq < S3_FREQ_MAX) {
+        node->freq++;
+    }
+}
+
+static bool s3_from_s(size_t capacity) {
+    return !list_empty(&s3_s) && (s3_s.bytes > capacity / 10 || list_empty(&s3_m));
+}
+
+static DLinkedNode *s3_victim(size_t capacity) {
+    for (;;) {
+        if (s3_from_s(capacity)) {
+            DLinkedNode *node = list_pop(&s3_s);
+            if (node->freq > 0) {
+                node->freq = 0;
+                node->queue = S3_M;
+                list_push(&s3_m, node);
+                continue;
+            }
+            ghost_add(&s3_g, node, S3_S);
+            ghost_trim(&s3_g, capacity - capacity / 10);
+            return node;
+        }
+        DLinkedNode *node = list_pop(&s3_m);
+        if (node == nullptr) {
+            return nullptr;
+        }
+        if (node->freq > 0) {
+            node->freq--;
+            list_push(&s3_m, node);
+            continue;
+        }
+        return node;
+    }
+}
+
+// the first node examined; victim may still move it to M or reinsert it
+static DLinkedNode *s3_peek(size_t capacity) {
+    return list_last(s3_from_s(capacity) ? &s3_s : &s3_m);
+}
+
+static void s3_remove(DLinkedNode *node) {
+    list_cut(node->queue == S3_S ? &s3_s : &s3_m, node);
+}
+
+static void s3_restore(DLinkedNode *node, int queue) {
+    ghost_forget(&s3_g, node->key);
+    node->queue = queue == S3_M ? S3_M : S3_S;
+    node->freq = 0;
+    list_push(node->queue == S3_S ? &s3_s : &s3_m, node);
+}
+
+static void s3_walk(void (*fn)(DLinkedNode *node, void *arg), void *arg) {
+    list_walk(&s3_s, fn, arg);
+    list_walk(&s3_m, fn, arg);
+}
+
+static void s3_reset() {
+    list_init(&s3_s);
+    list_init(&s3_m);
+    ghost_clear(&s3_g);
+}
+
+// ---------------------------------------------------------------------------
+// GreedyDual-Size-Frequency (Cherkasova, HP Labs '98). A node's priority
+// is L + freq * cost / size, where cost is what fetching it again from
+// the cloud would be charged: small segments cost the request fee for few
+// bytes and are kept before large ones. The victim is the node of lowest
+// priority, whose priority becomes the new L, so nodes not hit since age
+// out against newer ones. Ties go to the least recently touched node.
+
+typedef std::pair <std::pair<double, long>, DLinkedNode *> gdsf_entry;
+
+static std::set <gdsf_entry> gdsf_queue;
+static double gdsf_l;
+static long gdsf_tick;
+
+static double gdsf_cost(size_t size) {
+    return CLOUD_COST_PER_REQUEST + CLOUD_COST_PER_MB * size / 1048576.0;
+}
+
+static gdsf_entry gdsf_key(DLinkedNode *node) {
+    return std::make_pair(std::make_pair(node->prio, node->seq), node);
+}
+
+static void gdsf_push(DLinkedNode *node) {
+    size_t size = node->size > 0 ? node->size : 1;
+    node->prio = gdsf_l + node->freq * gdsf_cost(size) / size;
+    node->seq = gdsf_tick++;
+    gdsf_queue.insert(gdsf_key(node));
+}
+
+static void gdsf_insert(DLinkedNode *node, size_t capacity UNUSED) {
+    node->queue = 0;
+    node->freq = 1;
+    gdsf_push(node);
+}
+
+// the lowest priority there is, ahead of older nodes of the same
+static void gdsf_cold(DLinkedNode *node) {
+    gdsf_queue.erase(gdsf_key(node));
+    node->prio = gdsf_l;
+    node->seq = -gdsf_tick++;
+    gdsf_queue.insert(gdsf_key(node));
+}
+
+static void gdsf_hit(DLinkedNode *node) {
+    gdsf_queue.erase(gdsf_key(node));
+    if (node->freq < INT_MAX) {
+        node->freq++;
+    }
+    gdsf_push(node);
+}
+
+static DLinkedNode *gdsf_victim(size_t capacity UNUSED) {
+    if (gdsf_queue.empty()) {
+        return nullptr;
+    }
+    DLinkedNode *node = gdsf_queue.begin()->second;
+    gdsf_queue.erase(gdsf_queue.begin());
+    gdsf_l = node->prio;
+    return node;
+}
+
+static DLinkedNode *gdsf_peek(size_t capacity UNUSED) {
+    return gdsf_queue.empty() ? nullptr : gdsf_queue.begin()->second;
+}
+
+static void gdsf_remove(DLinkedNode *node) {
+    gdsf_queue.erase(gdsf_key(node));
+}
+
+// frequencies are not persisted, a node restored at rebuild starts over;
+// one put back after a resize keeps its own
+static void gdsf_restore(DLinkedNode *node, int queue UNUSED) {
+    node->queue = 0;
+    if (node->freq < 1) {
+        node->freq = 1;
+    }
+    gdsf_push(node);
+}
+
+static void gdsf_walk(void (*fn)(DLinkedNode *node, void *arg), void *arg) {
+    for (auto it = gdsf_queue.begin(); it != gdsf_queue.end(); ++it) {
+        fn(it->second, arg);
+    }
+}
+
+static void gdsf_reset() {
+    gdsf_queue.clear();
+    gdsf_l = 0;
+    gdsf_tick = 0;
+}
+
+// ---------------------------------------------------------------------------
+
+static struct cache_policy policies[] = {
+        {"lru",    lru_insert,  lru_cold,  lru_hit,  lru_victim,  lru_peek,  lru_remove,  lru_restore,  lru_walk,
+                lru_reset},
+        {"arc",    arc_insert,  arc_cold,  arc_hit,  arc_victim,  arc_peek,  arc_remove,  arc_restore,  arc_walk,
+                arc_reset},
+        {"s3fifo", s3_insert,   s3_cold,   s3_hit,   s3_victim,   s3_peek,   s3_remove,   s3_restore,   s3_walk,
+                s3_reset},
+        {"gdsf",   gdsf_insert, gdsf_cold, gdsf_hit, gdsf_victim, gdsf_peek, gdsf_remove, gdsf_restore, gdsf_walk,
+                gdsf_reset},
+};
+
+struct cache_policy *cache_policy_find(const char *name) {
+    for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+        if (strcmp(policies[i].name, name) == 0) {
+            return &policies[i];
+        }
+    }
+    return nullptr;
+}
+
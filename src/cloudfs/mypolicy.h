@@ -0,0 +1,61 @@
+//
+// Created by Wilson_Xu on 2021/12/08.
+//
+
+#ifndef SRC_MYPOLICY_H
+#define SRC_MYPOLICY_H
+
+#include <stddef.h>
+
+struct DLinkedNode;
+
+/*
+ * Replacement policy of the segment cache. mycache owns the nodes, their
+ * index, the byte accounting and the cached files; the policy only orders
+ * the resident nodes and picks victims. A node is in at most one of the
+ * policy's queues, recorded in node->queue, which is persisted so a
+ * restart puts every node back where it was.
+ *
+ * insert   a node that just became resident
+ * cold     moves a node just inserted to where victim looks first, for
+ *          segments of a sequential scan that are unlikely to be reused
+ * hit      an access to a resident node
+ * victim   unlinks and returns the node to evict next, or nullptr
+ * peek     the node victim would consider first, left in place
+ * remove   unlinks a node the cache drops on its own (delete, resize)
+ * restore  puts a node back as the most recent of queue (rebuild)
+ * walk     visits every resident node, least recent of each queue first
+ * reset    forgets all nodes; the cache frees them
+ */
+struct cache_policy {
+    const char *name;
+
+    void (*insert)(DLinkedNode *node, size_t capacity);
+
+    void (*cold)(DLinkedNode *node);
+
+    void (*hit)(DLinkedNode *node);
+
+    DLinkedNode *(*victim)(size_t capacity);
+
+    DLinkedNode *(*peek)(size_t capacity);
+
+    void (*remove)(DLinkedNode *node);
+
+    void (*restore)(DLinkedNode *node, int queue);
+
+    void (*walk)(void (*fn)(DLinkedNode *node, void *arg), void *arg);
+
+    void (*reset)();
+};
+
+#define CACHE_POLICY_DEFAULT ("lru")
+
+// what fetching a segment from the cloud costs, as scripts/graph/plot.py
+// charges it: a fee per request plus one per MB transferred
+#define CLOUD_COST_PER_REQUEST 0.01
+#define CLOUD_COST_PER_MB 0.09
+
+struct cache_policy *cache_policy_find(const char *name);
+
+#endif //SRC_MYPOLICY_H
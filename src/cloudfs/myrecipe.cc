@@ -0,0 +1,557 @@
+//
+// Created by Wilson_Xu on 2021/12/04.
+//
+
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <openssl/md5.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "cloudfs.h"
+#include "mydedup.h"
+#include "myrecipe.h"
+
+#define ON_CLOUD 1
+#define TEMPDIR (".tempfiles")
+
+// Parsed recipes, most recently used first. Bounded by the total number of
+// segments held; pinned entries are never evicted.
+static std::mutex recipe_mutex;
+static std::list<struct recipe *> recipe_lru;
+static std::unordered_map<ino_t, std::list<struct recipe *>::iterator> recipe_map;
+static size_t recipe_cached_segs = 0;
+
+void md5_to_hex(const unsigned char *digest, char *md5string) {
+    static const char hex[] = "0123456789abcdef";
+    for (int b = 0; b < MD5_DIGEST_LENGTH; b++) {
+        md5string[b * 2] = hex[digest[b] >> 4];
+        md5string[b * 2 + 1] = hex[digest[b] & 0xf];
+    }
+    md5string[2 * MD5_DIGEST_LENGTH] = '\0';
+}
+
+static int hex_val(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+int hex_to_md5(const char *md5string, unsigned char *digest) {
+    for (int b = 0; b < MD5_DIGEST_LENGTH; b++) {
+        int hi = hex_val(md5string[b * 2]);
+        int lo = hex_val(md5string[b * 2 + 1]);
+        if (hi < 0 || lo < 0) {
+            return -1;
+        }
+        digest[b] = (unsigned char) ((hi << 4) | lo);
+    }
+    return 0;
+}
+
+static std::string recipe_log_dir;
+
+static std::string recipe_log_path(ino_t ino) {
+    return recipe_log_dir + "/" + std::to_string((unsigned long long) ino) + ".recipe";
+}
+
+// writes all of buf at off, or returns -errno
+static int write_full(int fd, const char *buf, size_t len, off_t off) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, off);
+        if (n < 0) {
+            return -errno;
+        }
+        buf += n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+/*
+ * Writes data over the file at path_s, then saves proxy and marks the file
+ * as on cloud. Returns 0 or -errno.
+ */
+static int recipe_apply(const char *path_s, int fd, const std::string &data, struct stat *proxy) {
+    int ret = write_full(fd, data.data(), data.size(), 0);
+    if (ret == 0 && (ftruncate(fd, data.size()) < 0 || fsync(fd) < 0)) {
+        ret = -errno;
+    }
+    if (ret == 0 && clone_2_proxy((char *) path_s, proxy) < 0) {
+        ret = -EIO;
+    }
+    if (ret == 0 && set_loc(path_s, ON_CLOUD) < 0) {
+        ret = -errno;
+    }
+    return ret;
+}
+
+/*
+ * Replaces the recipe of path_s with segs, filling in each seg_offset on the
+ * way, and saves the attributes of the file with its new logical size as
+ * its proxy, marking it as on cloud. Either all of it happens or, if it
+ * fails before the change is committed, none of it.
+ * Returns the logical size of the file, or -errno.
+ */
+off_t recipe_write(const char *path_s, std::vector <seg_info_p> &segs) {
+    std::string data(sizeof(recipe_header) + segs.size() * sizeof(recipe_entry), '\0');
+    recipe_header *h = (recipe_header *) &data[0];
+    recipe_entry *e = (recipe_entry *) &data[sizeof(recipe_header)];
+    uint64_t offset = 0;
+    for (size_t i = 0; i < segs.size(); i++) {
+        segs[i]->seg_offset = offset;
+        hex_to_md5(segs[i]->md5, e[i].digest);
+        e[i].offset = offset;
+        e[i].size = segs[i]->seg_size;
+        offset += segs[i]->seg_size;
+    }
+    h->magic = RECIPE_MAGIC;
+    h->version = RECIPE_VERSION;
+    h->seg_count = segs.size();
+    h->size = offset;
+
+    recipe_log_header lh;
+    memset(&lh, 0, sizeof(lh));
+    lh.magic = RECIPE_LOG_MAGIC;
+    lh.path_len = strlen(path_s);
+    get_from_proxy(path_s, &lh.proxy);
+    lh.proxy.st_size = offset;
+
+    int fd = open(path_s, O_WRONLY);
+    if (fd < 0) {
+        return -errno;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        int ret = -errno;
+        close(fd);
+        return ret;
+    }
+
+    // commit: the log is complete and on disk
+    std::string log = recipe_log_path(st.st_ino);
+    std::string record((const char *) &lh, sizeof(lh));
+    record.append(path_s, lh.path_len);
+    record.append(data);
+    int ret = 0;
+    int lfd = open(log.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (lfd < 0) {
+        ret = -errno;
+    } else {
+        ret = write_full(lfd, record.data(), record.size(), 0);
+        if (ret == 0 && fsync(lfd) < 0) {
+            ret = -errno;
+        }
+        close(lfd);
+    }
+    int dfd = ret == 0 ? open(recipe_log_dir.c_str(), O_RDONLY | O_DIRECTORY) : -1;
+    if (dfd >= 0) {
+        if (fsync(dfd) < 0) {
+            ret = -errno;
+        }
+        close(dfd);
+    }
+    if (ret < 0) {
+        unlink(log.c_str());
+        close(fd);
+        return ret;
+    }
+
+    // until this has gone through, readers and recipe_recover use the log
+    if (recipe_apply(path_s, fd, data, &lh.proxy) == 0) {
+        unlink(log.c_str());
+    }
+    close(fd);
+    return offset;
+}
+
+/*
+ * Drops a pending change of the recipe of path_s, once the file no longer
+ * has one (it is unlinked, or back on the SSD). Call it while path_s still
+ * exists.
+ */
+void recipe_discard(const char *path_s) {
+    struct stat st;
+    if (lstat(path_s, &st) == 0) {
+        unlink(recipe_log_path(st.st_ino).c_str());
+    }
+}
+
+/*
+ * Opens the log at log_path and checks that it holds a whole recipe, which
+ * starts at *base. Returns the descriptor, or -1 if it does not.
+ */
+static int recipe_log_open(const char *log_path, recipe_log_header *lh, off_t *base) {
+    int fd = open(log_path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    recipe_header h;
+    if (fstat(fd, &st) == 0 && pread(fd, lh, sizeof(*lh), 0) == (ssize_t) sizeof(*lh) &&
+        lh->magic == RECIPE_LOG_MAGIC) {
+        *base = sizeof(*lh) + lh->path_len;
+        if (pread(fd, &h, sizeof(h), *base) == (ssize_t) sizeof(h) && h.magic == RECIPE_MAGIC &&
+            h.version == RECIPE_VERSION &&
+            (uint64_t) st.st_size == *base + sizeof(h) + h.seg_count * sizeof(recipe_entry)) {
+            return fd;
+        }
+    }
+    close(fd);
+    return -1;
+}
+
+/*
+ * Opens the current recipe of path_s: the file itself, or the log of a
+ * change still being applied, in which the recipe starts at *base.
+ * Returns the descriptor or -errno.
+ */
+static int recipe_open(const char *path_s, off_t *base) {
+    *base = 0;
+    int fd = open(path_s, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        int ret = -errno;
+        if (fd >= 0) {
+            close(fd);
+        }
+        return ret;
+    }
+    recipe_log_header lh;
+    int lfd = recipe_log_open(recipe_log_path(st.st_ino).c_str(), &lh, base);
+    if (lfd < 0) {
+        return fd;
+    }
+    close(fd);
+    return lfd;
+}
+
+/*
+ * Applies the changes of recipe logs left by a crash, and drops those that
+ * never got committed or whose file is gone, e.g. at mount. Later logs go to
+ * ssd_path's temp directory.
+ * Returns the number of changes applied or -errno.
+ */
+int recipe_recover(const char *ssd_path) {
+    recipe_log_dir = std::string(ssd_path) + TEMPDIR;
+    DIR *dir = opendir(recipe_log_dir.c_str());
+    if (dir == NULL) {
+        return -errno;
+    }
+    int applied = 0;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        const char *dot = strrchr(de->d_name, '.');
+        if (dot == NULL || strcmp(dot, ".recipe") != 0) {
+            continue;
+        }
+        std::string log = recipe_log_dir + "/" + de->d_name;
+        recipe_log_header lh;
+        off_t base;
+        int lfd = recipe_log_open(log.c_str(), &lh, &base);
+        if (lfd >= 0) {
+            std::string path(lh.path_len, '\0');
+            std::string data;
+            struct stat lst, st;
+            int fd = -1;
+            if (pread(lfd, &path[0], lh.path_len, sizeof(lh)) == (ssize_t) lh.path_len && fstat(lfd, &lst) == 0) {
+                data.resize(lst.st_size - base);
+                if (pread(lfd, &data[0], data.size(), base) == (ssize_t) data.size()) {
+                    fd = open(path.c_str(), O_WRONLY);
+                }
+            }
+            // the name has to still lead to the inode the log is for
+            if (fd >= 0 && fstat(fd, &st) == 0 && log == recipe_log_path(st.st_ino) &&
+                recipe_apply(path.c_str(), fd, data, &lh.proxy) == 0) {
+                applied++;
+            }
+            if (fd >= 0) {
+                close(fd);
+            }
+            close(lfd);
+        }
+        unlink(log.c_str());
+    }
+    closedir(dir);
+    return applied;
+}
+
+static int recipe_read_text(FILE *fp, std::vector <seg_info_p> &segs) {
+    char line[MAX_PATH_LEN];
+    long offset = 0;
+    while (fgets(line, MAX_PATH_LEN, fp) != NULL) {
+        if (strlen(line) < 2 * MD5_DIGEST_LENGTH + 2) {
+            break;
+        }
+        seg_info_p new_seg = (seg_info_p) malloc(sizeof(seg_info_t));
+        memset(new_seg->md5, '\0', 2 * MD5_DIGEST_LENGTH + 1);
+        memcpy(new_seg->md5, line, 2 * MD5_DIGEST_LENGTH);
+        sscanf(line + (2 * MD5_DIGEST_LENGTH + 1), "%ld", &(new_seg->seg_size));
+        new_seg->seg_offset = offset;
+        offset += new_seg->seg_size;
+        segs.push_back(new_seg);
+    }
+    return 0;
+}
+
+/*
+ * Appends the segments of the recipe at path_s to segs. Binary recipes of
+ * another version, or whose length does not match their segment count,
+ * are rejected.
+ * Returns 0 or -errno.
+ */
+int recipe_read(const char *path_s, std::vector <seg_info_p> &segs) {
+    off_t base;
+    int fd = recipe_open(path_s, &base);
+    if (fd < 0) {
+        return fd;
+    }
+    FILE *fp = fdopen(fd, "rb");
+    if (fp == NULL || fseeko(fp, base, SEEK_SET) < 0) {
+        int ret = -errno;
+        if (fp != NULL) {
+            fclose(fp);
+        } else {
+            close(fd);
+        }
+        return ret;
+    }
+
+    recipe_header h;
+    if (fread(&h, sizeof(h), 1, fp) != 1 || h.magic != RECIPE_MAGIC) {
+        fseeko(fp, base, SEEK_SET);
+        int ret = recipe_read_text(fp, segs);
+        fclose(fp);
+        return ret;
+    }
+
+    // a recipe from a newer version, or a torn or corrupt one
+    struct stat st;
+    if (h.version != RECIPE_VERSION || fstat(fileno(fp), &st) < 0 ||
+        (uint64_t) (st.st_size - base) < sizeof(h) ||
+        h.seg_count != ((uint64_t) (st.st_size - base) - sizeof(h)) / sizeof(recipe_entry) ||
+        ((uint64_t) (st.st_size - base) - sizeof(h)) % sizeof(recipe_entry) != 0) {
+        fclose(fp);
+        return -EINVAL;
+    }
+
+    std::vector <recipe_entry> entries(h.seg_count);
+    if (h.seg_count > 0 && fread(&entries[0], sizeof(recipe_entry), h.seg_count, fp) != h.seg_count) {
+        fclose(fp);
+        return -EIO;
+    }
+    fclose(fp);
+
+    segs.reserve(segs.size() + h.seg_count);
+    for (uint64_t i = 0; i < h.seg_count; i++) {
+        seg_info_p new_seg = (seg_info_p) malloc(sizeof(seg_info_t));
+        md5_to_hex(entries[i].digest, new_seg->md5);
+        new_seg->seg_size = entries[i].size;
+        new_seg->seg_offset = entries[i].offset;
+        segs.push_back(new_seg);
+    }
+    return 0;
+}
+
+/*
+ * Logical size of the file described by the recipe. Only the header is read
+ * for binary recipes.
+ */
+int recipe_size(const char *path_s, off_t *size) {
+    off_t base;
+    int fd = recipe_open(path_s, &base);
+    if (fd < 0) {
+        return fd;
+    }
+    recipe_header h;
+    ssize_t n = pread(fd, &h, sizeof(h), base);
+    close(fd);
+    if (n == (ssize_t) sizeof(h) && h.magic == RECIPE_MAGIC && h.version == RECIPE_VERSION) {
+        *size = h.size;
+        return 0;
+    }
+
+    std::vector <seg_info_p> segs;
+    int ret = recipe_read(path_s, segs);
+    *size = 0;
+    for (size_t i = 0; i < segs.size(); i++) {
+        *size += segs[i]->seg_size;
+        free(segs[i]);
+    }
+    return ret;
+}
+
+/*
+ * Index of the segment holding byte offset, clamped to the last segment for
+ * offsets at or past the end of file. -1 when there are no segments.
+ */
+int recipe_find(std::vector <seg_info_p> &segs, off_t offset) {
+    if (segs.empty()) {
+        return -1;
+    }
+    auto it = std::upper_bound(segs.begin(), segs.end(), offset,
+                               [](off_t off, const seg_info_p s) { return off < s->seg_offset; });
+    if (it == segs.begin()) {
+        return 0;
+    }
+    return (int) (it - segs.begin()) - 1;
+}
+
+void recipe_free_segs(std::vector <seg_info_p> &segs) {
+    for (size_t i = 0; i < segs.size(); i++) {
+        free(segs[i]);
+    }
+    segs.clear();
+}
+
+static void recipe_free(struct recipe *r) {
+    recipe_free_segs(r->segs);
+    delete r;
+}
+
+// recipe_mutex must be held
+static void recipe_unlink_locked(std::unordered_map<ino_t, std::list<struct recipe *>::iterator>::iterator it) {
+    struct recipe *r = *(it->second);
+    recipe_cached_segs -= r->segs.size();
+    recipe_lru.erase(it->second);
+    recipe_map.erase(it);
+    r->stale = 1;
+    if (r->users == 0) {
+        recipe_free(r);
+    }
+}
+
+// recipe_mutex must be held
+static void recipe_put_locked(struct recipe *r) {
+    if (r == NULL) {
+        return;
+    }
+    r->users--;
+    if (r->users == 0 && r->stale) {
+        recipe_free(r);
+    }
+}
+
+// recipe_mutex must be held
+static void recipe_evict_locked() {
+    auto it = recipe_lru.end();
+    while (recipe_cached_segs > RECIPE_CACHE_MAX_SEGS && it != recipe_lru.begin()) {
+        --it;
+        struct recipe *r = *it;
+        if (r->users > 0) {
+            continue;
+        }
+        auto victim = recipe_map.find(r->ino);
+        ++it;
+        recipe_unlink_locked(victim);
+    }
+}
+
+// recipe_mutex must be held; the result comes back pinned once
+static struct recipe *recipe_lookup_locked(const char *path_s) {
+    struct stat statbuf;
+    if (lstat(path_s, &statbuf) < 0) {
+        return NULL;
+    }
+    auto it = recipe_map.find(statbuf.st_ino);
+    if (it != recipe_map.end()) {
+        recipe_lru.splice(recipe_lru.begin(), recipe_lru, it->second);
+        (*(it->second))->users++;
+        return *(it->second);
+    }
+
+    struct recipe *r = new recipe;
+    r->ino = statbuf.st_ino;
+    r->users = 1;
+    r->stale = 0;
+    if (recipe_read(path_s, r->segs) < 0) {
+        recipe_free(r);
+        return NULL;
+    }
+    r->size = r->segs.empty() ? 0 : r->segs.back()->seg_offset + r->segs.back()->seg_size;
+
+    recipe_lru.push_front(r);
+    recipe_map[r->ino] = recipe_lru.begin();
+    recipe_cached_segs += r->segs.size();
+    recipe_evict_locked();
+    return r;
+}
+
+void recipe_cache_init() {
+    recipe_cache_clear();
+}
+
+void recipe_cache_destroy() {
+    recipe_cache_clear();
+}
+
+/*
+ * Drops every cached recipe, e.g. after a snapshot restore replaced the tree.
+ * Open handles pick up the new recipe on their next access.
+ */
+void recipe_cache_clear() {
+    std::lock_guard<std::mutex> lock(recipe_mutex);
+    while (!recipe_map.empty()) {
+        recipe_unlink_locked(recipe_map.begin());
+    }
+}
+
+/*
+ * Returns the current recipe of path_s pinned for the caller, who must drop
+ * it with recipe_release(). *slot is the copy kept by an open handle; it is
+ * replaced (and the old copy released) when the file has changed since.
+ */
+struct recipe *recipe_acquire(struct recipe **slot, const char *path_s) {
+    std::lock_guard<std::mutex> lock(recipe_mutex);
+    if (*slot == NULL || (*slot)->stale) {
+        struct recipe *r = recipe_lookup_locked(path_s);
+        if (r == NULL) {
+            return NULL;
+        }
+        recipe_put_locked(*slot);
+        *slot = r;
+    }
+    (*slot)->users++;
+    return *slot;
+}
+
+void recipe_release(struct recipe *r) {
+    std::lock_guard<std::mutex> lock(recipe_mutex);
+    recipe_put_locked(r);
+}
+
+/*
+ * Marks the cached recipe of the inode behind path_s stale, for all of its
+ * names. Has to be called while path_s still exists.
+ */
+void recipe_invalidate(const char *path_s) {
+    struct stat statbuf;
+    if (lstat(path_s, &statbuf) < 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(recipe_mutex);
+    auto it = recipe_map.find(statbuf.st_ino);
+    if (it != recipe_map.end()) {
+        recipe_unlink_locked(it);
+    }
+}
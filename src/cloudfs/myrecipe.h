@@ -0,0 +1,105 @@
+//
+// Created by Wilson_Xu on 2021/12/04.
+//
+
+#ifndef SRC_MYRECIPE_H
+#define SRC_MYRECIPE_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+
+/*
+ * On-SSD layout of a deduplicated file ("recipe"):
+ *
+ *   recipe_header                     fixed size, holds the logical size
+ *   recipe_entry[seg_count]           fixed width, in file order
+ *
+ * Every entry carries the logical offset of its first byte, so the size of
+ * the file is known from the header alone and the segment holding a given
+ * offset is found by binary search. Recipes written by older versions are
+ * plain text ("md5 size\n" per segment) and are still accepted on read.
+ *
+ * A recipe is replaced in place, which keeps the SSD inode and with it the
+ * xattrs and every hard link, but only after the new one has been logged:
+ *
+ *   <ssd>/.tempfiles/<inode>.recipe   recipe_log_header, path, recipe
+ *
+ * Once the log is on disk the change is committed. Readers take the recipe
+ * from the log for as long as it exists, and recipe_recover() finishes the
+ * changes a crash interrupted.
+ */
+#define RECIPE_MAGIC 0x52534643u /* "CFSR" */
+#define RECIPE_VERSION 1
+
+struct recipe_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t seg_count;
+    uint64_t size;
+};
+
+#define RECIPE_LOG_MAGIC 0x4c534643u /* "CFSL" */
+
+struct recipe_log_header {
+    uint32_t magic;
+    uint32_t path_len;
+    struct stat proxy;      // the attributes saved with the new recipe
+};
+
+struct recipe_entry {
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    uint64_t offset;
+    uint64_t size;
+};
+
+/*
+ * A parsed recipe shared by every open handle of the same file, under any
+ * of its names: entries are keyed by SSD inode. Entries are pinned while in
+ * use (users > 0); a stale entry has been superseded by a write, truncate or
+ * unlink and is freed once the last user drops it.
+ */
+struct recipe {
+    ino_t ino;
+    std::vector <seg_info_p> segs;
+    off_t size;
+    int users;
+    int stale;
+};
+
+#define RECIPE_CACHE_MAX_SEGS (1 << 18)
+
+void md5_to_hex(const unsigned char *digest, char *md5string);
+
+int hex_to_md5(const char *md5string, unsigned char *digest);
+
+off_t recipe_write(const char *path_s, std::vector <seg_info_p> &segs);
+
+void recipe_discard(const char *path_s);
+
+int recipe_recover(const char *ssd_path);
+
+int recipe_read(const char *path_s, std::vector <seg_info_p> &segs);
+
+int recipe_size(const char *path_s, off_t *size);
+
+int recipe_find(std::vector <seg_info_p> &segs, off_t offset);
+
+void recipe_free_segs(std::vector <seg_info_p> &segs);
+
+void recipe_cache_init();
+
+void recipe_cache_destroy();
+
+void recipe_cache_clear();
+
+struct recipe *recipe_acquire(struct recipe **slot, const char *path_s);
+
+void recipe_release(struct recipe *r);
+
+void recipe_invalidate(const char *path_s);
+
+#endif //SRC_MYRECIPE_H
@@ -0,0 +1,460 @@
+//
+// Created by Wilson_Xu on 2021/12/06.
+//
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <openssl/md5.h>
+#include <unistd.h>
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "cloudfs.h"
+#include "mydedup.h"
+#include "myrecipe.h"
+#include "mysegidx.h"
+
+#define MASTERDIR (".master")
+#define SEGPROXYDIR (".segproxy")
+#define CACHEDIR (".cache")
+
+// Leaf lock: taken under the reference lock of mydedup and under the cache
+// lock, never the other way round.
+static std::mutex segidx_mutex;
+static std::string ssd_root;
+static std::string idx_path;
+static int idx_fd = -1;
+static size_t idx_len = 0;
+static struct segidx_header *hdr = NULL;
+static struct segidx_slot *slots = NULL;
+
+static size_t idx_bytes(uint64_t capacity) {
+    return sizeof(struct segidx_header) + capacity * sizeof(struct segidx_slot);
+}
+
+static uint64_t slot_hash(const unsigned char *digest) {
+    uint64_t h;
+    memcpy(&h, digest, sizeof(h));
+    return h;
+}
+
+// writes the page holding slot i back to the SSD. Returns 0 or -errno.
+static int slot_sync(long i) {
+    static const uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t at = (uintptr_t) &slots[i] & ~(page - 1);
+    if (msync((void *) at, page, MS_SYNC) < 0) {
+        return -errno;
+    }
+    return 0;
+}
+
+static void idx_unmap() {
+    if (hdr != NULL) {
+        msync(hdr, idx_len, MS_SYNC);
+        munmap(hdr, idx_len);
+    }
+    if (idx_fd >= 0) {
+        close(idx_fd);
+    }
+    hdr = NULL;
+    slots = NULL;
+    idx_fd = -1;
+    idx_len = 0;
+}
+
+/*
+ * Creates an empty table of the given capacity at path and leaves it mapped
+ * in *fd_p / *hdr_p. The file is not made durable here.
+ */
+static int idx_create(const char *path, uint64_t capacity, int *fd_p, struct segidx_header **hdr_p) {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -errno;
+    }
+    size_t len = idx_bytes(capacity);
+    if (ftruncate(fd, len) < 0) {
+        int err = -errno;
+        close(fd);
+        unlink(path);
+        return err;
+    }
+    void *m = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (m == MAP_FAILED) {
+        int err = -errno;
+        close(fd);
+        unlink(path);
+        return err;
+    }
+    struct segidx_header *h = (struct segidx_header *) m;
+    h->magic = SEGIDX_MAGIC;
+    h->version = SEGIDX_VERSION;
+    h->capacity = capacity;
+    h->count = 0;
+    h->used = 0;
+    *fd_p = fd;
+    *hdr_p = h;
+    return 0;
+}
+
+static int idx_open() {
+    int fd = open(idx_path.c_str(), O_RDWR);
+    if (fd < 0 && errno == ENOENT) {
+        struct segidx_header *h;
+        int ret = idx_create(idx_path.c_str(), SEGIDX_MIN_CAPACITY, &fd, &h);
+        if (ret < 0) {
+            return ret;
+        }
+        munmap(h, idx_bytes(SEGIDX_MIN_CAPACITY));
+    }
+    if (fd < 0) {
+        return -errno;
+    }
+
+    struct stat st;
+    struct segidx_header h;
+    if (fstat(fd, &st) < 0 || pread(fd, &h, sizeof(h), 0) != sizeof(h)) {
+        close(fd);
+        return -EIO;
+    }
+    if (h.magic != SEGIDX_MAGIC || h.version != SEGIDX_VERSION || h.capacity == 0 ||
+        (h.capacity & (h.capacity - 1)) != 0 || (size_t) st.st_size != idx_bytes(h.capacity)) {
+        close(fd);
+        return -EINVAL;
+    }
+    void *m = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (m == MAP_FAILED) {
+        int err = -errno;
+        close(fd);
+        return err;
+    }
+    idx_fd = fd;
+    idx_len = st.st_size;
+    hdr = (struct segidx_header *) m;
+    slots = (struct segidx_slot *) ((char *) m + sizeof(struct segidx_header));
+
+    // the counters are only hints; a crash may have left them behind the slots
+    hdr->count = 0;
+    hdr->used = 0;
+    for (uint64_t i = 0; i < hdr->capacity; i++) {
+        if (slots[i].state == SLOT_LIVE) {
+            hdr->count++;
+        }
+        if (slots[i].state != SLOT_EMPTY) {
+            hdr->used++;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Returns the slot holding digest, or -1. With insert set, returns the slot
+ * a new entry should go into instead of -1.
+ */
+static long slot_find(const unsigned char *digest, bool insert) {
+    uint64_t mask = hdr->capacity - 1;
+    long dead = -1;
+    for (uint64_t i = slot_hash(digest) & mask, n = 0; n < hdr->capacity; i = (i + 1) & mask, n++) {
+        struct segidx_slot *s = &slots[i];
+        if (s->state == SLOT_EMPTY) {
+            if (!insert) {
+                return -1;
+            }
+            return dead >= 0 ? dead : (long) i;
+        }
+        if (s->state == SLOT_DEAD) {
+            if (dead < 0) {
+                dead = i;
+            }
+        } else if (memcmp(s->digest, digest, MD5_DIGEST_LENGTH) == 0) {
+            return i;
+        }
+    }
+    return insert ? dead : -1;
+}
+
+static void slot_fill(struct segidx_slot *s, const unsigned char *digest, uint64_t size, uint32_t refcnt,
+                      int loc) {
+    memcpy(s->digest, digest, MD5_DIGEST_LENGTH);
+    s->size = size;
+    s->refcnt = refcnt;
+    s->loc = loc;
+    s->pad = 0;
+    __atomic_store_n(&s->state, (uint8_t) SLOT_LIVE, __ATOMIC_RELEASE);
+}
+
+/*
+ * Rewrites the table into a fresh file, doubling it when more than half
+ * full and otherwise only dropping tombstones, then renames it into place.
+ */
+static int idx_grow() {
+    uint64_t capacity = hdr->capacity;
+    if (hdr->count * 2 >= capacity) {
+        capacity *= 2;
+    }
+    std::string tmp_path = idx_path + ".tmp";
+    int fd;
+    struct segidx_header *h;
+    int ret = idx_create(tmp_path.c_str(), capacity, &fd, &h);
+    if (ret < 0) {
+        return ret;
+    }
+    struct segidx_slot *to = (struct segidx_slot *) ((char *) h + sizeof(struct segidx_header));
+    uint64_t mask = capacity - 1;
+    for (uint64_t i = 0; i < hdr->capacity; i++) {
+        struct segidx_slot *s = &slots[i];
+        if (s->state != SLOT_LIVE) {
+            continue;
+        }
+        uint64_t j = slot_hash(s->digest) & mask;
+        while (to[j].state != SLOT_EMPTY) {
+            j = (j + 1) & mask;
+        }
+        to[j] = *s;
+        h->count++;
+        h->used++;
+    }
+    if (msync(h, idx_bytes(capacity), MS_SYNC) < 0 || fsync(fd) < 0 ||
+        rename(tmp_path.c_str(), idx_path.c_str()) < 0) {
+        ret = -errno;
+        munmap(h, idx_bytes(capacity));
+        close(fd);
+        unlink(tmp_path.c_str());
+        return ret;
+    }
+
+    munmap(hdr, idx_len);
+    close(idx_fd);
+    idx_fd = fd;
+    idx_len = idx_bytes(capacity);
+    hdr = h;
+    slots = to;
+    return 0;
+}
+
+static long slot_insert(const unsigned char *digest) {
+    // keep probe chains short: at most 70% of the slots live or tombstoned
+    if ((hdr->used + 1) * 10 > hdr->capacity * 7) {
+        int ret = idx_grow();
+        if (ret < 0 && hdr->used + 1 >= hdr->capacity) {
+            return ret;
+        }
+    }
+    long i = slot_find(digest, true);
+    if (i < 0) {
+        return -ENOSPC;
+    }
+    if (slots[i].state == SLOT_EMPTY) {
+        hdr->used++;
+    }
+    hdr->count++;
+    return i;
+}
+
+/*
+ * Folds the ".segproxy/<md5>.segproxy" refcount files of older versions
+ * into the index. The files are removed only after the index is on disk;
+ * if that is interrupted the files win again on the next mount.
+ */
+static void idx_migrate() {
+    std::string dir = ssd_root + SEGPROXYDIR;
+    DIR *d = opendir(dir.c_str());
+    if (d == NULL) {
+        return;
+    }
+    std::vector <std::string> done;
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        const char *name = ent->d_name;
+        unsigned char digest[MD5_DIGEST_LENGTH];
+        if (strlen(name) != 2 * MD5_DIGEST_LENGTH + strlen(".segproxy") ||
+            strcmp(name + 2 * MD5_DIGEST_LENGTH, ".segproxy") != 0 || hex_to_md5(name, digest) < 0) {
+            continue;
+        }
+        std::string path = dir + "/" + name;
+        FILE *fp = fopen(path.c_str(), "r");
+        int refcnt = 0;
+        if (fp == NULL || fscanf(fp, "%d", &refcnt) != 1 || refcnt < 1) {
+            if (fp != NULL) {
+                fclose(fp);
+            }
+            continue;
+        }
+        fclose(fp);
+
+        // the size and whether it was uploaded are not recorded; a cached
+        // copy may be the only one
+        struct stat st;
+        std::string cache_path = ssd_root + CACHEDIR + "/" + std::string(name, 2 * MD5_DIGEST_LENGTH) + ".cache";
+        int cached = stat(cache_path.c_str(), &st) == 0;
+
+        long i = slot_find(digest, false);
+        if (i < 0) {
+            i = slot_insert(digest);
+            if (i < 0) {
+                break;
+            }
+            slot_fill(&slots[i], digest, cached ? st.st_size : 0, refcnt, cached ? SEG_LOC_CACHE : SEG_LOC_CLOUD);
+        } else {
+            slots[i].refcnt = refcnt;
+        }
+        done.push_back(path);
+    }
+    closedir(d);
+
+    if (msync(hdr, idx_len, MS_SYNC) < 0 || fsync(idx_fd) < 0) {
+        return;
+    }
+    for (size_t i = 0; i < done.size(); i++) {
+        unlink(done[i].c_str());
+    }
+    rmdir(dir.c_str());
+}
+
+static int idx_load() {
+    int ret = idx_open();
+    if (ret < 0) {
+        return ret;
+    }
+    idx_migrate();
+    return 0;
+}
+
+int segidx_init(const char *ssd_path) {
+    std::lock_guard<std::mutex> lock(segidx_mutex);
+    ssd_root.assign(ssd_path);
+    idx_path.assign(ssd_path).append(MASTERDIR).append("/").append(SEGIDX_FILE);
+    return idx_load();
+}
+
+void segidx_destroy() {
+    std::lock_guard<std::mutex> lock(segidx_mutex);
+    idx_unmap();
+}
+
+/*
+ * Drops the mapping and opens the index file again, for when the SSD tree
+ * was replaced underneath it (snapshot restore).
+ */
+int segidx_reload() {
+    std::lock_guard<std::mutex> lock(segidx_mutex);
+    idx_unmap();
+    return idx_load();
+}
+
+/*
+ * Returns 1 and the reference count if md5 is indexed, 0 if not.
+ */
+int segidx_get_ref(const char *md5, int *refcnt) {
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    if (hex_to_md5(md5, digest) < 0) {
+        return -EINVAL;
+    }
+    std::lock_guard<std::mutex> lock(segidx_mutex);
+    if (hdr == NULL) {
+        return -EBADF;
+    }
+    long i = slot_find(digest, false);
+    if (i < 0) {
+        return 0;
+    }
+    *refcnt = slots[i].refcnt;
+    return 1;
+}
+
+/*
+ * Adds a reference to md5, indexing it first if needed. Returns the new
+ * reference count, so 1 means the caller must store the segment, or -errno.
+ * size and loc only apply to a new entry; size also fills in an unknown one.
+ */
+int segidx_incref(const char *md5, long size, int loc) {
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    if (hex_to_md5(md5, digest) < 0) {
+        return -EINVAL;
+    }
+    std::lock_guard<std::mutex> lock(segidx_mutex);
+    if (hdr == NULL) {
+        return -EBADF;
+    }
+    long i = slot_find(digest, false);
+    if (i >= 0) {
+        if (slots[i].size == 0 && size > 0) {
+            slots[i].size = size;
+        }
+        return ++slots[i].refcnt;
+    }
+    i = slot_insert(digest);
+    if (i < 0) {
+        return i;
+    }
+    slot_fill(&slots[i], digest, size, 1, loc);
+    // the caller stores the segment next, which a lost entry would leak
+    int ret = slot_sync(i);
+    return ret < 0 ? ret : 1;
+}
+
+/*
+ * Drops a reference to md5. Returns the remaining count; at 0 the entry is
+ * gone and the caller deletes the segment. -ENOENT if md5 is not indexed.
+ */
+int segidx_decref(const char *md5) {
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    if (hex_to_md5(md5, digest) < 0) {
+        return -EINVAL;
+    }
+    std::lock_guard<std::mutex> lock(segidx_mutex);
+    if (hdr == NULL) {
+        return -EBADF;
+    }
+    long i = slot_find(digest, false);
+    if (i < 0) {
+        return -ENOENT;
+    }
+    if (slots[i].refcnt > 1) {
+        return --slots[i].refcnt;
+    }
+    slots[i].state = SLOT_DEAD;
+    hdr->count--;
+    // the caller deletes the segment next, which must not come back as live
+    int ret = slot_sync(i);
+    return ret < 0 ? ret : 0;
+}
+
+int segidx_set_loc(const char *md5, int loc) {
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    if (hex_to_md5(md5, digest) < 0) {
+        return -EINVAL;
+    }
+    std::lock_guard<std::mutex> lock(segidx_mutex);
+    if (hdr == NULL) {
+        return -EBADF;
+    }
+    long i = slot_find(digest, false);
+    if (i < 0) {
+        return -ENOENT;
+    }
+    slots[i].loc = loc;
+    return 0;
+}
+
+void segidx_list(std::vector <std::string> &md5s) {
+    std::lock_guard<std::mutex> lock(segidx_mutex);
+    if (hdr == NULL) {
+        return;
+    }
+    char md5[2 * MD5_DIGEST_LENGTH + 1];
+    for (uint64_t i = 0; i < hdr->capacity; i++) {
+        if (slots[i].state == SLOT_LIVE) {
+            md5_to_hex(slots[i].digest, md5);
+            md5s.push_back(md5);
+        }
+    }
+}
@@ -0,0 +1,81 @@
+//
+// Created by Wilson_Xu on 2021/12/06.
+//
+
+#ifndef SRC_MYSEGIDX_H
+#define SRC_MYSEGIDX_H
+
+#include <stdint.h>
+#include <openssl/md5.h>
+
+#include <string>
+#include <vector>
+
+/*
+ * Segment index: one memory-mapped open-addressing hash table on the SSD,
+ * keyed by the binary MD5 of a segment and holding its reference count,
+ * size and location. It replaces the per-segment ".segproxy/<md5>.segproxy"
+ * text files, which are folded into the index the first time it is opened.
+ *
+ *   segidx_header                     capacity is a power of two
+ *   segidx_slot[capacity]             linear probing, tombstones on delete
+ *
+ * A slot is 32 bytes and 32-byte aligned, so it never straddles a sector
+ * and is written back whole. An insert fills the slot before publishing it
+ * through its state byte, and every update touches a single slot. The table
+ * is grown by writing a complete copy and renaming it over the old one.
+ *
+ * Updates are plain stores into the shared mapping. Only the two that the
+ * caller acts on are synced before returning: a new entry (count 1, the
+ * segment is stored next) and a removed one (count 0, it is deleted next).
+ * Other count changes and locations reach the SSD when the kernel writes
+ * the pages back, or at unmount, so after a crash a count may lag behind
+ * the recipes. The count and used fields of the header are recomputed from
+ * the slots at open.
+ */
+#define SEGIDX_MAGIC 0x49534643u /* "CFSI" */
+#define SEGIDX_VERSION 1
+#define SEGIDX_FILE ("segment.index")
+#define SEGIDX_MIN_CAPACITY (1 << 16)
+
+#define SEG_LOC_CLOUD 0
+#define SEG_LOC_CACHE 1 /* only in the local cache, not uploaded yet */
+
+struct segidx_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t capacity;
+    uint64_t count;
+    uint64_t used; /* live slots plus tombstones */
+};
+
+#define SLOT_EMPTY 0
+#define SLOT_LIVE 1
+#define SLOT_DEAD 2
+
+struct segidx_slot {
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    uint64_t size;
+    uint32_t refcnt;
+    uint8_t state;
+    uint8_t loc;
+    uint16_t pad;
+};
+
+int segidx_init(const char *ssd_path);
+
+void segidx_destroy();
+
+int segidx_reload();
+
+int segidx_get_ref(const char *md5, int *refcnt);
+
+int segidx_incref(const char *md5, long size, int loc);
+
+int segidx_decref(const char *md5);
+
+int segidx_set_loc(const char *md5, int loc);
+
+void segidx_list(std::vector <std::string> &md5s);
+
+#endif //SRC_MYSEGIDX_H
@@ -0,0 +1,74 @@
+//
+// Created by Wilson_Xu on 2021/12/09.
+//
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "mysketch.h"
+
+/*
+ * Sizes the sketch for about entries distinct keys: one counter per key
+ * and row, rounded up to a power of two.
+ */
+void sketch_init(struct sketch *s, size_t entries) {
+    size_t width = SKETCH_MIN_WIDTH;
+    while (width < entries) {
+        width <<= 1;
+    }
+    s->counters.assign(width * SKETCH_DEPTH, 0);
+    s->mask = width - 1;
+    s->samples = 0;
+    s->sample_limit = width * SKETCH_SAMPLE_FACTOR;
+}
+
+// row i probes h1 + i * h2, both halves of one 64-bit hash
+static size_t sketch_slot(struct sketch *s, uint64_t h, int row) {
+    uint32_t h1 = (uint32_t) h;
+    uint32_t h2 = (uint32_t) (h >> 32) | 1;
+    return row * (s->mask + 1) + ((h1 + row * h2) & s->mask);
+}
+
+static uint64_t sketch_hash(const std::string &key) {
+    // spread std::hash, which may be the identity on some platforms
+    uint64_t h = std::hash<std::string>()(key);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+void sketch_add(struct sketch *s, const std::string &key) {
+    if (s->counters.empty()) {
+        return;
+    }
+    uint64_t h = sketch_hash(key);
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        uint8_t &c = s->counters[sketch_slot(s, h, row)];
+        if (c < SKETCH_COUNTER_MAX) {
+            c++;
+        }
+    }
+    if (++s->samples >= s->sample_limit) {
+        for (size_t i = 0; i < s->counters.size(); i++) {
+            s->counters[i] >>= 1;
+        }
+        s->samples /= 2;
+    }
+}
+
+int sketch_estimate(struct sketch *s, const std::string &key) {
+    if (s->counters.empty()) {
+        return 0;
+    }
+    uint64_t h = sketch_hash(key);
+    int est = SKETCH_COUNTER_MAX;
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        int c = s->counters[sketch_slot(s, h, row)];
+        if (c < est) {
+            est = c;
+        }
+    }
+    return est;
+}
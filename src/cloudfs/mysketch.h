@@ -0,0 +1,39 @@
+//
+// Created by Wilson_Xu on 2021/12/09.
+//
+
+#ifndef SRC_MYSKETCH_H
+#define SRC_MYSKETCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+/*
+ * Count-min sketch of recent segment accesses, the frequency estimate of
+ * TinyLFU admission (Einziger et al., TOS '17). SKETCH_DEPTH rows of
+ * counters saturating at 15, each row indexed by its own hash of the key.
+ * Once width * SKETCH_SAMPLE_FACTOR accesses have been counted every
+ * counter is halved, so the estimate follows the recent past.
+ */
+#define SKETCH_DEPTH 4
+#define SKETCH_COUNTER_MAX 15
+#define SKETCH_SAMPLE_FACTOR 10
+#define SKETCH_MIN_WIDTH 1024
+
+struct sketch {
+    std::vector <uint8_t> counters;
+    size_t mask;
+    size_t samples;
+    size_t sample_limit;
+};
+
+void sketch_init(struct sketch *s, size_t entries);
+
+void sketch_add(struct sketch *s, const std::string &key);
+
+int sketch_estimate(struct sketch *s, const std::string &key);
+
+#endif //SRC_MYSKETCH_H
@@ -0,0 +1,559 @@
+//
+// Created by Wilson_Xu on 2021/12/11.
+//
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <openssl/md5.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "myslab.h"
+
+struct slab_file {
+    uint32_t id;
+    int fd;
+    size_t len;  // bytes of records, without the seal
+    size_t live; // bytes of records still indexed
+    std::string path;
+
+    slab_file() : id(0), fd(-1), len(0), live(0) {}
+
+    ~slab_file() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+};
+
+// readers hold a reference across their pread, so compaction may drop a slab
+typedef std::shared_ptr <slab_file> slab_ptr;
+
+struct slab_loc {
+    uint32_t slab;
+    uint32_t size;
+    uint64_t off; // of the segment bytes
+};
+
+static std::mutex slab_mutex;
+// signalled when there is sealing or compaction work, or on shutdown
+static std::condition_variable slab_cond;
+static bool ready = false;
+static std::string slab_dir;
+static size_t slab_size_max, dead_max;
+static size_t dead_bytes;
+static std::map <uint32_t, slab_ptr> slabs;
+static slab_ptr active;
+static std::unordered_map <std::string, slab_loc> slab_index;
+static std::deque <slab_ptr> seal_queue;
+static std::thread compactor;
+static bool compactor_stop;
+
+static size_t record_bytes(size_t size) {
+    return sizeof(struct slab_record) + size;
+}
+
+static std::string slab_path(uint32_t id) {
+    char name[32];
+    snprintf(name, sizeof(name), "%s%08u", SLAB_PREFIX, id);
+    return slab_dir + "/" + name;
+}
+
+static int slab_open(uint32_t id, int flags, slab_ptr *s_p) {
+    slab_ptr s = std::make_shared<slab_file>();
+    s->id = id;
+    s->path = slab_path(id);
+    s->fd = open(s->path.c_str(), O_RDWR | flags, 0644);
+    if (s->fd < 0) {
+        return -errno;
+    }
+    *s_p = s;
+    return 0;
+}
+
+static int slab_start_new() {
+    uint32_t id = slabs.empty() ? 1 : slabs.rbegin()->first + 1;
+    slab_ptr s;
+    int ret = slab_open(id, O_CREAT | O_TRUNC, &s);
+    if (ret < 0) {
+        return ret;
+    }
+    slabs[id] = s;
+    active = s;
+    return 0;
+}
+
+// the seal is written by the compaction thread once the records are synced
+static int slab_seal_active() {
+    seal_queue.push_back(active);
+    slab_cond.notify_all();
+    return slab_start_new();
+}
+
+static void index_drop(std::unordered_map<std::string, slab_loc>::iterator it) {
+    auto s = slabs.find(it->second.slab);
+    if (s != slabs.end()) {
+        s->second->live -= record_bytes(it->second.size);
+    }
+    dead_bytes += record_bytes(it->second.size);
+    if (dead_bytes > dead_max) {
+        slab_cond.notify_all();
+    }
+}
+
+static int slab_append(const std::string &key, const char *data, size_t size) {
+    size_t rec = record_bytes(size);
+    if (active->len > 0 && active->len + rec > slab_size_max) {
+        int ret = slab_seal_active();
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    struct slab_record hdr;
+    hdr.magic = SLAB_MAGIC;
+    hdr.size = size;
+    memset(hdr.key, 0, sizeof(hdr.key));
+    memcpy(hdr.key, key.data(), key.size() < sizeof(hdr.key) ? key.size() : sizeof(hdr.key));
+    struct iovec iov[2] = {{&hdr, sizeof(hdr)},
+                           {(void *) data, size}};
+    ssize_t n = pwritev(active->fd, iov, 2, active->len);
+    if (n < 0) {
+        return -errno;
+    }
+    if ((size_t) n != rec) {
+        return -ENOSPC;
+    }
+
+    auto it = slab_index.find(key);
+    if (it != slab_index.end()) {
+        index_drop(it);
+    }
+    slab_loc loc;
+    loc.slab = active->id;
+    loc.size = size;
+    loc.off = active->len + sizeof(hdr);
+    slab_index[key] = loc;
+    active->len += rec;
+    active->live += rec;
+    return 0;
+}
+
+static void md5_hex(const char *data, size_t size, char *hex) {
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    MD5((const unsigned char *) data, size, digest);
+    for (int i = 0; i < MD5_DIGEST_LENGTH; i++) {
+        sprintf(hex + 2 * i, "%02x", digest[i]);
+    }
+}
+
+/*
+ * Indexes the records of slab s. Without a seal, each record must match its
+ * key and the slab is cut at the first that does not.
+ * Returns whether the slab was sealed.
+ */
+static bool slab_scan(slab_ptr s) {
+    struct stat st;
+    if (fstat(s->fd, &st) < 0) {
+        return false;
+    }
+    size_t fsize = st.st_size;
+    std::vector <std::pair<size_t, struct slab_record>> records;
+    bool sealed = false;
+    size_t off = 0;
+    while (off + sizeof(struct slab_record) <= fsize) {
+        struct slab_record hdr;
+        if (pread(s->fd, &hdr, sizeof(hdr), off) != (ssize_t) sizeof(hdr)) {
+            break;
+        }
+        if (hdr.magic == SLAB_SEAL_MAGIC) {
+            sealed = true;
+            break;
+        }
+        if (hdr.magic != SLAB_MAGIC || off + record_bytes(hdr.size) > fsize) {
+            break;
+        }
+        records.push_back(std::make_pair(off, hdr));
+        off += record_bytes(hdr.size);
+    }
+
+    std::vector<char> buf;
+    s->len = 0;
+    for (size_t i = 0; i < records.size(); i++) {
+        struct slab_record &hdr = records[i].second;
+        size_t at = records[i].first;
+        if (!sealed) {
+            char hex[2 * MD5_DIGEST_LENGTH + 1];
+            buf.resize(hdr.size);
+            if (pread(s->fd, buf.data(), hdr.size, at + sizeof(hdr)) != (ssize_t) hdr.size) {
+                break;
+            }
+            md5_hex(buf.data(), hdr.size, hex);
+            if (memcmp(hex, hdr.key, sizeof(hdr.key)) != 0) {
+                break;
+            }
+        }
+        std::string key(hdr.key, strnlen(hdr.key, sizeof(hdr.key)));
+        auto it = slab_index.find(key);
+        if (it != slab_index.end()) {
+            index_drop(it);
+        }
+        slab_loc loc;
+        loc.slab = s->id;
+        loc.size = hdr.size;
+        loc.off = at + sizeof(hdr);
+        slab_index[key] = loc;
+        s->live += record_bytes(hdr.size);
+        s->len = at + record_bytes(hdr.size);
+    }
+    if (!sealed && s->len < fsize) {
+        // a torn tail; appending to the slab would overwrite it anyway
+        ftruncate(s->fd, s->len);
+    }
+    return sealed;
+}
+
+// moves the per-segment files of older versions into the store
+static void slab_migrate() {
+    DIR *d = opendir(slab_dir.c_str());
+    if (d == NULL) {
+        return;
+    }
+    std::vector <std::string> done;
+    std::vector<char> buf;
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        const char *name = ent->d_name;
+        if (strlen(name) != 2 * MD5_DIGEST_LENGTH + strlen(".cache") ||
+            strcmp(name + 2 * MD5_DIGEST_LENGTH, ".cache") != 0) {
+            continue;
+        }
+        std::string path = slab_dir + "/" + name;
+        struct stat st;
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            continue;
+        }
+        if (fstat(fd, &st) == 0) {
+            buf.resize(st.st_size);
+            if (pread(fd, buf.data(), st.st_size, 0) == st.st_size &&
+                slab_append(std::string(name, 2 * MD5_DIGEST_LENGTH), buf.data(), st.st_size) == 0) {
+                done.push_back(path);
+            }
+        }
+        close(fd);
+    }
+    closedir(d);
+    if (done.empty() || fsync(active->fd) < 0) {
+        return;
+    }
+    for (size_t i = 0; i < done.size(); i++) {
+        unlink(done[i].c_str());
+    }
+}
+
+/*
+ * Copies the live records of victim to the active slab, then unlinks it.
+ * Drops the lock between records so readers are not held up.
+ * Returns 0 or -errno, leaving victim in place on failure.
+ */
+static int slab_compact(slab_ptr victim, std::unique_lock <std::mutex> &lock) {
+    std::vector<char> buf;
+    // every slab a copy went to, the active one may fill up meanwhile
+    std::vector <slab_ptr> dest(1, active);
+    size_t off = 0;
+    while (off < victim->len) {
+        struct slab_record hdr;
+        if (pread(victim->fd, &hdr, sizeof(hdr), off) != (ssize_t) sizeof(hdr)) {
+            return -EIO;
+        }
+        std::string key(hdr.key, strnlen(hdr.key, sizeof(hdr.key)));
+        auto it = slab_index.find(key);
+        if (it != slab_index.end() && it->second.slab == victim->id && it->second.off == off + sizeof(hdr)) {
+            buf.resize(hdr.size);
+            if (pread(victim->fd, buf.data(), hdr.size, off + sizeof(hdr)) != (ssize_t) hdr.size) {
+                return -EIO;
+            }
+            int ret = slab_append(key, buf.data(), hdr.size);
+            if (ret < 0) {
+                return ret;
+            }
+            if (active != dest.back()) {
+                dest.push_back(active);
+            }
+        }
+        off += record_bytes(hdr.size);
+        lock.unlock();
+        lock.lock();
+    }
+
+    // the copies must be durable before the originals go
+    lock.unlock();
+    int ret = 0;
+    for (size_t i = 0; i < dest.size() && ret == 0; i++) {
+        ret = fsync(dest[i]->fd) < 0 ? -errno : 0;
+    }
+    lock.lock();
+    if (ret < 0) {
+        return ret;
+    }
+    if (victim->live > 0) {
+        // a record was missed; keep the slab rather than lose it
+        return -EAGAIN;
+    }
+    dead_bytes -= victim->len;
+    slabs.erase(victim->id);
+    unlink(victim->path.c_str());
+    return 0;
+}
+
+static slab_ptr slab_most_dead() {
+    slab_ptr victim;
+    for (auto it = slabs.begin(); it != slabs.end(); ++it) {
+        slab_ptr s = it->second;
+        if (victim == nullptr || s->len - s->live > victim->len - victim->live) {
+            victim = s;
+        }
+    }
+    return victim;
+}
+
+/*
+ * Body of the compaction thread: seals full slabs, syncing their records
+ * before writing the seal, and compacts while the store holds more than
+ * dead_max dead bytes.
+ */
+static void compact_loop() {
+    std::unique_lock <std::mutex> lock(slab_mutex);
+    while (!compactor_stop) {
+        if (!seal_queue.empty()) {
+            slab_ptr s = seal_queue.front();
+            seal_queue.pop_front();
+            lock.unlock();
+            struct slab_record seal;
+            memset(&seal, 0, sizeof(seal));
+            seal.magic = SLAB_SEAL_MAGIC;
+            if (fsync(s->fd) == 0) {
+                pwrite(s->fd, &seal, sizeof(seal), s->len);
+            }
+            lock.lock();
+            continue;
+        }
+        if (dead_bytes <= dead_max) {
+            slab_cond.wait(lock);
+            continue;
+        }
+        slab_ptr victim = slab_most_dead();
+        if (victim == active && slab_seal_active() < 0) {
+            slab_cond.wait(lock);
+            continue;
+        }
+        if (slab_compact(victim, lock) < 0) {
+            // retried once more space is freed
+            slab_cond.wait(lock);
+        }
+    }
+}
+
+/*
+ * Opens the store in dir, indexing the slabs found there, and starts the
+ * compaction thread. Slabs hold up to slab_size bytes of records.
+ * Returns 0 or -errno.
+ */
+int slab_init(const char *dir, size_t slab_size, size_t dead_limit) {
+    std::lock_guard <std::mutex> lock(slab_mutex);
+    slab_dir.assign(dir);
+    slab_size_max = slab_size;
+    dead_max = dead_limit;
+    dead_bytes = 0;
+    slabs.clear();
+    slab_index.clear();
+    seal_queue.clear();
+    active = nullptr;
+
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        return -errno;
+    }
+    struct dirent *ent;
+    size_t plen = strlen(SLAB_PREFIX);
+    std::vector <uint32_t> ids;
+    while ((ent = readdir(d)) != NULL) {
+        char *end;
+        if (strncmp(ent->d_name, SLAB_PREFIX, plen) == 0) {
+            unsigned long id = strtoul(ent->d_name + plen, &end, 10);
+            if (*end == '\0' && id > 0) {
+                ids.push_back(id);
+            }
+        }
+    }
+    closedir(d);
+
+    // ascending ids, so the newest record of a key is indexed last
+    std::sort(ids.begin(), ids.end());
+    std::vector <slab_ptr> unsealed;
+    for (size_t i = 0; i < ids.size(); i++) {
+        slab_ptr s;
+        if (slab_open(ids[i], 0, &s) < 0) {
+            continue;
+        }
+        slabs[s->id] = s;
+        if (!slab_scan(s)) {
+            unsealed.push_back(s);
+        }
+    }
+    dead_bytes = 0;
+    for (auto it = slabs.begin(); it != slabs.end(); ++it) {
+        dead_bytes += it->second->len - it->second->live;
+    }
+
+    // keep appending to the newest slab rather than starting one per mount;
+    // its seal, if any, is cut off
+    if (!slabs.empty() && slabs.rbegin()->second->len < slab_size_max &&
+        ftruncate(slabs.rbegin()->second->fd, slabs.rbegin()->second->len) == 0) {
+        active = slabs.rbegin()->second;
+    } else {
+        int ret = slab_start_new();
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    for (size_t i = 0; i < unsealed.size(); i++) {
+        if (unsealed[i] != active) {
+            seal_queue.push_back(unsealed[i]);
+        }
+    }
+    slab_migrate();
+
+    compactor_stop = false;
+    try {
+        compactor = std::thread(compact_loop);
+    } catch (const std::system_error &e) {
+        return -e.code().value();
+    }
+    ready = true;
+    return 0;
+}
+
+/*
+ * Stops the compaction thread and seals the active slab, so the next
+ * start does not have to check its records.
+ */
+void slab_destroy() {
+    {
+        std::lock_guard <std::mutex> lock(slab_mutex);
+        if (!ready) {
+            return;
+        }
+        compactor_stop = true;
+        slab_cond.notify_all();
+    }
+    compactor.join();
+
+    std::lock_guard <std::mutex> lock(slab_mutex);
+    seal_queue.push_back(active);
+    for (size_t i = 0; i < seal_queue.size(); i++) {
+        struct slab_record seal;
+        memset(&seal, 0, sizeof(seal));
+        seal.magic = SLAB_SEAL_MAGIC;
+        if (fsync(seal_queue[i]->fd) == 0) {
+            pwrite(seal_queue[i]->fd, &seal, sizeof(seal), seal_queue[i]->len);
+        }
+    }
+    seal_queue.clear();
+    slab_index.clear();
+    slabs.clear();
+    active = nullptr;
+    ready = false;
+}
+
+/*
+ * Stores segment key. A key already stored with the same size is left
+ * alone: keys are content hashes.
+ * Returns 0 or -errno.
+ */
+int slab_put(const std::string &key, const char *data, size_t size) {
+    std::lock_guard <std::mutex> lock(slab_mutex);
+    if (!ready) {
+        return -EBADF;
+    }
+    auto it = slab_index.find(key);
+    if (it != slab_index.end() && it->second.size == size) {
+        return 0;
+    }
+    return slab_append(key, data, size);
+}
+
+/*
+ * Copies up to len bytes at offset off of segment key into buf.
+ * Returns the number of bytes copied, or -ENOENT if key is not stored.
+ */
+ssize_t slab_read(const std::string &key, size_t off, char *buf, size_t len) {
+    slab_ptr s;
+    slab_loc loc;
+    {
+        std::lock_guard <std::mutex> lock(slab_mutex);
+        auto it = slab_index.find(key);
+        if (it == slab_index.end()) {
+            return -ENOENT;
+        }
+        loc = it->second;
+        auto s_it = slabs.find(loc.slab);
+        if (s_it == slabs.end()) {
+            return -ENOENT;
+        }
+        s = s_it->second;
+    }
+    if (off >= loc.size) {
+        return 0;
+    }
+    if (len > loc.size - off) {
+        len = loc.size - off;
+    }
+    ssize_t n = pread(s->fd, buf, len, loc.off + off);
+    return n < 0 ? -errno : n;
+}
+
+bool slab_has(const std::string &key) {
+    std::lock_guard <std::mutex> lock(slab_mutex);
+    return slab_index.find(key) != slab_index.end();
+}
+
+/*
+ * Forgets segment key; its bytes are reclaimed by compaction.
+ * Returns 0 or -ENOENT.
+ */
+int slab_remove(const std::string &key) {
+    std::lock_guard <std::mutex> lock(slab_mutex);
+    auto it = slab_index.find(key);
+    if (it == slab_index.end()) {
+        return -ENOENT;
+    }
+    index_drop(it);
+    slab_index.erase(it);
+    return 0;
+}
+
+void slab_keys(std::vector <std::string> &keys) {
+    std::lock_guard <std::mutex> lock(slab_mutex);
+    for (auto it = slab_index.begin(); it != slab_index.end(); ++it) {
+        keys.push_back(it->first);
+    }
+}
@@ -0,0 +1,66 @@
+//
+// Created by Wilson_Xu on 2021/12/11.
+//
+
+#ifndef SRC_MYSLAB_H
+#define SRC_MYSLAB_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <openssl/md5.h>
+
+#include <string>
+#include <vector>
+
+/*
+ * Log-structured store for the cached segments, replacing one
+ * ".cache/<md5>.cache" file per segment. Segments are appended as records
+ * to the active slab file ".cache/slab.<id>"; a full slab is sealed and a
+ * new one started. An in-memory index maps each key to its slab and
+ * offset, so reads are a pread on one of a few long-lived descriptors and
+ * a fill or eviction creates or unlinks nothing.
+ *
+ *   slab_record                       a segment: header, then size bytes
+ *   ...
+ *   slab_record (SLAB_SEAL_MAGIC)     written and synced on sealing
+ *
+ * Removing a segment only drops it from the index. A compaction thread
+ * copies the live records out of the slab with the most dead bytes and
+ * unlinks it once the store holds more than dead_limit dead bytes.
+ *
+ * The index is rebuilt at start by scanning the slabs, the newest record
+ * of a key winning. Records of a slab that was never sealed are checked
+ * against their key, the MD5 of the segment, and the slab is cut at the
+ * first torn one. Old per-segment files are moved into the store.
+ * Removals are not logged, so a removed segment whose slab was not
+ * compacted yet is back after a restart; the cache drops it again when
+ * it checks the store against its own list.
+ *
+ * Thread safe; the store's lock is a leaf, taken under cache_mutex and
+ * the RAM tier's lock.
+ */
+#define SLAB_MAGIC 0x52534643u      /* "CFSR" */
+#define SLAB_SEAL_MAGIC 0x53534643u /* "CFSS" */
+#define SLAB_PREFIX ("slab.")
+
+struct slab_record {
+    uint32_t magic;
+    uint32_t size;
+    char key[2 * MD5_DIGEST_LENGTH];
+};
+
+int slab_init(const char *dir, size_t slab_size, size_t dead_limit);
+
+void slab_destroy();
+
+int slab_put(const std::string &key, const char *data, size_t size);
+
+ssize_t slab_read(const std::string &key, size_t off, char *buf, size_t len);
+
+bool slab_has(const std::string &key);
+
+int slab_remove(const std::string &key);
+
+void slab_keys(std::vector <std::string> &keys);
+
+#endif //SRC_MYSLAB_H
@@ -34,6 +34,9 @@
 #include "mydedup.h"
 #include "mycache.h"
 #include "mysnapshot.h"
+#include "mymeta.h"
+#include "myrecipe.h"
+#include "mysegidx.h"
 #include "snapshot-api.h"
 
 #define BUF_SIZE (1024)
@@ -239,35 +242,19 @@ std::string get_snap_key(timestamp_t current_time) {
     return ret;
 }
 
-std::string seg_proxy_path() {
-    char retc[MAX_PATH_LEN];
-    snprintf(retc, MAX_PATH_LEN, "%s%s", sn_cfg->fstate->ssd_path, SEGPROXYDIR);
-//    PF("[%s]: md5: %s\t tempseg_path:%s\n", __func__, md5, seg_proxy_path);
-    std::string ret(retc);
-    return ret;
-}
-
+// Snapshot segment lists hold one md5 per line; lists written by older
+// versions hold the path of the segment's .segproxy file instead.
 std::string seg_proxy_path_to_md5(std::string seg_proxy_path) {
-    std::string substring1;
-    std::string substring2;
-    std::string string;
-    substring1.assign(sn_cfg->fstate->ssd_path).append(SEGPROXYDIR).append("/");
-    substring2.assign(".segproxy");
-    string.assign(seg_proxy_path);
-
-    PF("[%s] original string is %s\n", __func__, string.c_str());
-    PF("[%s] substring1 is %s\n", __func__, substring1.c_str());
-    PF("[%s] substring2 is %s\n", __func__, substring2.c_str());
-
-    string.erase(string.find(substring1), substring1.size());
-    string.erase(string.find(substring2), substring2.size());
-
-
-    PF("[%s] ret string is %s\n", __func__, string.c_str());
-    //hopefully this works
-
+    std::string string(seg_proxy_path);
+    size_t slash = string.rfind('/');
+    if (slash != std::string::npos) {
+        string.erase(0, slash + 1);
+    }
+    size_t ext = string.find(".segproxy");
+    if (ext != std::string::npos) {
+        string.erase(ext);
+    }
     return string;
-
 }
 
 
@@ -285,31 +272,13 @@ void mysnap_remove_segs(long timestamp) {
         return;
     }
     std::ifstream ifs(ssppath);
-    std::string segfilepath;
-    while (ifs >> segfilepath) {
-        PF("[%s]: segfile is  %s\n", __func__, segfilepath.c_str());
-        if (!file_exist(segfilepath.c_str())) {
-            PF("[%s]: ERROR %s does not exist!!!\n", __func__, segfilepath.c_str());
-            return;
-        }
-        int ref;
-        get_ref(segfilepath.c_str(), &ref);
-        if (ref > 1) {
-            set_ref(segfilepath.c_str(), ref - 1);
-            PF("[%s]: set ref of %s as ref-1 = %d\n", __func__, segfilepath.c_str(), ref - 1);
-//            PF("[%s]: key is %s for %s \n", __func__, seg_proxy_path_to_md5(segfilepath).c_str(), segfilepath.c_str());
-        } else if (ref == 1) {
-            cloud_delete_cache(seg_proxy_path_to_md5(segfilepath).c_str());
-//        cloud_delete_object(BUCKET, md5);
-            remove(segfilepath.c_str());
-            PF("[%s]: removed key %s from cloud, removed %s\n", __func__, seg_proxy_path_to_md5(segfilepath).c_str(),
-               segfilepath.c_str());
-        } else if (ref < 1) {
-
-            PF("[%s]: ERROR %s with 0 refcnt is not deleted!!!\n", __func__, segfilepath.c_str());
-            return;
-        }
-
+    std::string line;
+    while (ifs >> line) {
+        std::string md5 = seg_proxy_path_to_md5(line);
+        PF("[%s]: seg is  %s\n", __func__, md5.c_str());
+        // waits for, and marks, segments being uploaded or deleted like
+        // every other removal
+        mydedup_remove_one_seg(md5.c_str());
     }
 
     ifs.close();
@@ -322,33 +291,23 @@ void mysnap_remove_segs(long timestamp) {
 void mysnap_cloud_backup(long timestamp) {
     PF("[%s]: \n", __func__);
 
-    std::vector <std::string> segfiles;
-
-    std::string temp = seg_proxy_path();
-    std::string path = seg_proxy_path();
-    DIR *d = opendir(path.c_str());
-    if (!d) {
-        PF("[%s]: d is NULL\n", __func__);
-        return;
-    }
-    struct dirent *ent;
     std::vector <std::string> segs;
-    while ((ent = readdir(d)) != NULL) {
-        std::string f(ent->d_name);
-        PF("[%s]: ent: %s\n", __func__, ent->d_name);
-        if (f == "." || f == "..") {
-            continue;
-        } else {
-            segfiles.push_back(temp.assign(path).append("/").append(f));
-        }
+
+    // the snapshot holds a reference to every segment indexed right now;
+    // the lock covers only that, not writing the list out
+    mydedup_lock_refs();
+    segidx_list(segs);
+    for (int i = 0; i < segs.size(); i++) {
+        segidx_incref(segs[i].c_str(), 0, SEG_LOC_CLOUD);//refcnt plus one
     }
+    mydedup_unlock_refs();
+
     std::string sspkey = get_snap_seg_proxy_key(timestamp);
     std::string ssppath = get_snap_seg_proxy(timestamp);
     FILE *ssproxy = FFOPEN__(ssppath.c_str(), "w");
 
-    for (int i = 0; i < segfiles.size(); i++) {
-        PF("[%s]: segfiles[%d]: %s\n", __func__, i, segfiles[i].c_str());
-        fprintf(ssproxy, "%s\n", segfiles[i].c_str());
+    for (int i = 0; i < segs.size(); i++) {
+        fprintf(ssproxy, "%s\n", segs[i].c_str());
     }
 
     FFCLOSE__(ssproxy);
@@ -357,13 +316,6 @@ void mysnap_cloud_backup(long timestamp) {
     cloud_put(ssppath.c_str(), sspkey.c_str(), statbuf.st_size);
 
     unlink(ssppath.c_str());
-
-
-    for (int i = 0; i < segfiles.size(); i++) {
-        int refcnt = 0;
-        get_ref(segfiles[i].c_str(), &refcnt);
-        set_ref(segfiles[i].c_str(), refcnt + 1);//refcnt plus one
-    }
 }
 
 
@@ -476,6 +428,8 @@ int mysnap_uninstall(long timestamp) {
     }
 
     mysnap_removedir(install_path);
+    mymeta_clear();
+    recipe_cache_clear();
     installed--;
     snapshots[snapindex]->installed = 0;
 
@@ -564,6 +518,8 @@ int mysnap_restore(long timestamp) {
 
     std::string root = sn_cfg->fstate->ssd_path;
     mysnap_removedir(root);
+    mymeta_clear();
+    recipe_cache_clear();
 
 
 //    outfile=fopen(tar_path_s.c_str(), "wb");
@@ -585,6 +541,7 @@ int mysnap_restore(long timestamp) {
 
 
     unlink(tar_path_s.c_str());
+    segidx_reload();
 
 //    sysret = mysnap_chmod2_555(sn_cfg->fstate->ssd_path);
 //    sysret = mysnap_chmod(sn_cfg->fstate->ssd_path, "555");
@@ -714,8 +671,8 @@ void mysnap_store() {
 void mysnap_rebuild() {
     std::string snapmaster = snapmaster_path();
 
-    outfile = FFOPEN__(snapmaster.c_str(), "wb");
-    cloud_get_object(BUCKET, "snapshotmaster.metadata", get_buffer);
+    FILE *outfile = FFOPEN__(snapmaster.c_str(), "wb");
+    cloud_get_object(BUCKET, "snapshotmaster.metadata", get_buffer, outfile);
     FFCLOSE__(outfile);
     struct stat statbuf;
     if (lstat(snapmaster.c_str(), &statbuf) < 0) {
@@ -41,7 +41,6 @@ int mysnap_tar(timestamp_t time);
 
 std::string get_snap_key(timestamp_t current_time);
 
-std::string seg_proxy_path();
 
 //add 1 for all the blocks in cloud
 void mysnap_cloud_backup(long timestamp);
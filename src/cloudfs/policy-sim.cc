@@ -0,0 +1,207 @@
+//
+// Created by Wilson_Xu on 2021/12/08.
+//
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "mycache.h"
+#include "mypolicy.h"
+#include "mysketch.h"
+
+void usage(const char *program) {
+    printf("\n");
+    printf("This program replays a segment access trace against every\n");
+    printf("replacement policy of the segment cache and prints the hit\n");
+    printf("ratio, the bytes that would be fetched from the cloud and\n");
+    printf("what fetching them would cost, each with and without the\n");
+    printf("TinyLFU admission filter.\n");
+    printf("A trace has one \"<md5> <size>\" line per segment access.\n");
+    printf("Without one, a synthetic trace is used: a hot set of\n");
+    printf("segments shared by many files read with a Zipf skew, with\n");
+    printf("a sequential scan of never reused segments (a backup job)\n");
+    printf("every <scan-every> accesses.\n\n");
+    printf("Usage : %s -f <trace> -c <cache-size-KB>[,<cache-size-KB>...]\n", program);
+    printf("           -n <accesses> -H <hot-segments> -z <zipf-skew>\n");
+    printf("           -S <scan-segments> -e <scan-every>\n\n");
+}
+
+struct trace_access {
+    std::string key;
+    size_t size;
+};
+
+// segment sizes around 4KB, as the default Rabin parameters give
+static size_t seg_size(long id) {
+    return 3072 + (size_t) ((id * 2654435761u) % 3073);
+}
+
+static void synthetic_trace(std::vector <trace_access> &trace, long n, long hot, double skew, long scan, long every) {
+    std::vector<double> cdf(hot);
+    double sum = 0;
+    for (long i = 0; i < hot; i++) {
+        sum += 1.0 / pow(i + 1, skew);
+        cdf[i] = sum;
+    }
+    char key[64];
+    long next_cold = hot;
+    srand(1);
+    for (long i = 0; i < n; i++) {
+        if (every > 0 && i % every == every - 1) {
+            for (long j = 0; j < scan; j++, next_cold++) {
+                snprintf(key, sizeof key, "%032lx", next_cold);
+                trace.push_back({key, seg_size(next_cold)});
+            }
+        }
+        double u = sum * ((double) rand() / RAND_MAX);
+        long id = std::lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin();
+        if (id >= hot) {
+            id = hot - 1;
+        }
+        snprintf(key, sizeof key, "%032lx", id);
+        trace.push_back({key, seg_size(id)});
+    }
+}
+
+static int load_trace(const char *fname, std::vector <trace_access> &trace) {
+    FILE *fp = fopen(fname, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+    char key[PATH_MAX];
+    size_t size;
+    while (fscanf(fp, "%4095s %zu", key, &size) == 2) {
+        trace.push_back({key, size});
+    }
+    fclose(fp);
+    return 0;
+}
+
+// the lookup, admit, insert and evict loop of cache_get/cache_put, minus the files
+static void simulate(struct cache_policy *policy, std::vector <trace_access> &trace, size_t capacity,
+                     size_t avg_size, bool admission) {
+    std::unordered_map<std::string, DLinkedNode *> map;
+    struct sketch freq;
+    size_t total = 0, hits = 0, gets = 0, get_bytes = 0;
+    policy->reset();
+    if (admission) {
+        sketch_init(&freq, capacity / avg_size);
+    }
+    for (size_t i = 0; i < trace.size(); i++) {
+        sketch_add(&freq, trace[i].key);
+        auto it = map.find(trace[i].key);
+        if (it != map.end()) {
+            policy->hit(it->second);
+            hits++;
+            continue;
+        }
+        gets++;
+        get_bytes += trace[i].size;
+        if (trace[i].size > capacity) {
+            continue;
+        }
+        if (admission && total + trace[i].size > capacity) {
+            DLinkedNode *victim = policy->peek(capacity);
+            if (victim != nullptr && sketch_estimate(&freq, trace[i].key) <= sketch_estimate(&freq, victim->key)) {
+                continue;
+            }
+        }
+        DLinkedNode *node = new DLinkedNode(trace[i].key, trace[i].size, 0);
+        map[node->key] = node;
+        policy->insert(node, capacity);
+        total += node->size;
+        while (total > capacity) {
+            DLinkedNode *victim = policy->victim(capacity);
+            if (victim == nullptr) {
+                break;
+            }
+            total -= victim->size;
+            map.erase(victim->key);
+            delete victim;
+        }
+    }
+    printf("%-8s %-9s %10zu %10.2f%% %12.1f %12.2f\n", policy->name, admission ? "tinylfu" : "-", capacity / 1024,
+           100.0 * hits / trace.size(), get_bytes / 1048576.0,
+           gets * CLOUD_COST_PER_REQUEST + get_bytes / 1048576.0 * CLOUD_COST_PER_MB);
+    for (auto it = map.begin(); it != map.end(); ++it) {
+        delete it->second;
+    }
+    policy->reset();
+}
+
+int main(int argc, const char *argv[]) {
+    char fname[PATH_MAX] = {0};
+    char sizes[256] = "16384,65536";
+    long n = 2000000;
+    long hot = 20000;
+    double skew = 0.9;
+    long scan = 50000;
+    long every = 250000;
+
+    int c;
+    while ((c = getopt(argc, (char *const *) argv, "f:c:n:H:z:S:e:")) != -1) {
+        switch (c) {
+            case 'f':
+                strncpy(fname, optarg, sizeof fname - 1);
+                break;
+            case 'c':
+                strncpy(sizes, optarg, sizeof sizes - 1);
+                break;
+            case 'n':
+                n = atol(optarg);
+                break;
+            case 'H':
+                hot = atol(optarg);
+                break;
+            case 'z':
+                skew = atof(optarg);
+                break;
+            case 'S':
+                scan = atol(optarg);
+                break;
+            case 'e':
+                every = atol(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                exit(1);
+        }
+    }
+
+    std::vector <trace_access> trace;
+    if (fname[0]) {
+        if (load_trace(fname, trace) < 0) {
+            perror("open failed:");
+            exit(2);
+        }
+    } else {
+        synthetic_trace(trace, n, hot, skew, scan, every);
+    }
+
+    printf("%zu accesses\n", trace.size());
+    size_t avg_size = 0;
+    for (size_t i = 0; i < trace.size(); i++) {
+        avg_size += trace[i].size;
+    }
+    avg_size = trace.empty() ? 1 : std::max(avg_size / trace.size(), (size_t) 1);
+
+    printf("%-8s %-9s %10s %11s %12s %12s\n", "policy", "admission", "cache KB", "hit ratio", "GET MB", "GET cost");
+    const char *names[] = {"lru", "arc", "s3fifo", "gdsf"};
+    for (char *tok = strtok(sizes, ","); tok != NULL; tok = strtok(NULL, ",")) {
+        size_t capacity = (size_t) atol(tok) * 1024;
+        for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+            simulate(cache_policy_find(names[i]), trace, capacity, avg_size, false);
+            simulate(cache_policy_find(names[i]), trace, capacity, avg_size, true);
+        }
+    }
+    return 0;
+}
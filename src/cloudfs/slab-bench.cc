@@ -0,0 +1,208 @@
+//
+// Created by Wilson_Xu on 2021/12/12.
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <openssl/md5.h>
+#include <time.h>
+
+#include <string>
+#include <vector>
+
+#include "myslab.h"
+
+void usage(const char *program) {
+    printf("\n");
+    printf("This program times looking up and reading one cached\n");
+    printf("segment as the number of segments grows from 1k up to\n");
+    printf("<max-segments> in steps of 10x, for three layouts of the\n");
+    printf("cache directory:\n");
+    printf("  flat    one <md5>.cache file per segment in one directory\n");
+    printf("  fanout  the same files under two levels of <ab>/<cd>/\n");
+    printf("          directories named after the digest\n");
+    printf("  slab    the slab store cloudfs keeps its segments in\n");
+    printf("With -c the kernel's dentry and inode caches are dropped\n");
+    printf("before each timing (needs root), so that a file lookup goes\n");
+    printf("to the file system, which on ext2 scans the directory.\n\n");
+    printf("Usage : %s -n <max-segments> -o <ops-per-size> -d <scratch-dir>\n", program);
+    printf("           -s <segment-size> -l <flat|fanout|slab> [-c]\n\n");
+}
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static std::string make_key(const char *data, size_t size) {
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    char key[2 * MD5_DIGEST_LENGTH + 1];
+    MD5((const unsigned char *) data, size, digest);
+    for (int b = 0; b < MD5_DIGEST_LENGTH; b++) {
+        sprintf(key + 2 * b, "%02x", digest[b]);
+    }
+    return std::string(key);
+}
+
+static std::string file_path(const std::string &dir, const std::string &key, bool fanout) {
+    if (!fanout) {
+        return dir + "/" + key + ".cache";
+    }
+    return dir + "/" + key.substr(0, 2) + "/" + key.substr(2, 2) + "/" + key + ".cache";
+}
+
+static int file_put(const std::string &path, const char *data, size_t size) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -errno;
+    }
+    ssize_t n = write(fd, data, size);
+    close(fd);
+    return n == (ssize_t) size ? 0 : -EIO;
+}
+
+static ssize_t file_read(const std::string &path, char *buf, size_t len) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return -errno;
+    }
+    ssize_t n = pread(fd, buf, len, 0);
+    close(fd);
+    return n;
+}
+
+static void drop_caches() {
+    sync();
+    FILE *fp = fopen("/proc/sys/vm/drop_caches", "w");
+    if (fp == NULL) {
+        fprintf(stderr, "cannot drop caches: %s\n", strerror(errno));
+        return;
+    }
+    fputs("2\n", fp);
+    fclose(fp);
+}
+
+int main(int argc, const char *argv[]) {
+    long max_segs = 1000000;
+    long ops = 100000;
+    size_t seg_size = 256;
+    char dir[PATH_MAX] = "/tmp/slab-bench";
+    char layout[16] = "slab";
+    bool drop = false;
+
+    int c;
+    while ((c = getopt(argc, (char *const *) argv, "n:o:d:s:l:c")) != -1) {
+        switch (c) {
+            case 'n':
+                max_segs = atol(optarg);
+                break;
+            case 'o':
+                ops = atol(optarg);
+                break;
+            case 'd':
+                strncpy(dir, optarg, sizeof dir - 1);
+                break;
+            case 's':
+                seg_size = atol(optarg);
+                break;
+            case 'l':
+                strncpy(layout, optarg, sizeof layout - 1);
+                break;
+            case 'c':
+                drop = true;
+                break;
+            default:
+                usage(argv[0]);
+                exit(1);
+        }
+    }
+    bool slab = strcmp(layout, "slab") == 0;
+    bool fanout = strcmp(layout, "fanout") == 0;
+    if (!slab && !fanout && strcmp(layout, "flat") != 0) {
+        usage(argv[0]);
+        exit(1);
+    }
+    if (seg_size < sizeof(long)) {
+        seg_size = sizeof(long);
+    }
+
+    // a scratch directory of our own, so it can be emptied without care
+    std::string root = std::string(dir) + "/" + layout;
+    std::string cmd = "rm -rf '" + root + "'";
+    system(cmd.c_str());
+    mkdir(dir, 0755);
+    mkdir(root.c_str(), 0755);
+    if (fanout) {
+        char sub[8];
+        for (int a = 0; a < 256; a++) {
+            snprintf(sub, sizeof sub, "/%02x", a);
+            mkdir((root + sub).c_str(), 0755);
+            for (int b = 0; b < 256; b++) {
+                char subsub[8];
+                snprintf(subsub, sizeof subsub, "/%02x", b);
+                mkdir((root + sub + subsub).c_str(), 0755);
+            }
+        }
+    }
+    if (slab && slab_init(root.c_str(), 64 << 20, (size_t) 1 << 40) < 0) {
+        fprintf(stderr, "cannot open the slab store in %s\n", root.c_str());
+        exit(1);
+    }
+
+    std::vector <std::string> keys;
+    keys.reserve(max_segs);
+    std::vector<char> data(seg_size), buf(seg_size);
+
+    printf("layout %s, %zu-byte segments\n", layout, seg_size);
+    printf("%12s %14s\n", "segments", "read ns/op");
+    srand(1);
+    for (long n = 1000; n <= max_segs; n *= 10) {
+        for (long i = keys.size(); i < n; i++) {
+            memset(data.data(), 0, seg_size);
+            memcpy(data.data(), &i, sizeof(i));
+            std::string key = make_key(data.data(), seg_size);
+            int ret = slab ? slab_put(key, data.data(), seg_size) :
+                      file_put(file_path(root, key, fanout), data.data(), seg_size);
+            if (ret < 0) {
+                fprintf(stderr, "storing segment %ld failed: %s\n", i, strerror(-ret));
+                exit(1);
+            }
+            keys.push_back(key);
+        }
+        if (drop) {
+            drop_caches();
+        }
+
+        long missed = 0;
+        double t0 = now_ns();
+        for (long i = 0; i < ops; i++) {
+            const std::string &key = keys[((long) rand() * RAND_MAX + rand()) % n];
+            ssize_t r = slab ? slab_read(key, 0, buf.data(), seg_size) :
+                        file_read(file_path(root, key, fanout), buf.data(), seg_size);
+            if (r != (ssize_t) seg_size) {
+                missed++;
+            }
+        }
+        double t1 = now_ns();
+
+        printf("%12ld %14.1f\n", n, (t1 - t0) / ops);
+        if (missed > 0) {
+            printf("%ld reads failed\n", missed);
+        }
+        fflush(stdout);
+    }
+
+    if (slab) {
+        slab_destroy();
+    }
+    system(cmd.c_str());
+    return 0;
+}
@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <vector>
+#include "rabinpoly.h"
+
+void usage(const char *program) {
+    printf("\n");
+    printf("This program times the chunking engines of the dedup\n");
+    printf("library on the same data, fed in <buffer-size> pieces the\n");
+    printf("way FUSE writes arrive, and prints the throughput and the\n");
+    printf("distribution of the segment sizes of each engine. The\n");
+    printf("rabin-generic row runs the Rabin engine without the loops\n");
+    printf("compiled for common window sizes; init is the cost of one\n");
+    printf("rabin_init_engine and rabin_free.\n\n");
+    printf("Usage : %s [-f <file>]... -a <avg-segment-size>\n", program);
+    printf("           -i <min-segment-size> -x <max-segment-size>\n");
+    printf("           -w <rabin-window-size> -b <buffer-size>\n");
+    printf("           -r <rounds> -n <random-MB>\n\n");
+    printf("Incase no file is specified, <random-MB> of random data is used.\n\n");
+}
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int read_file(const char *fname, std::vector<char> &data) {
+    int fd = open(fname, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof buf)) > 0) {
+        data.insert(data.end(), buf, buf + n);
+    }
+    close(fd);
+    return n < 0 ? -1 : 0;
+}
+
+/*
+ * Splits data into segments with rp, bytes_per_call at a time, and appends
+ * the segment sizes to sizes.
+ */
+static int chunk(rabinpoly_t *rp, const std::vector<char> &data, size_t bytes_per_call,
+                 std::vector<unsigned int> &sizes) {
+    unsigned int segment_len = 0;
+    int new_segment = 0;
+    for (size_t off = 0; off < data.size(); off += bytes_per_call) {
+        const char *buftoread = data.data() + off;
+        int bytes = data.size() - off < bytes_per_call ? data.size() - off : bytes_per_call;
+        int len;
+        while (bytes > 0 && (len = rabin_segment_next(rp, buftoread, bytes, &new_segment)) > 0) {
+            segment_len += len;
+            if (new_segment) {
+                sizes.push_back(segment_len);
+                segment_len = 0;
+            }
+            buftoread += len;
+            bytes -= len;
+        }
+        if (bytes > 0) {
+            return -1;
+        }
+    }
+    if (segment_len) {
+        sizes.push_back(segment_len);
+    }
+    rabin_reset(rp);
+    return 0;
+}
+
+int main(int argc, const char *argv[]) {
+    int window_size = 48;
+    int avg_seg_size = 4096;
+    int min_seg_size = 2048;
+    int max_seg_size = 8192;
+    size_t buf_size = 4096;
+    int rounds = 5;
+    int random_mb = 64;
+    std::vector<char> data;
+
+    int c;
+    while ((c = getopt(argc, (char *const *) argv, "f:w:a:i:x:b:r:n:")) != -1) {
+        switch (c) {
+            case 'f':
+                if (read_file(optarg, data) < 0) {
+                    perror("read failed:");
+                    exit(2);
+                }
+                break;
+            case 'w':
+                window_size = atoi(optarg);
+                break;
+            case 'a':
+                avg_seg_size = atoi(optarg);
+                break;
+            case 'i':
+                min_seg_size = atoi(optarg);
+                break;
+            case 'x':
+                max_seg_size = atoi(optarg);
+                break;
+            case 'b':
+                buf_size = atol(optarg);
+                break;
+            case 'r':
+                rounds = atoi(optarg);
+                break;
+            case 'n':
+                random_mb = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                exit(1);
+        }
+    }
+    if (data.empty()) {
+        srand(1);
+        data.resize((size_t) random_mb << 20);
+        for (size_t i = 0; i < data.size(); i++) {
+            data[i] = rand();
+        }
+    }
+    if (buf_size == 0 || rounds <= 0) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    struct {
+        const char *name;
+        const char *engine;
+        bool generic;
+    } engines[] = {{"rabin", "rabin", false}, {"rabin-generic", "rabin", true}, {"gear", "gear", false}};
+    printf("%.1f MB in %zu-byte buffers, segments %d/%d/%d, window %d, %d rounds\n",
+           data.size() / 1048576.0, buf_size, min_seg_size, avg_seg_size, max_seg_size, window_size, rounds);
+    printf("%-13s %10s %10s %10s %10s %10s %10s %10s\n",
+           "engine", "MB/s", "init us", "segments", "avg", "stddev", "min", "max");
+    for (size_t e = 0; e < sizeof engines / sizeof engines[0]; e++) {
+        int engine = dedup_engine_find(engines[e].engine);
+        const int inits = 10000;
+        double start = now_sec();
+        for (int r = 0; r < inits; r++) {
+            rabinpoly_t *rp = rabin_init_engine(engine, window_size, avg_seg_size, min_seg_size, max_seg_size);
+            rabin_free(&rp);
+        }
+        double init_us = (now_sec() - start) / inits * 1e6;
+
+        rabinpoly_t *rp = rabin_init_engine(engine, window_size, avg_seg_size, min_seg_size, max_seg_size);
+        if (!rp) {
+            fprintf(stderr, "Failed to init the %s engine\n", engines[e].engine);
+            exit(1);
+        }
+        if (engines[e].generic) {
+            rp->next = rabin_generic_next;
+        }
+
+        std::vector<unsigned int> sizes;
+        double best = 0;
+        for (int r = 0; r < rounds; r++) {
+            sizes.clear();
+            double t0 = now_sec();
+            if (chunk(rp, data, buf_size, sizes) < 0) {
+                fprintf(stderr, "Failed to process the segment\n");
+                exit(2);
+            }
+            double t1 = now_sec();
+            if (r == 0 || t1 - t0 < best) {
+                best = t1 - t0;
+            }
+        }
+        rabin_free(&rp);
+
+        // the last segment is cut by the end of the data, not by the engine
+        size_t n = sizes.size() > 1 ? sizes.size() - 1 : sizes.size();
+        double sum = 0, sq = 0;
+        unsigned int lo = sizes[0], hi = sizes[0];
+        for (size_t i = 0; i < n; i++) {
+            sum += sizes[i];
+            sq += (double) sizes[i] * sizes[i];
+            lo = sizes[i] < lo ? sizes[i] : lo;
+            hi = sizes[i] > hi ? sizes[i] : hi;
+        }
+        double avg = sum / n;
+        printf("%-13s %10.1f %10.2f %10zu %10.1f %10.1f %10u %10u\n", engines[e].name,
+               data.size() / 1048576.0 / best, init_us, sizes.size(), avg, sqrt(sq / n - avg * avg), lo, hi);
+    }
+    return 0;
+}
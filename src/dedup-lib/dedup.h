@@ -47,6 +47,47 @@ rabinpoly_t *rabin_init(unsigned int window_size,
 						unsigned int min_segment_size,
 						unsigned int max_segment_size);
 
+/**
+ * Chunking engines that rabin_init_engine() can set up
+ *
+ * DEDUP_ENGINE_RABIN  Rabin fingerprint over a sliding window (rabin_init)
+ * DEDUP_ENGINE_GEAR   Gear hash with FastCDC's normalized chunking: a
+ *                     stricter boundary test below the average segment
+ *                     size and a looser one above it, and no hashing of
+ *                     the first min_segment_size bytes of a segment
+ */
+#define DEDUP_ENGINE_RABIN 0
+#define DEDUP_ENGINE_GEAR 1
+
+/**
+ * @brief Looks up a chunking engine by name ("rabin" or "gear").
+ *
+ * @param [in] name Name of the engine
+ *
+ * @retval engine One of the DEDUP_ENGINE_* values
+ * @retval -1 If there is no such engine
+ */
+int dedup_engine_find(const char *name);
+
+/**
+ * @brief Initializes the given chunking engine.
+ *
+ * Same as rabin_init(), but segments with engine instead of the Rabin
+ * fingerprint. The window size only applies to DEDUP_ENGINE_RABIN. The
+ * handle is used with rabin_segment_next(), rabin_reset() and
+ * rabin_free() like any other.
+ *
+ * @param [in] engine One of the DEDUP_ENGINE_* values
+ *
+ * @retval rp Pointer to a allocated rabin_poly_t structure
+ * @retval NULL Incase of errors during initialization
+ */
+rabinpoly_t *rabin_init_engine(int engine,
+						unsigned int window_size,
+						unsigned int avg_segment_size,
+						unsigned int min_segment_size,
+						unsigned int max_segment_size);
+
 /**
  * @brief Find the next segment boundary.
  *
@@ -89,6 +130,36 @@ int rabin_segment_next(rabinpoly_t *rp,
  */
 void rabin_reset(rabinpoly_t *rp);
 
+/**
+ * @brief Sets rp up to chunk a stream from a segment boundary on.
+ *
+ * Afterwards rabin_segment_next() finds the same boundaries as a handle
+ * that was fed the whole stream and found a boundary right before the
+ * next byte, so that a stream can be chunked from any boundary without
+ * going over what comes before it. Only the last window_size bytes of
+ * the history are used, and none by DEDUP_ENGINE_GEAR.
+ *
+ * @param [in] rp Pointer to the rabinpoly_t structure returned by rabin_init
+ * @param [in] history The bytes of the stream before the boundary
+ * @param [in] bytes Number of bytes in history, may be fewer than
+ *                   window_size at the start of the stream
+ *
+ * @retval void None
+ */
+void rabin_resume(rabinpoly_t *rp, const char *history, unsigned int bytes);
+
+/**
+ * @brief Allocates a new handle with the engine and segment sizes of rp.
+ *
+ * The new handle is at the start of a stream, as from rabin_init().
+ *
+ * @param [in] rp Pointer to the rabinpoly_t structure returned by rabin_init
+ *
+ * @retval rp Pointer to a allocated rabin_poly_t structure
+ * @retval NULL Incase of errors during initialization
+ */
+rabinpoly_t *rabin_dup(const rabinpoly_t *rp);
+
 /**
  * @brief Frees the Rabin Fingerprinting algorithm's datastructure
  *
@@ -101,4 +172,40 @@ void rabin_reset(rabinpoly_t *rp);
  */
 void rabin_free(rabinpoly_t **p_rp);
 
+/**
+ * Compute cost of the chunking done so far by all handles of the process
+ *
+ * calls     Calls to rabin_segment_next()
+ * bytes     Bytes the calls consumed
+ * segments  Segment boundaries they found
+ */
+typedef struct dedup_stats {
+	unsigned long long calls;
+	unsigned long long bytes;
+	unsigned long long segments;
+} dedup_stats_t;
+
+/**
+ * @brief Reads the compute cost counters.
+ *
+ * The counters are kept in memory. The number of calls is also written
+ * to DEDUP_STATS_FILE, at most once every DEDUP_STATS_INTERVAL seconds
+ * while chunking goes on, and by dedup_stats_flush().
+ *
+ * @param [out] stats Filled with the current counters
+ *
+ * @retval void None
+ */
+void dedup_stats_get(dedup_stats_t *stats);
+
+/**
+ * @brief Writes the current number of calls to DEDUP_STATS_FILE now.
+ *
+ * @retval void None
+ */
+void dedup_stats_flush(void);
+
+#define DEDUP_STATS_FILE "/tmp/dedupe_compute_cost"
+#define DEDUP_STATS_INTERVAL 1
+
 #endif /* _DEDUP_H_ */
@@ -0,0 +1,136 @@
+/*
+ * Gear hash chunking with FastCDC's normalized chunking (Xia et al.,
+ * USENIX ATC '16), behind the same interface as the Rabin engine.
+ *
+ * The gear hash takes one shift, one add and one table lookup per byte,
+ * and needs no window: the top bits of the 64-bit hash depend on the last
+ * 64 bytes only. Boundaries are where the top bits are all zero. Below
+ * the average segment size that test takes NORMAL_LEVEL more bits, above
+ * it NORMAL_LEVEL fewer, which keeps segment sizes close to the average.
+ * The first min_segment_size bytes of a segment can never hold a
+ * boundary, so they are skipped without being hashed.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "rabinpoly.h"
+#include "msb.h"
+
+#define NORMAL_LEVEL 2
+
+/* fixed, so that the same data always gives the same segments */
+#define GEAR_SEED 0x9e3779b97f4a7c15ULL
+
+static u_int64_t splitmix64(u_int64_t *state)
+{
+	u_int64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/* the top n bits of the hash */
+static u_int64_t top_bits(int n)
+{
+	if (n <= 0) {
+		return 0;
+	}
+	if (n >= 64) {
+		return ~0ULL;
+	}
+	return ~0ULL << (64 - n);
+}
+
+static bool gear_fill(u_int64_t *G)
+{
+	u_int64_t state = GEAR_SEED;
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		G[i] = splitmix64(&state);
+	}
+	return true;
+}
+
+/* the same for every handle, so it is filled once */
+static const u_int64_t *gear_table()
+{
+	static u_int64_t G[256];
+	static const bool filled = gear_fill(G);
+
+	(void) filled;
+	return G;
+}
+
+void gear_init(rabinpoly_t *rp)
+{
+	int bits = fls32(rp->avg_segment_size) - 1;
+
+	rp->G = gear_table();
+	rp->mask_small = top_bits(bits + NORMAL_LEVEL);
+	rp->mask_large = top_bits(bits > NORMAL_LEVEL ? bits - NORMAL_LEVEL : 1);
+}
+
+/*
+ * Same contract as rabin_segment_next. The hash and the size of the
+ * current segment carry over between calls, so a stream is cut the same
+ * however it is split into buffers.
+ */
+int gear_segment_next(rabinpoly_t *rp, const char *buf, unsigned int bytes,
+						int *is_new_segment)
+{
+	const u_char *p = (const u_char *) buf;
+	const u_int64_t *G = rp->G;
+	u_int64_t fp = rp->fingerprint;
+	unsigned int cur = rp->cur_seg_size;
+	unsigned int i = 0;
+
+	if (cur < rp->min_segment_size) {
+		unsigned int skip = rp->min_segment_size - cur;
+		if (skip >= bytes) {
+			rp->cur_seg_size = cur + bytes;
+			return bytes;
+		}
+		i = skip;
+		cur += skip;
+	}
+
+	/* from here on, byte i ends a segment of i + 1 + base bytes */
+	unsigned int base = cur - i;
+	unsigned int small_end = rp->avg_segment_size > cur ?
+			rp->avg_segment_size - base : i;
+	unsigned int max_end = rp->max_segment_size - base;
+	unsigned int end;
+
+	end = small_end < bytes ? small_end : bytes;
+	for (; i < end; i++) {
+		fp = (fp << 1) + G[p[i]];
+		if (!(fp & rp->mask_small)) {
+			break;
+		}
+	}
+	if (i == end) {
+		end = max_end < bytes ? max_end : bytes;
+		for (; i < end; i++) {
+			fp = (fp << 1) + G[p[i]];
+			if (!(fp & rp->mask_large)) {
+				break;
+			}
+		}
+		if (i == end && end < max_end) {
+			/* ran out of input */
+			rp->fingerprint = fp;
+			rp->cur_seg_size = i + base;
+			return i;
+		}
+		if (i == end) {
+			/* the segment reached max_segment_size */
+			i--;
+		}
+	}
+
+	*is_new_segment = 1;
+	rp->fingerprint = 0;
+	rp->cur_seg_size = 0;
+	return i + 1;
+}
@@ -23,6 +23,10 @@
  */
 #include <stdlib.h>
 #include <stdio.h>
+#include <time.h>
+
+#include <atomic>
+#include <mutex>
 
 #include "rabinpoly.h"
 #include "msb.h"
@@ -40,21 +44,52 @@ static u_int64_t polymod (u_int64_t nh, u_int64_t nl, u_int64_t d);
 static void polymult (u_int64_t *php, u_int64_t *plp, u_int64_t x, u_int64_t y);
 static u_int64_t polymmult (u_int64_t x, u_int64_t y, u_int64_t d);
 
-static void calcT(rabinpoly_t *rp);
+static void calcT(struct rabin_tables *t);
+static segment_next_fn rabin_fixed_next(unsigned int window_size, int shift);
 static u_int64_t slide8(rabinpoly_t *rp, u_char m);
 static u_int64_t append8(rabinpoly_t *rp, u_int64_t p, u_char m);
 
-static int dedupe_compute_cost = 0;
+/*
+ * Compute cost counters, shared by all handles. rabin_segment_next only
+ * bumps them; the call count reaches DEDUP_STATS_FILE from whichever call
+ * first finds the last write DEDUP_STATS_INTERVAL seconds old.
+ */
+static std::atomic<unsigned long long> stat_calls(0);
+static std::atomic<unsigned long long> stat_bytes(0);
+static std::atomic<unsigned long long> stat_segments(0);
+static std::atomic<long> stat_flushed(0);
+
+static long now_sec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec;
+}
+
+static void stats_write()
+{
+	FILE* fp = fopen(DEDUP_STATS_FILE, "w");
+	if (!fp) {
+		return;
+	}
+	fprintf(fp, "%llu\n", stat_calls.load(std::memory_order_relaxed));
+	fclose(fp);
+}
 
-static void log_dedupe_compute_cost()
+static void stats_account(int bytes, int is_new_segment)
 {
-    FILE* fp = fopen("/tmp/dedupe_compute_cost","w");
-    if (!fp) {
-        return;
-    }
-    dedupe_compute_cost++;
-    fprintf(fp, "%d\n", dedupe_compute_cost);
-    fclose(fp);
+	stat_calls.fetch_add(1, std::memory_order_relaxed);
+	stat_bytes.fetch_add(bytes, std::memory_order_relaxed);
+	if (is_new_segment) {
+		stat_segments.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	long now = now_sec();
+	long last = stat_flushed.load(std::memory_order_relaxed);
+	if (now - last >= DEDUP_STATS_INTERVAL &&
+		stat_flushed.compare_exchange_strong(last, now)) {
+		stats_write();
+	}
 }
 
 
@@ -113,29 +148,58 @@ polymmult (u_int64_t x, u_int64_t y, u_int64_t d)
 
 /**
  * Initialize the T[] and U[] array for faster computation of rabin fingerprint
- * Called only once from rabin_init() during initialization
+ * Called only once per polynomial and window size, see tables_get()
  */
-static void calcT(rabinpoly_t *rp)
+static void calcT(struct rabin_tables *t)
 {
 	unsigned int i;
-	int xshift = fls64 (rp->poly) - 1;
-	rp->shift = xshift - 8;
+	int xshift = fls64 (t->poly) - 1;
+	t->shift = xshift - 8;
 
-	u_int64_t T1 = polymod (0, INT64 (1) << xshift, rp->poly);
+	u_int64_t T1 = polymod (0, INT64 (1) << xshift, t->poly);
 	for (i = 0; i < 256; i++) {
-		rp->T[i] = polymmult (i, T1, rp->poly) | ((u_int64_t) i << xshift);
+		t->T[i] = polymmult (i, T1, t->poly) | ((u_int64_t) i << xshift);
 	}
 
 	u_int64_t sizeshift = 1;
-	for (i = 1; i < rp->window_size; i++) {
-		sizeshift = append8 (rp, sizeshift, 0);
+	for (i = 1; i < t->window_size; i++) {
+		sizeshift = (sizeshift << 8) ^ t->T[sizeshift >> t->shift];
 	}
 
 	for (i = 0; i < 256; i++) {
-		rp->U[i] = polymmult (i, sizeshift, rp->poly);
+		t->U[i] = polymmult (i, sizeshift, t->poly);
 	}
 }
 
+/**
+ * Returns the tables of poly and window_size, computing them on first use.
+ * They are kept until the process exits.
+ */
+static const struct rabin_tables *tables_get(u_int64_t poly,
+						unsigned int window_size)
+{
+	static std::mutex tables_mutex;
+	static struct rabin_tables *tables;
+	struct rabin_tables *t;
+
+	std::lock_guard<std::mutex> lock(tables_mutex);
+	for (t = tables; t; t = t->next) {
+		if (t->poly == poly && t->window_size == window_size) {
+			return t;
+		}
+	}
+	t = (struct rabin_tables *)malloc(sizeof(struct rabin_tables));
+	if (!t) {
+		return NULL;
+	}
+	t->poly = poly;
+	t->window_size = window_size;
+	calcT(t);
+	t->next = tables;
+	tables = t;
+	return t;
+}
+
 /**
  * Feed a new byte into the rabin sliding window and update 
  * the rabin fingerprint
@@ -162,25 +226,54 @@ static u_int64_t append8(rabinpoly_t *rp, u_int64_t p, u_char m)
  * Interface functions exposed by the library
  */
 
+int dedup_engine_find(const char *name)
+{
+	if (strcmp(name, "rabin") == 0) {
+		return DEDUP_ENGINE_RABIN;
+	}
+	if (strcmp(name, "gear") == 0) {
+		return DEDUP_ENGINE_GEAR;
+	}
+	return -1;
+}
+
 rabinpoly_t *rabin_init(unsigned int window_size,
 						unsigned int avg_segment_size, 
 						unsigned int min_segment_size,
 						unsigned int max_segment_size)
+{
+	return rabin_init_engine(DEDUP_ENGINE_RABIN, window_size,
+			avg_segment_size, min_segment_size, max_segment_size);
+}
+
+rabinpoly_t *rabin_init_engine(int engine,
+						unsigned int window_size,
+						unsigned int avg_segment_size,
+						unsigned int min_segment_size,
+						unsigned int max_segment_size)
 {
 	rabinpoly_t *rp;
 
 	if (!min_segment_size || !avg_segment_size || !max_segment_size ||
 		(min_segment_size > avg_segment_size) ||
-		(max_segment_size < avg_segment_size) ||
-		(window_size < DEFAULT_WINDOW_SIZE)) {
+		(max_segment_size < avg_segment_size)) {
+		return NULL;
+	}
+	/* the gear hash has no window of its own */
+	if (engine == DEDUP_ENGINE_GEAR) {
+		window_size = DEFAULT_WINDOW_SIZE;
+	} else if (engine != DEDUP_ENGINE_RABIN ||
+			window_size < DEFAULT_WINDOW_SIZE) {
 		return NULL;
 	}
 
-	rp = (rabinpoly_t *)malloc(sizeof(rabinpoly_t));
+	/* the window buffer lives right behind the handle */
+	rp = (rabinpoly_t *)malloc(sizeof(rabinpoly_t) + window_size);
 	if (!rp) {
 		return NULL;
 	}
 
+	rp->engine = engine;
 	rp->poly = FINGERPRINT_PT;
 	rp->window_size = window_size;;
 	rp->avg_segment_size = avg_segment_size;
@@ -191,30 +284,32 @@ rabinpoly_t *rabin_init(unsigned int window_size,
 	rp->fingerprint = 0;
 	rp->bufpos = -1;
 	rp->cur_seg_size = 0;
+	rp->buf = (u_char *)(rp + 1);
+	bzero ((char*) rp->buf, rp->window_size*sizeof (u_char));
 
-	calcT(rp);
+	if (engine == DEDUP_ENGINE_GEAR) {
+		gear_init(rp);
+		rp->next = gear_segment_next;
+		return rp;
+	}
 
-	rp->buf = (u_char *)malloc(rp->window_size*sizeof(u_char));
-	if (!rp->buf){
+	const struct rabin_tables *t = tables_get(rp->poly, rp->window_size);
+	if (!t) {
+		free(rp);
 		return NULL;
 	}
-	bzero ((char*) rp->buf, rp->window_size*sizeof (u_char));
+	rp->shift = t->shift;
+	rp->T = t->T;
+	rp->U = t->U;
+	rp->next = rabin_fixed_next(rp->window_size, rp->shift);
 	return rp;
 }
 
-int rabin_segment_next(rabinpoly_t *rp, 
-						const char *buf, 
-						unsigned int bytes,
+int rabin_generic_next(rabinpoly_t *rp, const char *buf, unsigned int bytes,
 						int *is_new_segment)
 {
 	unsigned int i;
 
-	if (!rp || !buf || !is_new_segment) {
-		return -1;
-	}
-
-	*is_new_segment = 0;
-    log_dedupe_compute_cost();
 	for (i = 0; i < bytes; i++) {
 		slide8(rp, buf[i]);
 		rp->cur_seg_size++;
@@ -234,6 +329,135 @@ int rabin_segment_next(rabinpoly_t *rp,
 	return i;
 }
 
+/*
+ * The Rabin loop for a window of W bytes and the shift S of the default
+ * polynomial, both known at compile time. The state is kept in locals,
+ * the ring index is masked when W is a power of two, and the bytes that
+ * cannot end a segment are slid without testing. Cuts exactly where
+ * rabin_generic_next does.
+ */
+#define SLIDE(m) do { \
+		pos = (W & (W - 1)) ? (pos + 1 == W ? 0 : pos + 1) : \
+				((pos + 1) & (W - 1)); \
+		u_char om = ring[pos]; \
+		ring[pos] = (m); \
+		fp ^= U[om]; \
+		fp = ((fp << 8) | (m)) ^ T[fp >> S]; \
+	} while (0)
+
+#define UNROLL 8
+
+template <unsigned int W, int S>
+static int rabin_fixed(rabinpoly_t *rp, const char *buf, unsigned int bytes,
+						int *is_new_segment)
+{
+	const u_char *p = (const u_char *) buf;
+	const u_int64_t *T = rp->T;
+	const u_int64_t *U = rp->U;
+	const u_int64_t mask = rp->fingerprint_mask;
+	u_char *ring = rp->buf;
+	u_int64_t fp = rp->fingerprint;
+	unsigned int pos = rp->bufpos;
+	unsigned int cur = rp->cur_seg_size;
+	unsigned int i = 0, end;
+
+	/* up to min_segment_size - 1 bytes in, no byte ends a segment */
+	if (cur + 1 < rp->min_segment_size) {
+		end = rp->min_segment_size - 1 - cur;
+		end = end < bytes ? end : bytes;
+		for (; i < end; i++) {
+			SLIDE(p[i]);
+		}
+		cur += end;
+	}
+
+	/* byte i ends a segment of i + 1 + base bytes */
+	unsigned int base = cur - i;
+	unsigned int max_end = rp->max_segment_size - base;
+	end = max_end < bytes ? max_end : bytes;
+
+	for (; i + UNROLL <= end; i += UNROLL) {
+		for (unsigned int k = 0; k < UNROLL; k++) {
+			SLIDE(p[i + k]);
+			if (!(fp & mask)) {
+				i += k;
+				goto cut;
+			}
+		}
+	}
+	for (; i < end; i++) {
+		SLIDE(p[i]);
+		if (!(fp & mask)) {
+			goto cut;
+		}
+	}
+	if (end == max_end) {
+		/* the segment reached max_segment_size */
+		i--;
+		goto cut;
+	}
+
+	rp->fingerprint = fp;
+	rp->bufpos = pos;
+	rp->cur_seg_size = i + base;
+	return i;
+
+cut:
+	*is_new_segment = 1;
+	rp->fingerprint = fp;
+	rp->bufpos = pos;
+	rp->cur_seg_size = 0;
+	return i + 1;
+}
+
+#undef SLIDE
+#undef UNROLL
+
+/* shift of FINGERPRINT_PT, which has its top bit set */
+#define DEFAULT_SHIFT (64 - 1 - 8)
+
+/**
+ * Picks the loop for a window size: a compiled-in one for the common
+ * sizes (48 is what cloudfs mounts with), the generic one otherwise.
+ */
+static segment_next_fn rabin_fixed_next(unsigned int window_size, int shift)
+{
+	if (shift != DEFAULT_SHIFT) {
+		return rabin_generic_next;
+	}
+	switch (window_size) {
+	case 32:
+		return rabin_fixed<32, DEFAULT_SHIFT>;
+	case 48:
+		return rabin_fixed<48, DEFAULT_SHIFT>;
+	case 64:
+		return rabin_fixed<64, DEFAULT_SHIFT>;
+	case 128:
+		return rabin_fixed<128, DEFAULT_SHIFT>;
+	case 256:
+		return rabin_fixed<256, DEFAULT_SHIFT>;
+	default:
+		return rabin_generic_next;
+	}
+}
+
+int rabin_segment_next(rabinpoly_t *rp, 
+						const char *buf, 
+						unsigned int bytes,
+						int *is_new_segment)
+{
+	unsigned int i;
+
+	if (!rp || !buf || !is_new_segment) {
+		return -1;
+	}
+
+	*is_new_segment = 0;
+	i = rp->next(rp, buf, bytes, is_new_segment);
+	stats_account(i, *is_new_segment);
+	return i;
+}
+
 void rabin_reset(rabinpoly_t *rp) { 
 	rp->fingerprint = 0; 
 	rp->bufpos = -1;
@@ -241,14 +465,48 @@ void rabin_reset(rabinpoly_t *rp) {
 	bzero ((char*) rp->buf, rp->window_size*sizeof (u_char));
 }
 
+void rabin_resume(rabinpoly_t *rp, const char *history, unsigned int bytes)
+{
+	unsigned int i;
+
+	rabin_reset(rp);
+	/* the gear hash starts over at every boundary anyway */
+	if (rp->engine == DEDUP_ENGINE_GEAR) {
+		return;
+	}
+	/* the fingerprint only depends on the last window_size bytes */
+	i = bytes > rp->window_size ? bytes - rp->window_size : 0;
+	for (; i < bytes; i++) {
+		slide8(rp, history[i]);
+	}
+}
+
+rabinpoly_t *rabin_dup(const rabinpoly_t *rp)
+{
+	return rabin_init_engine(rp->engine, rp->window_size,
+			rp->avg_segment_size, rp->min_segment_size, rp->max_segment_size);
+}
+
 void rabin_free(rabinpoly_t **p_rp)
 {
 	if (!p_rp || !*p_rp) {
 		return;
 	}
 
-	free((*p_rp)->buf);
 	free(*p_rp);
 	*p_rp = NULL;
 }
 
+void dedup_stats_get(dedup_stats_t *stats)
+{
+	stats->calls = stat_calls.load(std::memory_order_relaxed);
+	stats->bytes = stat_bytes.load(std::memory_order_relaxed);
+	stats->segments = stat_segments.load(std::memory_order_relaxed);
+}
+
+void dedup_stats_flush(void)
+{
+	stat_flushed.store(now_sec(), std::memory_order_relaxed);
+	stats_write();
+}
+
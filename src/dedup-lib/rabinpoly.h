@@ -29,6 +29,22 @@
 #include <string.h>
 #include "dedup.h"
 
+/*
+ * Lookup tables of a polynomial and window size. They never change once
+ * computed, so one copy is shared by all handles of the process.
+ */
+struct rabin_tables {
+	u_int64_t poly;
+	unsigned int window_size;
+	int shift;
+	u_int64_t T[256];		// Lookup table for mod
+	u_int64_t U[256];		// Lookup table for the byte leaving the window
+	struct rabin_tables *next;
+};
+
+typedef int (*segment_next_fn)(rabinpoly_t *rp, const char *buf,
+						unsigned int bytes, int *is_new_segment);
+
 struct rabinpoly {
 	u_int64_t poly;					// Actual polynomial
 	unsigned int window_size;		// in bytes
@@ -45,8 +61,23 @@ struct rabinpoly {
 	unsigned int cur_seg_size;	// tracks size of the current active segment 
 
   	int shift;
-	u_int64_t T[256];		// Lookup table for mod
-	u_int64_t U[256];
+	const u_int64_t *T;		// shared, see struct rabin_tables
+	const u_int64_t *U;
+
+	int engine;				// DEDUP_ENGINE_*
+	segment_next_fn next;	// the loop of the engine, picked by rabin_init
+	u_int64_t mask_small;	// gear: boundary test below avg_segment_size
+	u_int64_t mask_large;	// gear: boundary test from avg_segment_size on
+	const u_int64_t *G;		// gear: random value per byte, shared
 };
 
+/* The generic Rabin loop, for any window size */
+int rabin_generic_next(rabinpoly_t *rp, const char *buf, unsigned int bytes,
+						int *is_new_segment);
+
+/* The Gear/FastCDC engine (gear.cc) */
+void gear_init(rabinpoly_t *rp);
+int gear_segment_next(rabinpoly_t *rp, const char *buf, unsigned int bytes,
+						int *is_new_segment);
+
 #endif /* !_RABINPOLY_H_ */
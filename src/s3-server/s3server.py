@@ -20,6 +20,7 @@ import datetime
 import hashlib
 import os
 import os.path
+import re
 import subprocess
 import urllib
 import sys
@@ -271,12 +272,32 @@ class ObjectHandler(BaseRequestHandler):
         self.set_header("Content-Type", "application/unknown")
         self.set_header("Last-Modified", datetime.datetime.utcfromtimestamp(
             info.st_mtime))
-        tmon.num_read_bytes += os.path.getsize(path)
+        size = info.st_size
+        start, end = 0, size - 1
+        byte_range = self.request.headers.get("Range")
+        if byte_range is not None:
+            m = re.match(r'^bytes=(\d*)-(\d*)$', byte_range.strip())
+            if m is None or (m.group(1) == '' and m.group(2) == ''):
+                raise web.HTTPError(416)
+            if m.group(1) == '':
+                # suffix range: the last N bytes
+                start = max(size - int(m.group(2)), 0)
+            else:
+                start = int(m.group(1))
+                if m.group(2) != '':
+                    end = min(int(m.group(2)), size - 1)
+            if start >= size or start > end:
+                self.set_header("Content-Range", "bytes */%d" % size)
+                raise web.HTTPError(416)
+            self.set_status(206)
+            self.set_header("Content-Range", "bytes %d-%d/%d" % (start, end, size))
+        tmon.num_read_bytes += end - start + 1
         self.application.logger.debug(tmon.debug_out('GET'))
         object_file = open(path, "rb")
 
         try:
-            self.finish(object_file.read())
+            object_file.seek(start)
+            self.finish(object_file.read(end - start + 1))
         finally:
             object_file.close()
 
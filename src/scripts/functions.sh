@@ -123,7 +123,7 @@ function reinit_env()
 
 	$SCRIPTS_DIR/reset.sh 
 
-  nohup python $SCRIPTS_DIR/../s3-server/s3server.pyc > /dev/null 2>&1 &
+  nohup python $SCRIPTS_DIR/../s3-server/s3server.py > /dev/null 2>&1 &
   if [ $? -ne 0 ]; then
     echo "Unable to start S3 server"
     exit 1
@@ -1,3 +1,3 @@
 #!/bin/bash
 
-kill -15 `ps -lef | grep s3server.pyc | grep -v grep | awk '{print $4}'` > /dev/null 2>&1
+kill -15 `ps -lef | grep s3server.py | grep -v grep | awk '{print $4}'` > /dev/null 2>&1